@@ -0,0 +1,243 @@
+/**
+ * File: PciAcs.c
+ * Author: Matthew Millman
+ *
+ * ACS configuration for the switch downstream ports below the hot plug root
+ * ports, which decides whether peer-to-peer traffic turns around in a switch
+ * or is sent up to the root complex.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+//
+// ACS_POLICY_ISOLATE: Requests and completions between devices below the port are
+//                     redirected to the root complex, where the IOMMU can see them.
+// ACS_POLICY_P2P:     Peer-to-peer traffic turns around in the switch. Devices below
+//                     the switch end up in the same IOMMU group.
+// ACS_POLICY_LEAVE:   Don't touch whatever the port came up with.
+//
+#define ACS_POLICY_ISOLATE          0
+#define ACS_POLICY_P2P              1
+#define ACS_POLICY_LEAVE            2
+
+#define ACS_POLICY_DEFAULT          ACS_POLICY_ISOLATE
+
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 Policy;
+} ACS_POLICY;
+
+// Switch downstream ports which don't use ACS_POLICY_DEFAULT
+GLOBAL_REMOVE_IF_UNREFERENCED ACS_POLICY mAcsPolicies[] = {
+  { 0x05, 0x01, 0x00, ACS_POLICY_P2P },  // Thunderbolt port 1
+  { 0x05, 0x04, 0x00, ACS_POLICY_P2P }   // Thunderbolt port 2
+};
+
+#define PCIE_EXT_CAP_ID_ACS         0x000D
+#define ACS_CAPABILITY              0x04
+#define ACS_CONTROL                 0x06
+
+#define ACS_SOURCE_VALIDATION       BIT0
+#define ACS_REQUEST_REDIRECT        BIT2
+#define ACS_COMPLETION_REDIRECT     BIT3
+#define ACS_UPSTREAM_FORWARDING     BIT4
+
+#define ACS_P2P_CONTROLS            (ACS_REQUEST_REDIRECT | ACS_COMPLETION_REDIRECT | ACS_UPSTREAM_FORWARDING)
+
+/**
+  Get the ACS policy for a switch downstream port
+
+  @param  Port                The port
+
+  @retval (value)             ACS_POLICY_xxx
+**/
+UINT8 GetAcsPolicy(TopologyDevice *Port)
+{
+  UINTN Index;
+
+  for (Index = 0; Index < ARRAY_SIZE(mAcsPolicies); Index++)
+  {
+    if (mAcsPolicies[Index].Bus == Port->Bus && mAcsPolicies[Index].Device == Port->Device && mAcsPolicies[Index].Function == Port->Function)
+      return mAcsPolicies[Index].Policy;
+  }
+
+  return ACS_POLICY_DEFAULT;
+}
+
+/**
+  Check whether peer-to-peer requests and completions entering a port get
+  sent upstream rather than routed across the switch
+
+  @param  Port                Index of the switch downstream port
+
+  @retval TRUE                Traffic is redirected
+  @retval FALSE               Traffic can turn around in the switch
+**/
+BOOLEAN IsP2pRedirected(INT16 Port)
+{
+  TopologyDevice *Device = &gHotPlugTopology.Devices[Port];
+  UINT16 Offset = FindExtendedCapability(Device, PCIE_EXT_CAP_ID_ACS);
+
+  // No ACS means the port routes by address like any other bridge
+  if (Offset == 0)
+    return FALSE;
+
+  return (PciCfgRead16(Device->Bus, Device->Device, Device->Function, Offset + ACS_CONTROL) & (ACS_REQUEST_REDIRECT | ACS_COMPLETION_REDIRECT)) != 0;
+}
+
+/**
+  Find the switch downstream port directly below a switch upstream port on the
+  path from a device
+
+  @param  Index               Device to start from
+  @param  Switch              Index of the switch upstream port
+
+  @retval (value)             Index of the downstream port, -1 if the device isn't below the switch
+**/
+INT16 FindPortBelowSwitch(INT16 Index, INT16 Switch)
+{
+  for (; Index >= 0; Index = gHotPlugTopology.Devices[Index].Parent)
+  {
+    if (gHotPlugTopology.Devices[Index].Parent == Switch)
+      return Index;
+  }
+
+  return -1;
+}
+
+/**
+  Report which pairs of endpoints in a hot plug hierarchy can do peer-to-peer
+  DMA which turns around in a switch, and which pairs have to go via the root complex
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ReportP2pPairs(INT16 Root)
+{
+  TopologyDevice *A;
+  TopologyDevice *B;
+  INT16 Ancestor;
+  INT16 PortA;
+  INT16 PortB;
+  INT16 Switch;
+  UINTN IndexA;
+  UINTN IndexB;
+
+  for (IndexA = 0; IndexA < gHotPlugTopology.Count; IndexA++)
+  {
+    A = &gHotPlugTopology.Devices[IndexA];
+
+    if (A->Root != Root || !IsEndpoint(A))
+      continue;
+
+    for (IndexB = IndexA + 1; IndexB < gHotPlugTopology.Count; IndexB++)
+    {
+      B = &gHotPlugTopology.Devices[IndexB];
+
+      if (B->Root != Root || !IsEndpoint(B))
+        continue;
+
+      // Lowest switch both devices sit below, on different downstream ports
+      Switch = -1;
+      PortA = PortB = -1;
+
+      for (Ancestor = A->Parent; Ancestor >= 0 && Switch < 0; Ancestor = gHotPlugTopology.Devices[Ancestor].Parent)
+      {
+        INT16 Upstream = gHotPlugTopology.Devices[Ancestor].Parent;
+
+        if (Upstream < 0 || gHotPlugTopology.Devices[Upstream].PortType != PCIE_DEVICE_PORT_TYPE_UPSTREAM_PORT)
+          continue;
+
+        PortB = FindPortBelowSwitch((INT16)IndexB, Upstream);
+
+        if (PortB >= 0 && PortB != Ancestor)
+        {
+          Switch = Upstream;
+          PortA = Ancestor;
+        }
+      }
+
+      if (Switch < 0)
+      {
+        DEBUG((DEBUG_INFO, "ReportP2pPairs(): %02X:%02X.%X <-> %02X:%02X.%X via root complex (no common switch)\n",
+               A->Bus, A->Device, A->Function, B->Bus, B->Device, B->Function));
+      }
+      else if (IsP2pRedirected(PortA) || IsP2pRedirected(PortB))
+      {
+        DEBUG((DEBUG_INFO, "ReportP2pPairs(): %02X:%02X.%X <-> %02X:%02X.%X via root complex (ACS redirect)\n",
+               A->Bus, A->Device, A->Function, B->Bus, B->Device, B->Function));
+      }
+      else
+      {
+        DEBUG((DEBUG_INFO, "ReportP2pPairs(): %02X:%02X.%X <-> %02X:%02X.%X within switch %02X:%02X.%X\n",
+               A->Bus, A->Device, A->Function, B->Bus, B->Device, B->Function,
+               gHotPlugTopology.Devices[Switch].Bus, gHotPlugTopology.Devices[Switch].Device, gHotPlugTopology.Devices[Switch].Function));
+      }
+    }
+  }
+}
+
+/**
+  Program ACS P2P Request Redirect, Completion Redirect and Upstream Forwarding
+  on each switch downstream port of a hot plug hierarchy following its policy,
+  then report where peer-to-peer traffic ends up
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigureAcs(INT16 Root)
+{
+  TopologyDevice *Port;
+  UINT16 Capability;
+  UINT16 Control;
+  UINT16 NewControl;
+  UINT16 Offset;
+  UINT8 Policy;
+  UINTN Index;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Port = &gHotPlugTopology.Devices[Index];
+
+    if (Port->Root != Root || Port->PortType != PCIE_DEVICE_PORT_TYPE_DOWNSTREAM_PORT)
+      continue;
+
+    Policy = GetAcsPolicy(Port);
+    Offset = FindExtendedCapability(Port, PCIE_EXT_CAP_ID_ACS);
+
+    if (Offset == 0 || Policy == ACS_POLICY_LEAVE)
+      continue;
+
+    Capability = PciCfgRead16(Port->Bus, Port->Device, Port->Function, Offset + ACS_CAPABILITY);
+    Control = PciCfgRead16(Port->Bus, Port->Device, Port->Function, Offset + ACS_CONTROL);
+
+    if (Policy == ACS_POLICY_ISOLATE)
+      NewControl = Control | (Capability & (ACS_SOURCE_VALIDATION | ACS_P2P_CONTROLS));
+    else
+      NewControl = Control & ~ACS_P2P_CONTROLS;
+
+    if (NewControl != Control)
+      PciCfgWrite16(Port->Bus, Port->Device, Port->Function, Offset + ACS_CONTROL, NewControl);
+
+    DEBUG((DEBUG_INFO, "ConfigureAcs(): %02X:%02X.%X %a, control 0x%04x -> 0x%04x\n", Port->Bus, Port->Device, Port->Function,
+           (Policy == ACS_POLICY_ISOLATE) ? "isolate" : "P2P", Control, NewControl));
+  }
+
+  ReportP2pPairs(Root);
+}
@@ -0,0 +1,191 @@
+/**
+ * File: PciAer.c
+ * Author: Matthew Millman
+ *
+ * Collects AER error status from everything below the hot plug root ports,
+ * and publishes running counts as a configuration table.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+#define PCIE_EXT_CAP_ID_AER         0x0001
+#define AER_UNCORRECTABLE_STATUS    0x04
+#define AER_CORRECTABLE_STATUS      0x10
+
+#define AER_COR_RECEIVER_ERROR      BIT0
+#define AER_COR_BAD_TLP             BIT6
+#define AER_COR_BAD_DLLP            BIT7
+#define AER_COR_REPLAY_ROLLOVER     BIT8
+#define AER_COR_REPLAY_TIMEOUT      BIT12
+
+EFI_GUID gHotPlugAerTableGuid = {0x7C1E4A5D, 0x93B2, 0x4F0E, {0xB6, 0x41, 0x2D, 0x8A, 0x55, 0xE3, 0x19, 0xC7}};
+
+HOT_PLUG_AER_TABLE *mAerTable = NULL;
+
+/**
+  Find the counters for a device, adding an entry if it's new
+
+  @param  Device              Device to look up
+
+  @retval (pointer)           Counters for the device
+  @retval NULL                Table is full
+**/
+HOT_PLUG_AER_COUNTERS *FindAerCounters(TopologyDevice *Device)
+{
+  HOT_PLUG_AER_COUNTERS *Counters;
+  UINTN Index;
+
+  for (Index = 0; Index < mAerTable->Count; Index++)
+  {
+    Counters = &mAerTable->Devices[Index];
+
+    if (Counters->Bus == Device->Bus && Counters->Device == Device->Device && Counters->Function == Device->Function)
+      return Counters;
+  }
+
+  if (mAerTable->Count >= MAX_TOPOLOGY_DEVICES)
+    return NULL;
+
+  Counters = &mAerTable->Devices[mAerTable->Count++];
+  Counters->Bus = Device->Bus;
+  Counters->Device = Device->Device;
+  Counters->Function = Device->Function;
+  Counters->Depth = Device->Depth;
+
+  return Counters;
+}
+
+/**
+  Allocate the counters table and publish it, the first time round
+
+  @retval EFI_SUCCESS         Table ready
+  @retval other               Something went wrong.
+**/
+EFI_STATUS PublishAerTable()
+{
+  EFI_STATUS Status;
+
+  if (mAerTable != NULL)
+    return EFI_SUCCESS;
+
+  // Needs to outlive boot services so the OS can read it
+  Status = gBS->AllocatePool(EfiRuntimeServicesData, sizeof(HOT_PLUG_AER_TABLE), (VOID **)&mAerTable);
+
+  if (EFI_ERROR(Status))
+    return Status;
+
+  ZeroMem(mAerTable, sizeof(HOT_PLUG_AER_TABLE));
+  mAerTable->Signature = HOT_PLUG_AER_TABLE_SIGNATURE;
+  mAerTable->Revision = HOT_PLUG_AER_TABLE_REVISION;
+
+  Status = gBS->InstallConfigurationTable(&gHotPlugAerTableGuid, mAerTable);
+
+  if (EFI_ERROR(Status))
+  {
+    gBS->FreePool(mAerTable);
+    mAerTable = NULL;
+  }
+
+  return Status;
+}
+
+/**
+  Read and clear AER status for every device in the hot plug topology, and add
+  whatever was set to the counters. The status bits are sticky, so each bit
+  counts once per collection.
+**/
+VOID CollectAerErrors()
+{
+  HOT_PLUG_AER_COUNTERS *Counters;
+  TopologyDevice *Device;
+  UINT32 Correctable;
+  UINT32 Uncorrectable;
+  UINT16 Offset;
+  UINTN Index;
+  EFI_STATUS Status;
+
+  Status = PublishAerTable();
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "CollectAerErrors(): Couldn't publish table: %r\n", Status));
+    return;
+  }
+
+  mAerTable->Collections++;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+    Offset = FindExtendedCapability(Device, PCIE_EXT_CAP_ID_AER);
+
+    if (Offset == 0)
+      continue;
+
+    Correctable = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Offset + AER_CORRECTABLE_STATUS);
+    Uncorrectable = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Offset + AER_UNCORRECTABLE_STATUS);
+
+    // Surprise removal since the topology was built
+    if (Correctable == 0xFFFFFFFF)
+      continue;
+
+    // Write 1 to clear
+    if (Correctable != 0)
+      PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Offset + AER_CORRECTABLE_STATUS, Correctable);
+
+    if (Uncorrectable != 0)
+      PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Offset + AER_UNCORRECTABLE_STATUS, Uncorrectable);
+
+    Counters = FindAerCounters(Device);
+
+    if (Counters == NULL)
+      continue;
+
+    Counters->ReceiverErrors += (Correctable & AER_COR_RECEIVER_ERROR) ? 1 : 0;
+    Counters->BadTlp += (Correctable & AER_COR_BAD_TLP) ? 1 : 0;
+    Counters->BadDllp += (Correctable & AER_COR_BAD_DLLP) ? 1 : 0;
+    Counters->ReplayRollover += (Correctable & AER_COR_REPLAY_ROLLOVER) ? 1 : 0;
+    Counters->ReplayTimeout += (Correctable & AER_COR_REPLAY_TIMEOUT) ? 1 : 0;
+    Counters->Uncorrectable += (Uncorrectable != 0) ? 1 : 0;
+    Counters->LastCorrectable = Correctable;
+    Counters->LastUncorrectable = Uncorrectable;
+
+    if (Correctable != 0 || Uncorrectable != 0)
+    {
+      DEBUG((DEBUG_WARN, "CollectAerErrors(): %02X:%02X.%X correctable 0x%08x, uncorrectable 0x%08x\n",
+             Device->Bus, Device->Device, Device->Function, Correctable, Uncorrectable));
+    }
+  }
+}
+
+/**
+  Collect AER errors again just before boot, to catch anything which
+  happened while drivers were using the devices.
+
+  @param  Event               Event whose notification function is being invoked.
+  @param  Context             Not used.
+**/
+VOID EFIAPI OnReadyToBootCollectAer(IN EFI_EVENT Event, IN VOID *Context)
+{
+  gBS->CloseEvent(Event);
+
+  if (gHotPlugTopology.PciRootBridgeIo == NULL)
+    return;
+
+  CollectAerErrors();
+}
@@ -0,0 +1,307 @@
+/**
+ * File: PciBootDevice.c
+ * Author: Matthew Millman
+ *
+ * Puts the boot device first. The PCI device the last boot came from is
+ * remembered, connected as soon as PciBus has enumerated, and storage and
+ * network devices behind the hot plug ports are held back from everything
+ * else until ReadyToBoot, by a driver which claims them and does nothing.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+#include <Guid/GlobalVariable.h>
+#include <Library/PrintLib.h>
+
+//
+// BOOT_DEVICE_OTHERS_DEFER: Connect the held back devices at ReadyToBoot.
+// BOOT_DEVICE_OTHERS_SKIP:  Never connect them. They're left for the OS.
+//
+#define BOOT_DEVICE_OTHERS_DEFER    0
+#define BOOT_DEVICE_OTHERS_SKIP     1
+
+#define BOOT_DEVICE_OTHERS          BOOT_DEVICE_OTHERS_DEFER
+
+// Set to FALSE to connect in handle order, as before
+#define BOOT_DEVICE_FIRST           TRUE
+
+#define BOOT_DEVICE_VARIABLE        L"HotPlugBootDevice"
+
+#define MAX_HELD_DEVICES            32
+
+// Classes held back. Input and display stay, so the boot menu still works from a dock.
+GLOBAL_REMOVE_IF_UNREFERENCED UINT8 mHeldClasses[] = {
+  PCI_CLASS_MASS_STORAGE,
+  PCI_CLASS_NETWORK
+};
+
+EFI_STATUS EFIAPI BootDeferSupported(IN EFI_DRIVER_BINDING_PROTOCOL *This, IN EFI_HANDLE Controller, IN EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath);
+EFI_STATUS EFIAPI BootDeferStart(IN EFI_DRIVER_BINDING_PROTOCOL *This, IN EFI_HANDLE Controller, IN EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath);
+EFI_STATUS EFIAPI BootDeferStop(IN EFI_DRIVER_BINDING_PROTOCOL *This, IN EFI_HANDLE Controller, IN UINTN NumberOfChildren, IN EFI_HANDLE *ChildHandleBuffer);
+
+// Highest version, so it's asked before any real driver
+EFI_DRIVER_BINDING_PROTOCOL gBootDeferBinding = {
+    BootDeferSupported,
+    BootDeferStart,
+    BootDeferStop,
+    0xFFFFFFFF,
+    NULL,
+    NULL};
+
+STATIC EFI_HANDLE mBootDevice = NULL;
+STATIC BOOLEAN mBootDeviceLoaded = FALSE;
+STATIC BOOLEAN mHolding = FALSE;
+STATIC EFI_HANDLE mHeld[MAX_HELD_DEVICES];
+STATIC UINTN mHeldCount = 0;
+
+/**
+  Check whether a device is one to hold back until ReadyToBoot
+
+  @param  PciIo               The device
+
+  @retval TRUE                Hold it
+  @retval FALSE               Leave it alone
+**/
+BOOLEAN IsHeldDevice(EFI_PCI_IO_PROTOCOL *PciIo)
+{
+  UINTN Segment, Bus, Device, Function;
+  UINT8 ClassCode;
+  UINTN Index;
+
+  if (EFI_ERROR(PciIo->GetLocation(PciIo, &Segment, &Bus, &Device, &Function)))
+    return FALSE;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    if (gHotPlugTopology.Devices[Index].Bus == Bus && gHotPlugTopology.Devices[Index].Device == Device && gHotPlugTopology.Devices[Index].Function == Function)
+      break;
+  }
+
+  // Only devices below the hot plug ports
+  if (Index == gHotPlugTopology.Count || gHotPlugTopology.Devices[Index].Root < 0)
+    return FALSE;
+
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint8, PCI_CLASSCODE_OFFSET + 2, 1, &ClassCode);
+
+  for (Index = 0; Index < ARRAY_SIZE(mHeldClasses); Index++)
+  {
+    if (mHeldClasses[Index] == ClassCode)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+EFI_STATUS EFIAPI BootDeferSupported(IN EFI_DRIVER_BINDING_PROTOCOL *This, IN EFI_HANDLE Controller, IN EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath)
+{
+  EFI_PCI_IO_PROTOCOL *PciIo;
+
+  if (!mHolding || Controller == mBootDevice || mHeldCount == MAX_HELD_DEVICES)
+    return EFI_UNSUPPORTED;
+
+  if (EFI_ERROR(gBS->OpenProtocol(Controller, &gEfiPciIoProtocolGuid, (VOID **)&PciIo, This->DriverBindingHandle, Controller, EFI_OPEN_PROTOCOL_GET_PROTOCOL)))
+    return EFI_UNSUPPORTED;
+
+  return IsHeldDevice(PciIo) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+/**
+  Claim the device's PciIo, so no other driver can bind to it until it's let go
+**/
+EFI_STATUS EFIAPI BootDeferStart(IN EFI_DRIVER_BINDING_PROTOCOL *This, IN EFI_HANDLE Controller, IN EFI_DEVICE_PATH_PROTOCOL *RemainingDevicePath)
+{
+  EFI_PCI_IO_PROTOCOL *PciIo;
+  EFI_STATUS Status;
+
+  Status = gBS->OpenProtocol(Controller, &gEfiPciIoProtocolGuid, (VOID **)&PciIo, This->DriverBindingHandle, Controller, EFI_OPEN_PROTOCOL_BY_DRIVER);
+
+  if (EFI_ERROR(Status))
+    return Status;
+
+  mHeld[mHeldCount++] = Controller;
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI BootDeferStop(IN EFI_DRIVER_BINDING_PROTOCOL *This, IN EFI_HANDLE Controller, IN UINTN NumberOfChildren, IN EFI_HANDLE *ChildHandleBuffer)
+{
+  return gBS->CloseProtocol(Controller, &gEfiPciIoProtocolGuid, This->DriverBindingHandle, Controller);
+}
+
+/**
+  Work out which PCI device a boot option is on. Full device paths resolve
+  directly; short form hard drive paths are matched against the partition
+  signature of every block device.
+
+  @param  FilePath            Boot option device path
+
+  @retval (value)             PciIo handle, NULL if it can't be found
+**/
+EFI_HANDLE FindBootOptionPciDevice(EFI_DEVICE_PATH_PROTOCOL *FilePath)
+{
+  EFI_DEVICE_PATH_PROTOCOL *Remaining = FilePath;
+  EFI_DEVICE_PATH_PROTOCOL *Node;
+  HARDDRIVE_DEVICE_PATH *Wanted;
+  EFI_HANDLE *Handles;
+  EFI_HANDLE Found = NULL;
+  UINTN Count;
+  UINTN Index;
+
+  if (DevicePathType(FilePath) == ACPI_DEVICE_PATH)
+    return EFI_ERROR(gBS->LocateDevicePath(&gEfiPciIoProtocolGuid, &Remaining, &Found)) ? NULL : Found;
+
+  if (DevicePathType(FilePath) != MEDIA_DEVICE_PATH || DevicePathSubType(FilePath) != MEDIA_HARDDRIVE_DP)
+    return NULL;
+
+  Wanted = (HARDDRIVE_DEVICE_PATH *)FilePath;
+
+  if (EFI_ERROR(gBS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &Count, &Handles)))
+    return NULL;
+
+  for (Index = 0; Index < Count && Found == NULL; Index++)
+  {
+    for (Node = DevicePathFromHandle(Handles[Index]); Node != NULL && !IsDevicePathEnd(Node); Node = NextDevicePathNode(Node))
+    {
+      if (DevicePathType(Node) != MEDIA_DEVICE_PATH || DevicePathSubType(Node) != MEDIA_HARDDRIVE_DP)
+        continue;
+
+      if (((HARDDRIVE_DEVICE_PATH *)Node)->SignatureType == Wanted->SignatureType &&
+          CompareMem(((HARDDRIVE_DEVICE_PATH *)Node)->Signature, Wanted->Signature, sizeof(Wanted->Signature)) == 0)
+      {
+        Remaining = DevicePathFromHandle(Handles[Index]);
+
+        if (EFI_ERROR(gBS->LocateDevicePath(&gEfiPciIoProtocolGuid, &Remaining, &Found)))
+          Found = NULL;
+      }
+
+      break;
+    }
+  }
+
+  FreePool(Handles);
+  return Found;
+}
+
+/**
+  Remember the PCI device being booted from, and let go of the held devices.
+  Left open, so if the boot falls back to another option, the last one wins.
+
+  @param  Event               Event whose notification function is being invoked.
+  @param  Context             Not used.
+**/
+VOID EFIAPI OnReadyToBootRecordBootDevice(IN EFI_EVENT Event, IN VOID *Context)
+{
+  EFI_DEVICE_PATH_PROTOCOL *DevicePath;
+  EFI_DEVICE_PATH_PROTOCOL *Saved = NULL;
+  EFI_HANDLE Handle;
+  CHAR16 Name[sizeof("Boot####")];
+  UINT16 *BootCurrent;
+  UINT8 *Option;
+  UINTN Size;
+  UINTN Index;
+
+  if (mHolding)
+  {
+    mHolding = FALSE;
+
+    for (Index = 0; Index < mHeldCount; Index++)
+    {
+      gBS->DisconnectController(mHeld[Index], gBootDeferBinding.DriverBindingHandle, NULL);
+
+      if (BOOT_DEVICE_OTHERS == BOOT_DEVICE_OTHERS_DEFER)
+        gBS->ConnectController(mHeld[Index], NULL, NULL, TRUE);
+    }
+
+    DEBUG((DEBUG_INFO, "OnReadyToBootRecordBootDevice(): %a %u held device(s)\n",
+           BOOT_DEVICE_OTHERS == BOOT_DEVICE_OTHERS_DEFER ? "Connected" : "Skipped", mHeldCount));
+
+    mHeldCount = 0;
+  }
+
+  if (EFI_ERROR(GetEfiGlobalVariable2(L"BootCurrent", (VOID **)&BootCurrent, &Size)))
+    return;
+
+  UnicodeSPrint(Name, sizeof(Name), L"Boot%04X", *BootCurrent);
+  FreePool(BootCurrent);
+
+  if (EFI_ERROR(GetEfiGlobalVariable2(Name, (VOID **)&Option, &Size)))
+    return;
+
+  // EFI_LOAD_OPTION: Attributes, FilePathListLength, Description, FilePathList
+  Handle = FindBootOptionPciDevice((EFI_DEVICE_PATH_PROTOCOL *)(Option + sizeof(UINT32) + sizeof(UINT16) + StrSize((CHAR16 *)(Option + sizeof(UINT32) + sizeof(UINT16)))));
+  FreePool(Option);
+
+  if (Handle == NULL)
+    return;
+
+  DevicePath = DevicePathFromHandle(Handle);
+  GetVariable2(BOOT_DEVICE_VARIABLE, &gPciDxeShimVariableGuid, (VOID **)&Saved, &Size);
+
+  if (Saved == NULL || Size != GetDevicePathSize(DevicePath) || CompareMem(Saved, DevicePath, Size) != 0)
+  {
+    gRT->SetVariable(
+        BOOT_DEVICE_VARIABLE,
+        &gPciDxeShimVariableGuid,
+        EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+        GetDevicePathSize(DevicePath),
+        DevicePath);
+  }
+
+  if (Saved != NULL)
+    FreePool(Saved);
+}
+
+/**
+  Connect the last boot device as soon as PciBus has created its handle, then
+  start holding back the other storage and network devices behind the hot
+  plug ports. Called after each PciBus start.
+**/
+VOID ConnectBootDeviceFirst()
+{
+  EFI_DEVICE_PATH_PROTOCOL *DevicePath = NULL;
+  EFI_DEVICE_PATH_PROTOCOL *Remaining;
+  EFI_EVENT ReadyToBootEvent;
+  UINTN Size;
+
+  if (!BOOT_DEVICE_FIRST || mBootDevice != NULL)
+    return;
+
+  // Variables aren't necessarily up when the shim loads, so this waits for the first PciBus start
+  if (!mBootDeviceLoaded)
+  {
+    mBootDeviceLoaded = TRUE;
+    EfiCreateEventReadyToBootEx(TPL_CALLBACK, OnReadyToBootRecordBootDevice, NULL, &ReadyToBootEvent);
+  }
+
+  if (EFI_ERROR(GetVariable2(BOOT_DEVICE_VARIABLE, &gPciDxeShimVariableGuid, (VOID **)&DevicePath, &Size)))
+    return;
+
+  Remaining = DevicePath;
+
+  if (!EFI_ERROR(gBS->LocateDevicePath(&gEfiPciIoProtocolGuid, &Remaining, &mBootDevice)) && IsDevicePathEnd(Remaining))
+  {
+    DEBUG((DEBUG_INFO, "ConnectBootDeviceFirst(): Connecting last boot device first\n"));
+    gBS->ConnectController(mBootDevice, NULL, NULL, TRUE);
+
+    // Only hold the others back if the boot device is actually here
+    mHolding = TRUE;
+  }
+  else
+  {
+    mBootDevice = NULL;
+  }
+
+  FreePool(DevicePath);
+}
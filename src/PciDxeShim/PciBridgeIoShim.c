@@ -69,10 +69,12 @@ RootBridgeIoPollMem(
     OUT UINT64 *Result)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoPollMem()\n"));
   Status = OriginalProtocol->PollMem(OriginalProtocol, Width, Address, Mask, Value, Delay, Result);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_POLL_MEM, Start, AccessBytes(Width, 1));
   return Status;
 }
 
@@ -120,10 +122,12 @@ RootBridgeIoPollIo(
     OUT UINT64 *Result)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoPollIo()\n"));
   Status = OriginalProtocol->PollIo(OriginalProtocol, Width, Address, Mask, Value, Delay, Result);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_POLL_IO, Start, AccessBytes(Width, 1));
   return Status;
 }
 
@@ -164,10 +168,12 @@ RootBridgeIoMemRead(
     OUT VOID *Buffer)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoMemRead()\n"));
   Status = OriginalProtocol->Mem.Read(OriginalProtocol, Width, Address, Count, Buffer);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_MEM_READ, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -208,10 +214,12 @@ RootBridgeIoMemWrite(
     IN VOID *Buffer)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoMemWrite()\n"));
   Status = OriginalProtocol->Mem.Write(OriginalProtocol, Width, Address, Count, Buffer);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_MEM_WRITE, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -246,10 +254,12 @@ RootBridgeIoIoRead(
     OUT VOID *Buffer)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoIoRead()\n"));
   Status = OriginalProtocol->Io.Read(OriginalProtocol, Width, Address, Count, Buffer);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_IO_READ, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -284,10 +294,12 @@ RootBridgeIoIoWrite(
     IN VOID *Buffer)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoIoWrite()\n"));
   Status = OriginalProtocol->Io.Write(OriginalProtocol, Width, Address, Count, Buffer);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_IO_WRITE, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -332,10 +344,12 @@ RootBridgeIoCopyMem(
     IN UINTN Count)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoCopyMem()\n"));
   Status = OriginalProtocol->CopyMem(OriginalProtocol, Width, DestAddress, SrcAddress, Count);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_COPY_MEM, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -363,10 +377,31 @@ RootBridgeIoPciRead(
     IN OUT VOID *Buffer)
 {
   EFI_STATUS Status;
-  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol;
+  // The substitute lives inside its mapping, so there's no need to search for it
+  RootBridgeIoProtocolMapping *Mapping = BASE_CR(This, RootBridgeIoProtocolMapping, SubstitutedProtocol);
+  UINT64 Start = AsmReadTsc();
   //DEBUG((DEBUG_INFO, "RootBridgeIoPciRead()\n"));
-  Status = OriginalProtocol->Pci.Read(OriginalProtocol, Width, Address, Count, Buffer);
-  ASSERT_EFI_ERROR(Status);
+
+  if (PruneRead(Mapping, Width, Address, Count, Buffer) || ConfigCacheRead(Mapping, Width, Address, Count, Buffer))
+  {
+    RecordShimCall(PCI_SHIM_STAT_PCI_READ, Start, AccessBytes(Width, Count));
+    return EFI_SUCCESS;
+  }
+
+  Status = EcamAccess(Mapping, FALSE, Width, Address, Count, Buffer);
+
+  if (Status != EFI_SUCCESS)
+  {
+    OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
+    Status = OriginalProtocol->Pci.Read(OriginalProtocol, Width, Address, Count, Buffer);
+    ASSERT_EFI_ERROR(Status);
+  }
+
+  if (!EFI_ERROR(Status))
+    PruneSnoopRead(Mapping, Width, Address, Count, Buffer);
+
+  RecordShimCall(PCI_SHIM_STAT_PCI_READ, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -394,10 +429,25 @@ RootBridgeIoPciWrite(
     IN OUT VOID *Buffer)
 {
   EFI_STATUS Status;
-  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol;
+  // The substitute lives inside its mapping, so there's no need to search for it
+  RootBridgeIoProtocolMapping *Mapping = BASE_CR(This, RootBridgeIoProtocolMapping, SubstitutedProtocol);
+  UINT64 Start = AsmReadTsc();
   //DEBUG((DEBUG_INFO, "RootBridgeIoPciWrite()\n"));
-  Status = OriginalProtocol->Pci.Write(OriginalProtocol, Width, Address, Count, Buffer);
-  ASSERT_EFI_ERROR(Status);
+
+  ConfigCacheWrite(Mapping, Width, Address, Count);
+  PruneSnoopWrite(Mapping, Width, Address, Count, Buffer);
+
+  Status = EcamAccess(Mapping, TRUE, Width, Address, Count, Buffer);
+
+  if (Status != EFI_SUCCESS)
+  {
+    OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
+    Status = OriginalProtocol->Pci.Write(OriginalProtocol, Width, Address, Count, Buffer);
+    ASSERT_EFI_ERROR(Status);
+  }
+
+  RecordShimCall(PCI_SHIM_STAT_PCI_WRITE, Start, AccessBytes(Width, Count));
   return Status;
 }
 
@@ -433,10 +483,12 @@ RootBridgeIoMap(
     OUT VOID **Mapping)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoMap()\n"));
   Status = OriginalProtocol->Map(OriginalProtocol, Operation, HostAddress, NumberOfBytes, DeviceAddress, Mapping);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_MAP, Start, EFI_ERROR(Status) ? 0 : *NumberOfBytes);
   return Status;
 }
 
@@ -464,10 +516,12 @@ RootBridgeIoUnmap(
     IN VOID *Mapping)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoUnmap()\n"));
   Status = OriginalProtocol->Unmap(OriginalProtocol, Mapping);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_UNMAP, Start, 0);
   return Status;
 }
 
@@ -508,10 +562,12 @@ RootBridgeIoAllocateBuffer(
     IN UINT64 Attributes)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoAllocateBuffer()\n"));
   Status = OriginalProtocol->AllocateBuffer(OriginalProtocol, Type, MemoryType, Pages, HostAddress, Attributes);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_ALLOCATE_BUFFER, Start, EFI_ERROR(Status) ? 0 : EFI_PAGES_TO_SIZE(Pages));
   return Status;
 }
 
@@ -537,10 +593,12 @@ RootBridgeIoFreeBuffer(
     OUT VOID *HostAddress)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoFreeBuffer()\n"));
   Status = OriginalProtocol->FreeBuffer(OriginalProtocol, Pages, HostAddress);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_FREE_BUFFER, Start, EFI_PAGES_TO_SIZE(Pages));
   return Status;
 }
 
@@ -571,10 +629,12 @@ RootBridgeIoFlush(
     IN EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *This)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoFlush()\n"));
   Status = OriginalProtocol->Flush(OriginalProtocol);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_FLUSH, Start, 0);
   return Status;
 }
 
@@ -608,10 +668,12 @@ RootBridgeIoGetAttributes(
     OUT UINT64 *Attributes)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoGetAttributes()\n"));
   Status = OriginalProtocol->GetAttributes(OriginalProtocol, Supported, Attributes);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_GET_ATTRIBUTES, Start, 0);
   return Status;
 }
 
@@ -660,10 +722,12 @@ RootBridgeIoSetAttributes(
     IN OUT UINT64 *ResourceLength)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoSetAttributes()\n"));
   Status = OriginalProtocol->SetAttributes(OriginalProtocol, Attributes, ResourceBase, ResourceLength);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_SET_ATTRIBUTES, Start, 0);
   return Status;
 }
 
@@ -699,9 +763,11 @@ RootBridgeIoConfiguration(
     OUT VOID **Resources)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *OriginalProtocol = FindRootBridgeIoProtocolMappingBySubstitute(This);
   //DEBUG((DEBUG_INFO, "RootBridgeIoConfiguration()\n"));
   Status = OriginalProtocol->Configuration(OriginalProtocol, Resources);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_CONFIGURATION, Start, 0);
   return Status;
 }
@@ -0,0 +1,157 @@
+/**
+ * File: PciBulkRead.c
+ * Author: Matthew Millman
+ *
+ * Bulk config space reads. Requests are sorted by bus/device/function/offset,
+ * neighbouring ranges on the same function are merged, and each merged range
+ * goes through the substituted root bridge as one dword read, so whatever
+ * the root bridge path does (ECAM etc) applies to every caller.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+EFI_GUID gPciBulkReadProtocolGuid = {0x2D6F8B14, 0xC3A7, 0x4E59, {0x9B, 0x0E, 0x61, 0xF4, 0x3C, 0xA8, 0x75, 0xD2}};
+
+// Ranges closer than this on the same function are read as one
+#define BULK_READ_MERGE_GAP         16
+
+#define BULK_READ_KEY(Request) \
+  ((((UINT32)(Request)->Bus) << 20) | (((UINT32)(Request)->Device) << 15) | (((UINT32)(Request)->Function) << 12) | (Request)->Offset)
+
+STATIC UINT32 mSpan[SIZE_4KB / sizeof(UINT32)];
+
+/**
+  Read a list of config space ranges into one buffer
+
+  @param  This                  Protocol instance
+  @param  Count                 Number of requests
+  @param  Requests              Ranges to read, in any order
+  @param  BufferSize            Size of Buffer, must cover the sum of all lengths
+  @param  Buffer                Receives the data
+
+  @retval EFI_SUCCESS           All ranges read
+  @retval EFI_INVALID_PARAMETER A range runs past 4K, or is empty
+  @retval EFI_BUFFER_TOO_SMALL  Buffer can't hold everything
+  @retval other                 Root bridge read failed
+**/
+EFI_STATUS EFIAPI PciBulkRead(PCI_BULK_READ_PROTOCOL *This, UINTN Count, PCI_BULK_READ_REQUEST *Requests, UINTN BufferSize, VOID *Buffer)
+{
+  RootBridgeIoProtocolMapping *Mapping = BASE_CR(This, RootBridgeIoProtocolMapping, BulkRead);
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *RootBridgeIo = &Mapping->SubstitutedProtocol;
+  EFI_STATUS Status = EFI_SUCCESS;
+  PCI_BULK_READ_REQUEST *First;
+  UINTN *Order;
+  UINTN *Placement;
+  UINTN Total = 0;
+  UINTN Index;
+  UINTN Next;
+  UINTN Insert;
+  UINTN Start;
+  UINTN End;
+  UINTN Reads = 0;
+
+  if (Count == 0)
+    return EFI_SUCCESS;
+
+  if (Requests == NULL || Buffer == NULL)
+    return EFI_INVALID_PARAMETER;
+
+  Order = AllocatePool(Count * sizeof(UINTN) * 2);
+
+  if (Order == NULL)
+    return EFI_OUT_OF_RESOURCES;
+
+  Placement = Order + Count;
+
+  for (Index = 0; Index < Count; Index++)
+  {
+    if (Requests[Index].Length == 0 || Requests[Index].Offset + Requests[Index].Length > SIZE_4KB)
+    {
+      FreePool(Order);
+      return EFI_INVALID_PARAMETER;
+    }
+
+    Placement[Index] = Total;
+    Total += Requests[Index].Length;
+
+    // Insertion sort, callers usually hand these over nearly in order anyway
+    for (Insert = Index; Insert > 0 && BULK_READ_KEY(&Requests[Order[Insert - 1]]) > BULK_READ_KEY(&Requests[Index]); Insert--)
+      Order[Insert] = Order[Insert - 1];
+
+    Order[Insert] = Index;
+  }
+
+  if (Total > BufferSize)
+  {
+    FreePool(Order);
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  for (Index = 0; Index < Count; Index = Next)
+  {
+    First = &Requests[Order[Index]];
+    Start = First->Offset;
+    End = First->Offset + First->Length;
+
+    // Pull in everything else on this function that's close enough
+    for (Next = Index + 1; Next < Count; Next++)
+    {
+      PCI_BULK_READ_REQUEST *Request = &Requests[Order[Next]];
+
+      if (Request->Bus != First->Bus || Request->Device != First->Device || Request->Function != First->Function)
+        break;
+
+      if (Request->Offset > End + BULK_READ_MERGE_GAP)
+        break;
+
+      End = MAX(End, (UINTN)(Request->Offset + Request->Length));
+    }
+
+    Start &= ~3U;
+    End = ALIGN_VALUE(End, 4);
+
+    Status = RootBridgeIo->Pci.Read(RootBridgeIo, EfiPciWidthUint32,
+                                    EFI_PCI_ADDRESS(First->Bus, First->Device, First->Function, Start), (End - Start) / 4, mSpan);
+    Reads++;
+
+    if (EFI_ERROR(Status))
+      break;
+
+    for (; Index < Next; Index++)
+    {
+      PCI_BULK_READ_REQUEST *Request = &Requests[Order[Index]];
+      CopyMem((UINT8 *)Buffer + Placement[Order[Index]], (UINT8 *)mSpan + (Request->Offset - Start), Request->Length);
+    }
+  }
+
+  DEBUG((DEBUG_VERBOSE, "PciBulkRead(): %u request(s) in %u read(s)\n", Count, Reads));
+
+  FreePool(Order);
+  return Status;
+}
+
+/**
+  Fill in the bulk read protocol for a root bridge mapping
+
+  @param  Mapping             Root bridge mapping
+**/
+VOID InitializeBulkRead(RootBridgeIoProtocolMapping *Mapping)
+{
+  Mapping->BulkRead.Revision = PCI_BULK_READ_PROTOCOL_REVISION;
+  Mapping->BulkRead.Read = PciBulkRead;
+}
@@ -0,0 +1,75 @@
+/**
+ * File: PciBulkRead.h
+ * Author: Matthew Millman
+ *
+ * Bulk config space read protocol, installed by PciDxeShim alongside each
+ * substituted root bridge.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PCI_BULK_READ_H
+#define _PCI_BULK_READ_H
+
+#define PCI_BULK_READ_PROTOCOL_REVISION     1
+
+typedef struct _PCI_BULK_READ_PROTOCOL PCI_BULK_READ_PROTOCOL;
+
+//
+// One range to read. Data for each request is placed in the caller's buffer
+// straight after the previous request's, in list order.
+//
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 Reserved;
+  UINT16 Offset;
+  UINT16 Length;
+} PCI_BULK_READ_REQUEST;
+
+/**
+  Read a list of config space ranges into one buffer
+
+  @param  This                  Protocol instance
+  @param  Count                 Number of requests
+  @param  Requests              Ranges to read, in any order
+  @param  BufferSize            Size of Buffer, must cover the sum of all lengths
+  @param  Buffer                Receives the data
+
+  @retval EFI_SUCCESS           All ranges read
+  @retval EFI_INVALID_PARAMETER A range runs past 4K, or is empty
+  @retval EFI_BUFFER_TOO_SMALL  Buffer can't hold everything
+**/
+typedef
+EFI_STATUS
+(EFIAPI *PCI_BULK_READ)(
+    IN PCI_BULK_READ_PROTOCOL *This,
+    IN UINTN Count,
+    IN PCI_BULK_READ_REQUEST *Requests,
+    IN UINTN BufferSize,
+    OUT VOID *Buffer);
+
+struct _PCI_BULK_READ_PROTOCOL
+{
+  UINT32 Revision;
+  PCI_BULK_READ Read;
+};
+
+extern EFI_GUID gPciBulkReadProtocolGuid;
+
+#endif /* _PCI_BULK_READ_H */
@@ -0,0 +1,347 @@
+/**
+ * File: PciBusPrune.c
+ * Author: Matthew Millman
+ *
+ * Answers PciBus's probes for functions which can't exist without going
+ * anywhere near the hardware. Behind a root or downstream port only device 0
+ * can exist (unless ARI forwarding is on, in which case the ARI function
+ * chain says what's there), and functions 1-7 of a single function device
+ * are never there. Over a few Thunderbolt hops each of those probes costs
+ * microseconds.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+#define PCIE_EXT_CAP_ID_ARI         0x000E
+#define ARI_CAPABILITY              0x04
+#define ARI_CAP_NEXT_FUNCTION(x)    (((x) >> 8) & 0xFF)
+
+#define DEVCTL2_ARI_FORWARDING      BIT5
+
+/**
+  Read config space through the substituted root bridge, so the ECAM path applies
+**/
+UINT32 PruneCfgRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register)
+{
+  UINT32 Value = 0;
+  Mapping->SubstitutedProtocol.Pci.Read(&Mapping->SubstitutedProtocol, Width, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Value);
+  return Value;
+}
+
+/**
+  Find the PCI Express capability of a function
+
+  @retval (value)                 Offset of the capability, 0 if not found
+**/
+UINT8 PruneFindPcieCapability(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus, UINT8 Device, UINT8 Function)
+{
+  UINT8 Offset;
+  UINTN Limit;
+
+  if ((PruneCfgRead(Mapping, EfiPciWidthUint16, Bus, Device, Function, PCI_PRIMARY_STATUS_OFFSET) & EFI_PCI_STATUS_CAPABILITY) == 0)
+    return 0;
+
+  Offset = (UINT8)PruneCfgRead(Mapping, EfiPciWidthUint8, Bus, Device, Function, PCI_CAPBILITY_POINTER_OFFSET) & 0xFC;
+
+  for (Limit = 0; Offset != 0 && Limit < 48; Limit++)
+  {
+    if ((UINT8)PruneCfgRead(Mapping, EfiPciWidthUint8, Bus, Device, Function, Offset) == EFI_PCI_CAPABILITY_ID_PCIEXP)
+      return Offset;
+
+    Offset = (UINT8)PruneCfgRead(Mapping, EfiPciWidthUint8, Bus, Device, Function, Offset + 1) & 0xFC;
+  }
+
+  return 0;
+}
+
+/**
+  Fill in which functions exist on a bus behind an ARI forwarding port, by
+  following the ARI next function numbers from function 0
+
+  @param  Mapping             Root bridge mapping
+  @param  Bus                 Bus behind the port
+**/
+VOID WalkAriFunctions(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus)
+{
+  PRUNE_BUS *Entry = &Mapping->PruneBus[Bus];
+  UINT16 Function = 0;
+  UINT16 Offset;
+  UINT32 Header;
+  UINTN Limit;
+
+  ZeroMem(Entry->AriFunctions, sizeof(Entry->AriFunctions));
+
+  // Walk from function 0; it's already known to be there
+  do
+  {
+    Entry->AriFunctions[Function >> 3] |= (UINT8)(1 << (Function & 7));
+
+    for (Offset = PCIE_EXTENDED_CAPABILITY_BASE, Limit = 0; Offset >= PCIE_EXTENDED_CAPABILITY_BASE && Limit < 256; Limit++)
+    {
+      Header = PruneCfgRead(Mapping, EfiPciWidthUint32, Bus, (UINT8)(Function >> 3), (UINT8)(Function & 7), Offset);
+
+      if (Header == 0 || Header == 0xFFFFFFFF || (Header & 0xFFFF) == PCIE_EXT_CAP_ID_ARI)
+        break;
+
+      Offset = (UINT16)((Header >> 20) & 0xFFC);
+    }
+
+    // Not an ARI device, so it's an ordinary device 0 with up to eight functions
+    if ((Header & 0xFFFF) != PCIE_EXT_CAP_ID_ARI || Offset < PCIE_EXTENDED_CAPABILITY_BASE)
+    {
+      if (Function == 0)
+        Entry->AriFunctions[0] = 0xFF;
+
+      break;
+    }
+
+    Function = (UINT16)ARI_CAP_NEXT_FUNCTION(PruneCfgRead(Mapping, EfiPciWidthUint16, Bus, (UINT8)(Function >> 3), (UINT8)(Function & 7), Offset + ARI_CAPABILITY));
+
+  } while (Function != 0 && (Entry->AriFunctions[Function >> 3] & (1 << (Function & 7))) == 0);
+
+  Entry->Flags |= PRUNE_ARI_WALKED;
+}
+
+/**
+  Answer a config read with all ones if the function it's for can't exist
+
+  @param  Mapping             Root bridge mapping
+  @param  Width               Width of each access
+  @param  Address             EFI_PCI_ADDRESS style address
+  @param  Count               Number of accesses
+  @param  Buffer              Receives all ones
+
+  @retval TRUE                Answered
+  @retval FALSE               Needs a real read
+**/
+BOOLEAN PruneRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+  PRUNE_BUS *Entry = &Mapping->PruneBus[PciAddress->Bus];
+  UINT8 Device = PciAddress->Device;
+  UINT8 Function = PciAddress->Function;
+  BOOLEAN Absent = FALSE;
+
+  if (Width > EfiPciWidthUint64 || Buffer == NULL || Device > PCI_MAX_DEVICE || Function > PCI_MAX_FUNC)
+    return FALSE;
+
+  if ((Entry->Flags & PRUNE_ARI) != 0)
+  {
+    // Device and function together are the ARI function number
+    if ((Entry->Flags & PRUNE_ARI_WALKED) != 0)
+      Absent = (Entry->AriFunctions[Device] & (1 << Function)) == 0;
+  }
+  else
+  {
+    if ((Entry->Flags & PRUNE_LINK) != 0 && Device != 0)
+      Absent = TRUE;
+
+    if (Function != 0 && (Entry->SingleFunction[Device >> 3] & (1 << (Device & 7))) != 0)
+      Absent = TRUE;
+  }
+
+  if (!Absent)
+    return FALSE;
+
+  Mapping->PrunedCycles += Count;
+  SetMem(Buffer, Count << Width, 0xFF);
+  return TRUE;
+}
+
+/**
+  Pick up the vendor ID and header type of function 0 as PciBus reads them,
+  to learn which devices are single function
+
+  @param  Mapping             Root bridge mapping
+  @param  Width               Width of each access
+  @param  Address             EFI_PCI_ADDRESS style address
+  @param  Count               Number of accesses
+  @param  Buffer              What was read
+**/
+VOID PruneSnoopRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+  PRUNE_BUS *Entry = &Mapping->PruneBus[PciAddress->Bus];
+  UINT8 Device = PciAddress->Device;
+  UINT8 Bit = (UINT8)(1 << (Device & 7));
+  UINTN Start = PciAddress->Register;
+  UINTN End;
+  UINT8 *Data = (UINT8 *)Buffer;
+
+  if (Width > EfiPciWidthUint64 || PciAddress->Function != 0 || PciAddress->ExtendedRegister != 0 || Device > PCI_MAX_DEVICE)
+    return;
+
+  End = Start + (Count << Width);
+
+  // Gone, forget anything learnt about it
+  if (Start == PCI_VENDOR_ID_OFFSET && End >= 2 && *(UINT16 *)Data == 0xFFFF)
+  {
+    Entry->SingleFunction[Device >> 3] &= (UINT8)~Bit;
+
+    if (Device == 0)
+      Entry->Flags &= (UINT8)~PRUNE_ARI_WALKED;
+
+    return;
+  }
+
+  if (Start > PCI_HEADER_TYPE_OFFSET || End <= PCI_HEADER_TYPE_OFFSET)
+    return;
+
+  if ((Data[PCI_HEADER_TYPE_OFFSET - Start] & HEADER_TYPE_MULTI_FUNCTION) != 0)
+    Entry->SingleFunction[Device >> 3] &= (UINT8)~Bit;
+  else
+    Entry->SingleFunction[Device >> 3] |= Bit;
+
+  // New header for function 0 behind an ARI port, so work out the function chain again
+  if (Device == 0 && (Entry->Flags & PRUNE_ARI) != 0)
+  {
+    Entry->Flags &= (UINT8)~PRUNE_ARI_WALKED;
+    WalkAriFunctions(Mapping, PciAddress->Bus);
+  }
+}
+
+/**
+  Record what sits on a bridge's secondary bus, as its bus numbers are written
+
+  @param  Mapping             Root bridge mapping
+  @param  Bus                 Bridge bus
+  @param  Device              Bridge device
+  @param  Function            Bridge function
+  @param  Secondary           New secondary bus number
+**/
+VOID PruneClassifyBridge(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus, UINT8 Device, UINT8 Function, UINT8 Secondary)
+{
+  PRUNE_BUS *Entry;
+  UINT8 PcieCap;
+  UINT8 PortType;
+  UINTN Index;
+
+  // Whatever this bridge led to before, it doesn't now
+  for (Index = 0; Index <= PCI_MAX_BUS; Index++)
+  {
+    Entry = &Mapping->PruneBus[Index];
+
+    if ((Entry->Flags & PRUNE_LINK) != 0 && Entry->PortBus == Bus && Entry->PortDevice == Device && Entry->PortFunction == Function)
+      ZeroMem(Entry, sizeof(*Entry));
+  }
+
+  Entry = &Mapping->PruneBus[Secondary];
+  ZeroMem(Entry, sizeof(*Entry));
+
+  if (Secondary <= Bus)
+    return;
+
+  PcieCap = PruneFindPcieCapability(Mapping, Bus, Device, Function);
+
+  if (PcieCap == 0)
+    return;
+
+  PortType = (UINT8)((PruneCfgRead(Mapping, EfiPciWidthUint16, Bus, Device, Function, PcieCap + PCIE_REG_CAPABILITY) >> 4) & 0x0F);
+
+  if (PortType != PCIE_DEVICE_PORT_TYPE_ROOT_PORT && PortType != PCIE_DEVICE_PORT_TYPE_DOWNSTREAM_PORT)
+    return;
+
+  Entry->Flags = PRUNE_LINK;
+  Entry->PortBus = Bus;
+  Entry->PortDevice = Device;
+  Entry->PortFunction = Function;
+  Entry->PortPcieCap = PcieCap;
+
+  if ((PruneCfgRead(Mapping, EfiPciWidthUint16, Bus, Device, Function, PcieCap + PCIE_REG_DEVICE_CONTROL2) & DEVCTL2_ARI_FORWARDING) != 0)
+    Entry->Flags |= PRUNE_ARI;
+}
+
+/**
+  Keep track of bridge bus numbers and ARI forwarding as PciBus writes them
+
+  @param  Mapping             Root bridge mapping
+  @param  Width               Width of each access
+  @param  Address             EFI_PCI_ADDRESS style address
+  @param  Count               Number of accesses
+  @param  Buffer              What's being written
+**/
+VOID PruneSnoopWrite(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+  PRUNE_BUS *Entry;
+  UINTN Start = PciAddress->Register;
+  UINTN End;
+  UINTN Index;
+  UINT8 *Data = (UINT8 *)Buffer;
+
+  if (Width > EfiPciWidthUint64 || PciAddress->ExtendedRegister != 0 || Buffer == NULL)
+    return;
+
+  End = Start + (Count << Width);
+
+  if (Start <= PCI_BRIDGE_SECONDARY_BUS_REGISTER_OFFSET && End > PCI_BRIDGE_SECONDARY_BUS_REGISTER_OFFSET)
+  {
+    PruneClassifyBridge(Mapping, PciAddress->Bus, PciAddress->Device, PciAddress->Function, Data[PCI_BRIDGE_SECONDARY_BUS_REGISTER_OFFSET - Start]);
+    return;
+  }
+
+  // ARI forwarding being turned on or off on a port we know about
+  for (Index = 0; Index <= PCI_MAX_BUS; Index++)
+  {
+    Entry = &Mapping->PruneBus[Index];
+
+    if ((Entry->Flags & PRUNE_LINK) == 0 || Entry->PortBus != PciAddress->Bus || Entry->PortDevice != PciAddress->Device || Entry->PortFunction != PciAddress->Function)
+      continue;
+
+    if (Start > Entry->PortPcieCap + PCIE_REG_DEVICE_CONTROL2 || End <= Entry->PortPcieCap + PCIE_REG_DEVICE_CONTROL2)
+      break;
+
+    Entry->Flags &= (UINT8)~(PRUNE_ARI | PRUNE_ARI_WALKED);
+
+    if ((Data[Entry->PortPcieCap + PCIE_REG_DEVICE_CONTROL2 - Start] & DEVCTL2_ARI_FORWARDING) != 0)
+      Entry->Flags |= PRUNE_ARI;
+
+    break;
+  }
+}
+
+/**
+  Re-read ARI forwarding on every port being tracked, after the shim's own
+  tuning may have changed it behind the substituted root bridge's back, and
+  report how much pruning saved
+
+  @param  Mapping             Root bridge mapping
+**/
+VOID RefreshPruning(RootBridgeIoProtocolMapping *Mapping)
+{
+  PRUNE_BUS *Entry;
+  UINTN Index;
+
+  for (Index = 0; Index <= PCI_MAX_BUS; Index++)
+  {
+    Entry = &Mapping->PruneBus[Index];
+
+    if ((Entry->Flags & PRUNE_LINK) == 0)
+      continue;
+
+    Entry->Flags &= (UINT8)~(PRUNE_ARI | PRUNE_ARI_WALKED);
+
+    if ((PruneCfgRead(Mapping, EfiPciWidthUint16, Entry->PortBus, Entry->PortDevice, Entry->PortFunction, Entry->PortPcieCap + PCIE_REG_DEVICE_CONTROL2) & DEVCTL2_ARI_FORWARDING) != 0)
+    {
+      Entry->Flags |= PRUNE_ARI;
+
+      if (PruneCfgRead(Mapping, EfiPciWidthUint16, (UINT8)Index, 0, 0, PCI_VENDOR_ID_OFFSET) != 0xFFFF)
+        WalkAriFunctions(Mapping, (UINT8)Index);
+    }
+  }
+
+  DEBUG((DEBUG_INFO, "RefreshPruning(): %u config cycle(s) saved so far\n", Mapping->PrunedCycles));
+}
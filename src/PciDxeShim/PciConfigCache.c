@@ -0,0 +1,269 @@
+/**
+ * File: PciConfigCache.c
+ * Author: Matthew Millman
+ *
+ * Pre-scans the buses behind the hot plug root ports on every core once bus
+ * numbers are assigned, and remembers which functions aren't there. PciBus
+ * probes every slot on those buses again while collecting resources, and
+ * those probes are answered from here instead of timing out on the link.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+#include <Library/IoLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Protocol/MpService.h>
+
+// Give up on the APs after this long, and don't trust anything they found
+#define PRESCAN_TIMEOUT_US          500000
+
+#define ECAM_ADDRESS(Base, Bus, Device, Function, Register) \
+  ((Base) + (((UINT64)(Bus)) << 20) + (((UINT64)(Device)) << 15) + (((UINT64)(Function)) << 12) + (Register))
+
+typedef struct
+{
+  RootBridgeIoProtocolMapping *Mapping;
+  UINT8 Buses[PCI_MAX_BUS + 1];
+  UINT32 BusCount;
+  volatile UINT32 Next;
+} PRESCAN_CONTEXT;
+
+STATIC PRESCAN_CONTEXT mPrescan;
+
+/**
+  Record which functions on a bus are absent. Runs on the APs, so it touches
+  ECAM directly and nothing else.
+
+  @param  Mapping             Root bridge mapping
+  @param  Bus                 Bus to scan
+**/
+VOID PrescanBus(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus)
+{
+  UINTN Base;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 Absent;
+
+  for (Device = 0; Device <= PCI_MAX_DEVICE; Device++)
+  {
+    Base = (UINTN)ECAM_ADDRESS(Mapping->EcamBase, Bus, Device, 0, 0);
+
+    // No function 0, no device
+    if (MmioRead16(Base + PCI_VENDOR_ID_OFFSET) == 0xFFFF)
+    {
+      Mapping->AbsentMap[Bus][Device] = 0xFF;
+      continue;
+    }
+
+    // Functions of single function devices are only marked if they read back empty
+    if ((MmioRead8(Base + PCI_HEADER_TYPE_OFFSET) & HEADER_TYPE_MULTI_FUNCTION) == 0)
+      continue;
+
+    Absent = 0;
+
+    for (Function = 1; Function <= PCI_MAX_FUNC; Function++)
+    {
+      if (MmioRead16((UINTN)ECAM_ADDRESS(Mapping->EcamBase, Bus, Device, Function, PCI_VENDOR_ID_OFFSET)) == 0xFFFF)
+        Absent |= (UINT8)(1 << Function);
+    }
+
+    Mapping->AbsentMap[Bus][Device] = Absent;
+  }
+}
+
+/**
+  Take buses off the shared list until there are none left
+
+  @param  Buffer              PRESCAN_CONTEXT
+**/
+VOID EFIAPI PrescanBuses(IN VOID *Buffer)
+{
+  PRESCAN_CONTEXT *Context = (PRESCAN_CONTEXT *)Buffer;
+  UINT32 Slot;
+
+  while ((Slot = InterlockedIncrement(&Context->Next) - 1) < Context->BusCount)
+    PrescanBus(Context->Mapping, Context->Buses[Slot]);
+}
+
+/**
+  Throw away everything the cache knows
+
+  @param  Mapping             Root bridge mapping
+**/
+VOID InvalidateConfigCache(RootBridgeIoProtocolMapping *Mapping)
+{
+  if (!Mapping->CacheValid)
+    return;
+
+  Mapping->CacheValid = FALSE;
+  ZeroMem(Mapping->AbsentMap, sizeof(Mapping->AbsentMap));
+
+  DEBUG((DEBUG_INFO, "InvalidateConfigCache(): %u read(s) answered from the cache\n", Mapping->CacheHits));
+}
+
+/**
+  Scan every bus behind the hot plug root ports, across all cores, and fill in
+  the absent function cache. Called once bus numbers are assigned.
+
+  @param  Mapping             Root bridge mapping
+**/
+VOID PrescanHotPlugBuses(RootBridgeIoProtocolMapping *Mapping)
+{
+  EFI_MP_SERVICES_PROTOCOL *MpServices;
+  EFI_STATUS Status;
+  TopologyDevice *Port;
+  UINTN Processors = 1;
+  UINTN Enabled = 1;
+  UINTN Index;
+  UINTN Bus;
+  UINT64 Start;
+  UINT64 Elapsed = 0;
+  BOOLEAN OnBsp = FALSE;
+
+  InvalidateConfigCache(Mapping);
+
+  if (!Mapping->EcamProbed)
+    InitializeEcam(Mapping);
+
+  // The APs can't call the root bridge, so no ECAM means no prescan
+  if (!Mapping->EcamEnabled)
+    return;
+
+  if (gHotPlugTopology.PciRootBridgeIo != Mapping->OriginalProtocol && EFI_ERROR(BuildHotPlugTopology(Mapping->OriginalProtocol)))
+    return;
+
+  mPrescan.Mapping = Mapping;
+  mPrescan.BusCount = 0;
+  mPrescan.Next = 0;
+
+  // Everything from the secondary bus to the end of the padding
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Port = &gHotPlugTopology.Devices[Index];
+
+    if (Port->Parent >= 0 || Port->SecondaryBus <= Port->Bus)
+      continue;
+
+    for (Bus = Port->SecondaryBus; Bus <= Port->SubordinateBus; Bus++)
+    {
+      if (Bus >= Mapping->EcamStartBus && Bus <= Mapping->EcamEndBus)
+        mPrescan.Buses[mPrescan.BusCount++] = (UINT8)Bus;
+    }
+  }
+
+  if (mPrescan.BusCount == 0)
+    return;
+
+  // The APs trust ECAM blindly, so every bus is checked here first
+  for (Index = 0; Index < mPrescan.BusCount; Index++)
+  {
+    if (!CheckEcamBus(Mapping, mPrescan.Buses[Index]))
+      return;
+  }
+
+  ZeroMem(Mapping->AbsentMap, sizeof(Mapping->AbsentMap));
+
+  Status = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID **)&MpServices);
+
+  if (!EFI_ERROR(Status))
+  {
+    MpServices->GetNumberOfProcessors(MpServices, &Processors, &Enabled);
+    Start = AsmReadTsc();
+    Status = MpServices->StartupAllAPs(MpServices, PrescanBuses, FALSE, NULL, PRESCAN_TIMEOUT_US, &mPrescan, NULL);
+    Elapsed = TscToMicroseconds(AsmReadTsc() - Start);
+  }
+
+  // No APs to help, so do it here
+  if (EFI_ERROR(Status) && Status != EFI_TIMEOUT)
+  {
+    OnBsp = TRUE;
+    Start = AsmReadTsc();
+    PrescanBuses(&mPrescan);
+    Elapsed = TscToMicroseconds(AsmReadTsc() - Start);
+    Status = EFI_SUCCESS;
+  }
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "PrescanHotPlugBuses(): APs didn't finish in %lu us: %r\n", Elapsed, Status));
+    ZeroMem(Mapping->AbsentMap, sizeof(Mapping->AbsentMap));
+    return;
+  }
+
+  Mapping->CacheHits = 0;
+  Mapping->CacheValid = TRUE;
+
+  // Scan time against processor count shows whether spreading the buses pays off
+  if (OnBsp)
+    DEBUG((DEBUG_INFO, "PrescanHotPlugBuses(): %u bus(es) on the BSP in %lu us\n", mPrescan.BusCount, Elapsed));
+  else
+    DEBUG((DEBUG_INFO, "PrescanHotPlugBuses(): %u bus(es) on %u AP(s) in %lu us\n", mPrescan.BusCount, Enabled - 1, Elapsed));
+}
+
+/**
+  Answer a config read from the cache, if it's for a function known not to
+  be there
+
+  @param  Mapping             Root bridge mapping
+  @param  Width               Width of each access
+  @param  Address             EFI_PCI_ADDRESS style address
+  @param  Count               Number of accesses
+  @param  Buffer              Receives all ones
+
+  @retval TRUE                Answered
+  @retval FALSE               Needs a real read
+**/
+BOOLEAN ConfigCacheRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+
+  if (!Mapping->CacheValid || Width > EfiPciWidthUint64 || Buffer == NULL)
+    return FALSE;
+
+  if (PciAddress->Device > PCI_MAX_DEVICE || PciAddress->Function > PCI_MAX_FUNC)
+    return FALSE;
+
+  if ((Mapping->AbsentMap[PciAddress->Bus][PciAddress->Device] & (1 << PciAddress->Function)) == 0)
+    return FALSE;
+
+  Mapping->CacheHits++;
+  SetMem(Buffer, Count << Width, 0xFF);
+  return TRUE;
+}
+
+/**
+  Drop the cache when a bridge's bus numbers change, since functions could
+  turn up anywhere after that
+
+  @param  Mapping             Root bridge mapping
+  @param  Width               Width of each access
+  @param  Address             EFI_PCI_ADDRESS style address
+  @param  Count               Number of accesses
+**/
+VOID ConfigCacheWrite(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+  UINTN Start;
+  UINTN End;
+
+  if (!Mapping->CacheValid || PciAddress->ExtendedRegister != 0)
+    return;
+
+  Start = PciAddress->Register;
+  End = Start + Count * ((UINTN)1 << (Width & 0x03));
+
+  if (Start <= PCI_BRIDGE_SUBORDINATE_BUS_REGISTER_OFFSET && End > PCI_BRIDGE_PRIMARY_BUS_REGISTER_OFFSET)
+    InvalidateConfigCache(Mapping);
+}
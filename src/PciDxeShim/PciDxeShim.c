@@ -58,6 +58,7 @@ EFI_STATUS DumpInstalledDevices(IN EFI_DRIVER_BINDING_PROTOCOL *BindingProtocol,
 EFI_STATUS EFIAPI PciDxeShimMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
 {
   EFI_STATUS Status;
+  EFI_EVENT ReadyToBootEvent;
   SerialPortInitialize();
 
   DEBUG((DEBUG_INFO, "PciDxeShim: Starting up\n"));
@@ -76,6 +77,24 @@ EFI_STATUS EFIAPI PciDxeShimMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE
 
   ASSERT_EFI_ERROR(Status);
 
+  Status = EfiCreateEventReadyToBootEx(TPL_CALLBACK, OnReadyToBootCollectAer, NULL, &ReadyToBootEvent);
+
+  ASSERT_EFI_ERROR(Status);
+
+  Status = gBS->InstallMultipleProtocolInterfaces(
+      &ImageHandle,
+      &gPciHotPlugRescanProtocolGuid, &gPciHotPlugRescan,
+      &gEfiPciOverrideProtocolGuid, &gPciOpRomOverride,
+      &gPciShimStatsProtocolGuid, &gPciShimStats,
+      NULL);
+
+  ASSERT_EFI_ERROR(Status);
+
+  // Its own handle, so it can be disconnected from the held devices on its own
+  Status = EfiLibInstallDriverBinding(ImageHandle, SystemTable, &gBootDeferBinding, NULL);
+
+  ASSERT_EFI_ERROR(Status);
+
   DEBUG((DEBUG_INFO, "PciDxeShim: Startup complete\n"));
 
   return EFI_SUCCESS;
@@ -122,9 +141,12 @@ EFI_STATUS InstallRootBridgeIoProtocolProtocol(EFI_DRIVER_BINDING_PROTOCOL *This
   newIoMapping->SubstitutedProtocol.SetAttributes = RootBridgeIoSetAttributes;
   newIoMapping->SubstitutedProtocol.Configuration = RootBridgeIoConfiguration;
 
+  InitializeBulkRead(newIoMapping);
+
   Status = gBS->InstallMultipleProtocolInterfaces(
       &Controller,
       &gPciRootBridgeIoProtocolGuidSubstituteGuid, &newIoMapping->SubstitutedProtocol,
+      &gPciBulkReadProtocolGuid, &newIoMapping->BulkRead,
       NULL);
 
   ASSERT_EFI_ERROR(Status);
@@ -151,7 +173,10 @@ EFI_STATUS UninstallRootBridgeIoProtocolProtocol(EFI_HANDLE Controller, RootBrid
 
   DEBUG((DEBUG_INFO, "UninstallRootBridgeIoProtocolProtocol()\n"));
 
-  Status = gBS->UninstallMultipleProtocolInterfaces(Controller, &gPciRootBridgeIoProtocolGuidSubstituteGuid, &rootBridgeIoProtocolMapping->SubstitutedProtocol, NULL);
+  Status = gBS->UninstallMultipleProtocolInterfaces(Controller,
+      &gPciRootBridgeIoProtocolGuidSubstituteGuid, &rootBridgeIoProtocolMapping->SubstitutedProtocol,
+      &gPciBulkReadProtocolGuid, &rootBridgeIoProtocolMapping->BulkRead,
+      NULL);
 
   ASSERT_EFI_ERROR(Status);
 
@@ -478,6 +503,9 @@ PciBusDriverBindingStart(
 
   DumpInstalledDevices(This, Controller);
 
+  if (!EFI_ERROR(Status))
+    ConnectBootDeviceFirst();
+
   ASSERT_EFI_ERROR(Status);
   return Status;
 }
@@ -744,3 +772,54 @@ EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *FindResourceAllocationProtocol
 
   return NULL;
 }
+
+/**
+  Find the root bridge I/O protocol mapping which belongs to a substitute
+  resource allocation protocol.
+
+  @param  Substitute          Pointer to a substitute protocol.
+
+  @retval (pointer)           Pointer to the mapping.
+  @retval NULL                No mapping found.
+
+**/
+RootBridgeIoProtocolMapping *FindRootBridgeIoMappingByResourceAllocation(EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *Substitute)
+{
+  LIST_ENTRY *mappingEntry;
+
+  for (mappingEntry = GetFirstNode(&RootBridgeIoProtocolList); !IsNull(&RootBridgeIoProtocolList, mappingEntry); mappingEntry = GetNextNode(&RootBridgeIoProtocolList, mappingEntry))
+  {
+    RootBridgeIoProtocolMapping *mapping = (RootBridgeIoProtocolMapping *)mappingEntry;
+
+    if (&mapping->Parent->SubstitutedProtocol == Substitute)
+      return mapping;
+  }
+
+  DEBUG((DEBUG_ERROR, "FindRootBridgeIoMappingByResourceAllocation(): Failed to find mapping\n"));
+
+  return NULL;
+}
+
+/**
+  Find the root bridge I/O protocol mapping for a root bridge handle.
+
+  @param  RootBridgeHandle    Handle the root bridge I/O protocol is installed on.
+
+  @retval (pointer)           Pointer to the mapping.
+  @retval NULL                No mapping found.
+
+**/
+RootBridgeIoProtocolMapping *FindRootBridgeIoMappingByHandle(EFI_HANDLE RootBridgeHandle)
+{
+  LIST_ENTRY *mappingEntry;
+
+  for (mappingEntry = GetFirstNode(&RootBridgeIoProtocolList); !IsNull(&RootBridgeIoProtocolList, mappingEntry); mappingEntry = GetNextNode(&RootBridgeIoProtocolList, mappingEntry))
+  {
+    RootBridgeIoProtocolMapping *mapping = (RootBridgeIoProtocolMapping *)mappingEntry;
+
+    if (mapping->Controller == RootBridgeHandle)
+      return mapping;
+  }
+
+  return NULL;
+}
@@ -30,6 +30,11 @@
 #include "Bus/Pci/PciHostBridgeDxe/PciHostBridge.h"
 
 #include <Library/SerialPortLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+
+#include "PciBulkRead.h"
+#include "PciHotPlugRescan.h"
+#include "PciShimStats.h"
 
 typedef struct
 {
@@ -39,6 +44,24 @@ typedef struct
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL SubstitutedProtocol;
 } ResourceAllocationProtocolMapping;
 
+//
+// What's known about one bus, for answering probes of functions that can't exist
+//
+#define PRUNE_LINK                  BIT0    // Secondary bus of a root or downstream port
+#define PRUNE_ARI                   BIT1    // ... with ARI forwarding enabled
+#define PRUNE_ARI_WALKED            BIT2    // AriFunctions is filled in
+
+typedef struct
+{
+  UINT8 Flags;          // PRUNE_xxx
+  UINT8 PortBus;        // Root or downstream port above the bus
+  UINT8 PortDevice;
+  UINT8 PortFunction;
+  UINT8 PortPcieCap;
+  UINT8 SingleFunction[(PCI_MAX_DEVICE + 1) / 8];    // Function 0 read without the multi-function bit
+  UINT8 AriFunctions[PCI_MAX_DEVICE + 1];            // Functions on the ARI chain
+} PRUNE_BUS;
+
 typedef struct
 {
   LIST_ENTRY Link;
@@ -49,8 +72,159 @@ typedef struct
   EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL SubstitutedProtocol;
   BOOLEAN IsOpen;
   ResourceAllocationProtocolMapping *Parent;
+  BOOLEAN EcamProbed;
+  BOOLEAN EcamEnabled;
+  UINT8 EcamStartBus;
+  UINT8 EcamEndBus;
+  UINT64 EcamBase;
+  UINT8 EcamCheckedBuses[(PCI_MAX_BUS + 1) / 8];
+  PCI_BULK_READ_PROTOCOL BulkRead;
+  BOOLEAN CacheValid;
+  UINTN CacheHits;
+  UINT8 AbsentMap[PCI_MAX_BUS + 1][PCI_MAX_DEVICE + 1];
+  UINTN PrunedCycles;
+  PRUNE_BUS PruneBus[PCI_MAX_BUS + 1];
 } RootBridgeIoProtocolMapping;
 
+//
+// PCI Express capability registers, relative to the start of the capability
+//
+#define PCIE_REG_CAPABILITY               0x02
+#define PCIE_REG_DEVICE_CAPABILITY        0x04
+#define PCIE_REG_DEVICE_CONTROL           0x08
+#define PCIE_REG_DEVICE_STATUS            0x0A
+#define PCIE_REG_LINK_CAPABILITY          0x0C
+#define PCIE_REG_LINK_CONTROL             0x10
+#define PCIE_REG_LINK_STATUS              0x12
+#define PCIE_REG_DEVICE_CAPABILITY2       0x24
+#define PCIE_REG_DEVICE_CONTROL2          0x28
+#define PCIE_REG_LINK_CAPABILITY2         0x2C
+#define PCIE_REG_LINK_CONTROL2            0x30
+
+#define PCIE_EXTENDED_CAPABILITY_BASE     0x100
+
+#define MAX_TOPOLOGY_DEVICES              64
+
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 HeaderType;
+  UINT8 PcieCap;        // Offset of the PCI Express capability, 0 if there isn't one
+  UINT8 PortType;       // PCIE_DEVICE_PORT_TYPE_xxx
+  UINT8 SecondaryBus;   // Bridges only
+  UINT8 SubordinateBus; // Bridges only
+  UINT8 Depth;          // 0 for the hot plug root port itself
+  INT16 Parent;         // Index of the upstream bridge, -1 for a hot plug root port
+  INT16 Root;           // Index of the hot plug root port this device sits under
+  EFI_DEVICE_PATH_PROTOCOL *HpcDevicePath; // Hot plug root ports only
+} TopologyDevice;
+
+//
+// Everything at and below the hot plug root ports, in scan order.
+// A parent always comes before its children.
+//
+typedef struct
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo; // Original protocol, so our own accesses aren't shimmed
+  UINTN Count;
+  TopologyDevice Devices[MAX_TOPOLOGY_DEVICES];
+} HotPlugTopology;
+
+extern HotPlugTopology gHotPlugTopology;
+
+//
+// AER counters, published as a configuration table under gHotPlugAerTableGuid.
+// Each counter is the number of collections in which that error was seen.
+//
+#define HOT_PLUG_AER_TABLE_SIGNATURE      SIGNATURE_32('T', 'B', 'A', 'E')
+#define HOT_PLUG_AER_TABLE_REVISION       1
+
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 Depth;
+  UINT16 ReceiverErrors;
+  UINT16 BadTlp;
+  UINT16 BadDllp;
+  UINT16 ReplayRollover;
+  UINT16 ReplayTimeout;
+  UINT16 Uncorrectable;
+  UINT32 LastCorrectable;
+  UINT32 LastUncorrectable;
+} HOT_PLUG_AER_COUNTERS;
+
+typedef struct
+{
+  UINT32 Signature;
+  UINT16 Revision;
+  UINT16 Collections;
+  UINT32 Count;
+  HOT_PLUG_AER_COUNTERS Devices[MAX_TOPOLOGY_DEVICES];
+} HOT_PLUG_AER_TABLE;
+
+extern EFI_GUID gHotPlugAerTableGuid;
+extern EFI_GUID gPciDxeShimVariableGuid;
+extern PCI_HOT_PLUG_RESCAN_PROTOCOL gPciHotPlugRescan;
+extern LIST_ENTRY RootBridgeIoProtocolList;
+extern EFI_PCI_OVERRIDE_PROTOCOL gPciOpRomOverride;
+extern EFI_DRIVER_BINDING_PROTOCOL gBootDeferBinding;
+extern PCI_SHIM_STATS_PROTOCOL gPciShimStats;
+
+EFI_STATUS BuildHotPlugTopology(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo);
+UINT8 PciCfgRead8(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register);
+UINT16 PciCfgRead16(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register);
+UINT32 PciCfgRead32(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register);
+VOID PciCfgWrite16(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register, UINT16 Value);
+VOID PciCfgWrite32(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register, UINT32 Value);
+UINT16 PcieCapRead16(TopologyDevice *Device, UINT8 Register);
+UINT32 PcieCapRead32(TopologyDevice *Device, UINT8 Register);
+VOID PcieCapWrite16(TopologyDevice *Device, UINT8 Register, UINT16 Value);
+UINT16 FindExtendedCapability(TopologyDevice *Device, UINT16 CapabilityId);
+BOOLEAN IsEndpoint(TopologyDevice *Device);
+UINT64 SizeMemoryBar(TopologyDevice *Device, UINTN *BarIndex, UINT64 *Base, BOOLEAN *Prefetchable);
+
+VOID TuneHotPlugHierarchies(RootBridgeIoProtocolMapping *Mapping);
+VOID ConfigureLinkPower(INT16 Root);
+VOID VerifyLinkTraining(INT16 Root);
+VOID ConfigurePtm(INT16 Root);
+VOID ConfigureAcs(INT16 Root);
+VOID AlignForLargePages(VOID *Configuration);
+VOID ReportLargePageMappable(INT16 Root);
+VOID ApplyWriteCombining();
+VOID InitializeBulkRead(RootBridgeIoProtocolMapping *Mapping);
+VOID InitializeEcam(RootBridgeIoProtocolMapping *Mapping);
+BOOLEAN CheckEcamBus(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus);
+VOID PrescanHotPlugBuses(RootBridgeIoProtocolMapping *Mapping);
+VOID InvalidateConfigCache(RootBridgeIoProtocolMapping *Mapping);
+BOOLEAN ConfigCacheRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer);
+VOID ConfigCacheWrite(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count);
+BOOLEAN PruneRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer);
+VOID PruneSnoopRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer);
+VOID PruneSnoopWrite(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer);
+VOID RefreshPruning(RootBridgeIoProtocolMapping *Mapping);
+UINT32 PruneCfgRead(RootBridgeIoProtocolMapping *Mapping, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register);
+VOID PrepareAriHierarchy(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus, UINT8 Device, UINT8 Function);
+EFI_STATUS EcamAccess(RootBridgeIoProtocolMapping *Mapping, BOOLEAN Write, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer);
+VOID CollectAerErrors();
+VOID ResizeHotPlugBars(RootBridgeIoProtocolMapping *Mapping);
+VOID RestoreResizedBars();
+VOID ClearReBarFallback();
+VOID ConnectBootDeviceFirst();
+VOID SaveHotPlugS3State();
+UINT64 AccessBytes(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINTN Count);
+VOID RecordShimCall(UINTN Method, UINT64 Start, UINT64 Bytes);
+VOID RecordShimPhase(EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE Phase);
+UINT64 TscToMicroseconds(UINT64 Ticks);
+VOID EFIAPI OnReadyToBootCollectAer(IN EFI_EVENT Event, IN VOID *Context);
+BOOLEAN HasLinkPartner(INT16 Index);
+BOOLEAN RetrainLink(TopologyDevice *Port);
+
+RootBridgeIoProtocolMapping *FindRootBridgeIoMappingByResourceAllocation(EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *Substitute);
+RootBridgeIoProtocolMapping *FindRootBridgeIoMappingByHandle(EFI_HANDLE RootBridgeHandle);
 EFI_DRIVER_BINDING_PROTOCOL *FindDriverBindingProtocol();
 BOOLEAN IsProtocolsMapped(EFI_DRIVER_BINDING_PROTOCOL *Protocol);
 EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *FindRootBridgeIoProtocolMappingBySubstitute(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *Substitute);
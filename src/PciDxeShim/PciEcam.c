@@ -0,0 +1,338 @@
+/**
+ * File: PciEcam.c
+ * Author: Matthew Millman
+ *
+ * Serves config space accesses straight from the memory mapped (ECAM) window
+ * described by the MCFG table, rather than going through the root bridge.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+#include <Library/IoLib.h>
+#include <IndustryStandard/MemoryMappedConfigurationSpaceAccessTable.h>
+#include <Guid/Acpi.h>
+
+// Set to FALSE to send every config access to the root bridge, as before
+#define ECAM_FAST_PATH              TRUE
+
+// Compare ECAM against the root bridge on each bus before trusting it
+#define ECAM_VALIDATE               TRUE
+
+typedef struct
+{
+  UINT16 Register;
+  UINT32 Mask;
+} ECAM_VALIDATE_FIELD;
+
+// Only fields which can't change between the two reads. Status, BIST and the like
+// can, and a mismatch turns ECAM off for the rest of the boot.
+GLOBAL_REMOVE_IF_UNREFERENCED ECAM_VALIDATE_FIELD mEcamValidateFields[] = {
+  { PCI_VENDOR_ID_OFFSET, 0xFFFFFFFF },       // Vendor and device ID, checked first
+  { PCI_REVISION_ID_OFFSET, 0xFFFFFF00 },     // Class code
+  { PCI_CACHELINE_SIZE_OFFSET, 0x00FF0000 },  // Header type
+};
+
+#define ECAM_ADDRESS(Base, Bus, Device, Function, Register) \
+  ((Base) + (((UINT64)(Bus)) << 20) + (((UINT64)(Device)) << 15) + (((UINT64)(Function)) << 12) + (Register))
+
+STATIC EFI_EVENT mAcpiTableEvent = NULL;
+
+/**
+  Look up the ECAM window for a root bridge's segment in the MCFG table
+
+  @param  Mapping             Root bridge mapping, EcamBase / EcamStartBus / EcamEndBus set on success
+
+  @retval TRUE                Window found
+  @retval FALSE               No MCFG, or nothing for this segment
+**/
+BOOLEAN FindEcamWindow(RootBridgeIoProtocolMapping *Mapping)
+{
+  EFI_ACPI_MEMORY_MAPPED_CONFIGURATION_BASE_ADDRESS_TABLE_HEADER *Mcfg;
+  EFI_ACPI_MEMORY_MAPPED_ENHANCED_CONFIGURATION_SPACE_BASE_ADDRESS_ALLOCATION_STRUCTURE *Entry;
+  UINTN Count;
+  UINTN Index;
+
+  Mcfg = (EFI_ACPI_MEMORY_MAPPED_CONFIGURATION_BASE_ADDRESS_TABLE_HEADER *)EfiLocateFirstAcpiTable(
+      EFI_ACPI_2_0_MEMORY_MAPPED_CONFIGURATION_BASE_ADDRESS_TABLE_SIGNATURE);
+
+  if (Mcfg == NULL)
+    return FALSE;
+
+  Entry = (EFI_ACPI_MEMORY_MAPPED_ENHANCED_CONFIGURATION_SPACE_BASE_ADDRESS_ALLOCATION_STRUCTURE *)(Mcfg + 1);
+  Count = (Mcfg->Header.Length - sizeof(*Mcfg)) / sizeof(*Entry);
+
+  for (Index = 0; Index < Count; Index++)
+  {
+    if (Entry[Index].PciSegmentGroupNumber != Mapping->OriginalProtocol->SegmentNumber)
+      continue;
+
+    // The base is where bus 0 would be, even if the window starts higher
+    Mapping->EcamBase = Entry[Index].BaseAddress;
+    Mapping->EcamStartBus = Entry[Index].StartBusNumber;
+    Mapping->EcamEndBus = Entry[Index].EndBusNumber;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+  Check that ECAM and the root bridge agree on the identity of the functions
+  on a bus: vendor and device ID, class code and header type
+
+  @param  Mapping             Root bridge mapping
+  @param  Bus                 Bus to check
+  @param  LastDevice          Highest device number to check
+
+  @retval TRUE                Both paths agree
+  @retval FALSE               Mismatch, ECAM can't be trusted
+**/
+BOOLEAN ValidateEcam(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus, UINT8 LastDevice)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *Original = Mapping->OriginalProtocol;
+  UINT32 Expected;
+  UINT32 Actual;
+  UINT8 Device;
+  UINT8 Function;
+  UINT16 Register;
+  UINTN Field;
+  UINTN Functions = 0;
+
+  for (Device = 0; Device <= LastDevice; Device++)
+  {
+    for (Function = 0; Function <= PCI_MAX_FUNC; Function++)
+    {
+      for (Field = 0; Field < ARRAY_SIZE(mEcamValidateFields); Field++)
+      {
+        Register = mEcamValidateFields[Field].Register;
+        Original->Pci.Read(Original, EfiPciWidthUint32, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Expected);
+        Actual = MmioRead32((UINTN)ECAM_ADDRESS(Mapping->EcamBase, Bus, Device, Function, Register));
+
+        if (((Expected ^ Actual) & mEcamValidateFields[Field].Mask) != 0)
+        {
+          DEBUG((DEBUG_ERROR, "ValidateEcam(): %02X:%02X.%X+0x%02x root bridge 0x%08x, ECAM 0x%08x\n",
+                 Bus, Device, Function, Register, Expected, Actual));
+          return FALSE;
+        }
+
+        // Nothing there
+        if (Field == 0 && Expected == 0xFFFFFFFF)
+          break;
+      }
+
+      if (Field != 0)
+        Functions++;
+      else if (Function == 0)
+        break;
+    }
+  }
+
+  DEBUG((DEBUG_INFO, "ValidateEcam(): %u function(s) on bus 0x%02x match\n", Functions, Bus));
+
+  return TRUE;
+}
+
+/**
+  ACPI tables changed. Root bridges which found no MCFG entry get another go
+  on their next config access, MCFG is often installed after PciBus starts.
+
+  @param  Event               Event whose notification function is being invoked.
+  @param  Context             Not used.
+**/
+VOID EFIAPI OnAcpiTableInstalled(IN EFI_EVENT Event, IN VOID *Context)
+{
+  LIST_ENTRY *Entry;
+  RootBridgeIoProtocolMapping *Mapping;
+
+  for (Entry = GetFirstNode(&RootBridgeIoProtocolList); !IsNull(&RootBridgeIoProtocolList, Entry); Entry = GetNextNode(&RootBridgeIoProtocolList, Entry))
+  {
+    Mapping = (RootBridgeIoProtocolMapping *)Entry;
+
+    if (Mapping->EcamProbed && Mapping->EcamBase == 0)
+      Mapping->EcamProbed = FALSE;
+  }
+}
+
+/**
+  Set up the ECAM fast path for a root bridge, the first time it's needed
+
+  @param  Mapping             Root bridge mapping
+**/
+VOID InitializeEcam(RootBridgeIoProtocolMapping *Mapping)
+{
+  Mapping->EcamProbed = TRUE;
+  Mapping->EcamEnabled = FALSE;
+  Mapping->EcamBase = 0;
+  ZeroMem(Mapping->EcamCheckedBuses, sizeof(Mapping->EcamCheckedBuses));
+
+  if (!ECAM_FAST_PATH)
+    return;
+
+  if (!FindEcamWindow(Mapping))
+  {
+    // Try again once the ACPI tables change, rather than looking on every access
+    if (mAcpiTableEvent == NULL)
+      gBS->CreateEventEx(EVT_NOTIFY_SIGNAL, TPL_CALLBACK, OnAcpiTableInstalled, NULL, &gEfiAcpiTableGuid, &mAcpiTableEvent);
+
+    DEBUG((DEBUG_INFO, "InitializeEcam(): No MCFG entry for segment %u yet, using root bridge\n", Mapping->OriginalProtocol->SegmentNumber));
+    return;
+  }
+
+  DEBUG((DEBUG_INFO, "InitializeEcam(): ECAM at 0x%lx, buses 0x%02x-0x%02x\n", Mapping->EcamBase, Mapping->EcamStartBus, Mapping->EcamEndBus));
+
+  if (ECAM_VALIDATE && !ValidateEcam(Mapping, Mapping->EcamStartBus, PCI_MAX_DEVICE))
+  {
+    DEBUG((DEBUG_ERROR, "InitializeEcam(): ECAM doesn't match the root bridge, using root bridge\n"));
+    return;
+  }
+
+  Mapping->EcamCheckedBuses[Mapping->EcamStartBus / 8] |= (UINT8)(1 << (Mapping->EcamStartBus % 8));
+  Mapping->EcamEnabled = TRUE;
+}
+
+/**
+  Check ECAM against the root bridge on a bus the first time it's used. The
+  buses behind the hot plug ports only get numbers during the scan, so they
+  can't all be checked up front. Device 0 is enough to catch a window that's
+  off by some buses, and it's all a link has. A mismatch turns ECAM off.
+
+  @param  Mapping             Root bridge mapping, ECAM enabled
+  @param  Bus                 Bus about to be accessed through ECAM
+
+  @retval TRUE                ECAM can be used for the bus
+  @retval FALSE               ECAM is off now
+**/
+BOOLEAN CheckEcamBus(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus)
+{
+  if (!ECAM_VALIDATE || (Mapping->EcamCheckedBuses[Bus / 8] & (1 << (Bus % 8))) != 0)
+    return TRUE;
+
+  if (!ValidateEcam(Mapping, Bus, 0))
+  {
+    DEBUG((DEBUG_ERROR, "CheckEcamBus(): ECAM doesn't match the root bridge on bus 0x%02x, using root bridge\n", Bus));
+    Mapping->EcamEnabled = FALSE;
+    return FALSE;
+  }
+
+  Mapping->EcamCheckedBuses[Bus / 8] |= (UINT8)(1 << (Bus % 8));
+  return TRUE;
+}
+
+/**
+  Serve a config space access from ECAM, if it can be
+
+  @param  Mapping             Root bridge mapping
+  @param  Write               TRUE to write, FALSE to read
+  @param  Width               Width of each access
+  @param  Address             EFI_PCI_ADDRESS style address
+  @param  Count               Number of accesses
+  @param  Buffer              Data
+
+  @retval EFI_SUCCESS         Done
+  @retval EFI_UNSUPPORTED     Not something the fast path handles, send it to the root bridge
+**/
+EFI_STATUS EcamAccess(RootBridgeIoProtocolMapping *Mapping, BOOLEAN Write, EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINT64 Address, UINTN Count, VOID *Buffer)
+{
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+  UINT32 Register;
+  UINTN Size;
+  UINTN Start;
+  UINTN End;
+  UINTN Index;
+  UINTN Base;
+  UINT32 Dword;
+
+  if (!Mapping->EcamProbed)
+    InitializeEcam(Mapping);
+
+  if (!Mapping->EcamEnabled)
+    return EFI_UNSUPPORTED;
+
+  // FIFO, fill and 64-bit accesses are rare enough to leave to the root bridge
+  if (Width > EfiPciWidthUint32 || Count == 0 || Buffer == NULL)
+    return EFI_UNSUPPORTED;
+
+  if (PciAddress->Bus < Mapping->EcamStartBus || PciAddress->Bus > Mapping->EcamEndBus)
+    return EFI_UNSUPPORTED;
+
+  if (!CheckEcamBus(Mapping, PciAddress->Bus))
+    return EFI_UNSUPPORTED;
+
+  Register = (PciAddress->ExtendedRegister != 0) ? PciAddress->ExtendedRegister : PciAddress->Register;
+  Size = (UINTN)1 << Width;
+
+  // Has to stay within one function's config space, and be naturally aligned
+  if ((Register & (Size - 1)) != 0 || Register + Size * Count > SIZE_4KB)
+    return EFI_UNSUPPORTED;
+
+  Base = (UINTN)ECAM_ADDRESS(Mapping->EcamBase, PciAddress->Bus, PciAddress->Device, PciAddress->Function, 0);
+
+  if (Write)
+  {
+    // Writes keep their width, a wider write could clear RW1C bits next door
+    for (Index = 0; Index < Count; Index++, Register += (UINT32)Size)
+    {
+      switch (Width)
+      {
+      case EfiPciWidthUint8:
+        MmioWrite8(Base + Register, ((UINT8 *)Buffer)[Index]);
+        break;
+      case EfiPciWidthUint16:
+        MmioWrite16(Base + Register, ((UINT16 *)Buffer)[Index]);
+        break;
+      default:
+        MmioWrite32(Base + Register, ((UINT32 *)Buffer)[Index]);
+        break;
+      }
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  if (Count == 1)
+  {
+    switch (Width)
+    {
+    case EfiPciWidthUint8:
+      *(UINT8 *)Buffer = MmioRead8(Base + Register);
+      break;
+    case EfiPciWidthUint16:
+      *(UINT16 *)Buffer = MmioRead16(Base + Register);
+      break;
+    default:
+      *(UINT32 *)Buffer = MmioRead32(Base + Register);
+      break;
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  // Multi-count reads: one dword load for each dword the range touches
+  Start = Register & ~3U;
+  End = Register + Size * Count;
+
+  for (Index = Start; Index < End; Index += 4)
+  {
+    UINTN First = MAX(Index, (UINTN)Register);
+    UINTN Last = MIN(Index + 4, End);
+
+    Dword = MmioRead32(Base + Index);
+    CopyMem((UINT8 *)Buffer + (First - Register), (UINT8 *)&Dword + (First - Index), Last - First);
+  }
+
+  return EFI_SUCCESS;
+}
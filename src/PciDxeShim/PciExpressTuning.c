@@ -0,0 +1,434 @@
+/**
+ * File: PciExpressTuning.c
+ * Author: Matthew Millman
+ *
+ * Tunes the PCI Express settings of everything below the hot plug root ports
+ * once PciBus has finished with them.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+//
+// MPS_POLICY_PERFORMANCE:  Largest payload every device in the hierarchy supports.
+//                          A device hot plugged later which supports less won't work
+//                          properly until the OS fixes things up.
+// MPS_POLICY_HOT_PLUG_SAFE: 128 bytes everywhere, which every device supports.
+//
+#define MPS_POLICY_PERFORMANCE      0
+#define MPS_POLICY_HOT_PLUG_SAFE    1
+
+#define MPS_POLICY                  MPS_POLICY_PERFORMANCE
+
+//
+// Max Read Request Size is left at whatever the device came up with. Reads larger than
+// MPS come back as several completions, and some devices (and some tunnels) mishandle
+// that, so raising it is only safe for devices known to cope, and none are yet.
+//
+#define DEVCAP_MPS_MASK             0x0007
+#define DEVCTL_MPS_SHIFT            5
+#define DEVCTL_MPS_MASK             (0x7 << DEVCTL_MPS_SHIFT)
+
+#define ENCODED_SIZE(x)             (128 << (x))
+
+//
+// Board policy for endpoint requests. Relaxed ordering helps throughput a lot over the
+// tunnel's extra latency. No snoop is off by default as it relies on the driver managing
+// cache coherency itself.
+//
+#define ENABLE_RELAXED_ORDERING     TRUE
+#define ENABLE_NO_SNOOP             FALSE
+
+//
+// Completion timeout to program, encoded as per DevCtl2. Tunnelled links need longer
+// than the 50us-50ms default. 6 = 65ms-210ms (range B). If the device doesn't support
+// range B the shortest value of the next supported range up is used instead.
+//
+#define COMPLETION_TIMEOUT_VALUE    0x6
+
+#define DEVCAP_EXTENDED_TAG         BIT5
+#define DEVCTL_RELAXED_ORDERING     BIT4
+#define DEVCTL_EXTENDED_TAG         BIT8
+#define DEVCTL_NO_SNOOP             BIT11
+
+#define DEVCAP2_CPL_TIMEOUT_RANGES  0x0000000F
+#define DEVCAP2_10BIT_TAG_COMPLETER BIT16
+#define DEVCAP2_10BIT_TAG_REQUESTER BIT17
+#define DEVCTL2_CPL_TIMEOUT_MASK    0x000F
+#define DEVCTL2_10BIT_TAG_REQUESTER BIT12
+
+#define DEVCAP2_ARI_FORWARDING      BIT5
+#define DEVCTL2_ARI_FORWARDING      BIT5
+
+#define PCIE_EXT_CAP_ID_ARI         0x000E
+#define PCIE_EXT_CAP_ID_SRIOV       0x0010
+#define SRIOV_CONTROL               0x08
+#define SRIOV_CTL_VF_ENABLE         BIT0
+#define SRIOV_CTL_ARI_HIERARCHY     BIT4
+
+// Shortest completion timeout value in each of ranges A to D
+GLOBAL_REMOVE_IF_UNREFERENCED UINT8 mCompletionTimeoutRangeStart[] = { 0x1, 0x5, 0x9, 0xD };
+
+/**
+  Set Max Payload Size across each hot plug hierarchy
+
+  Every device below a root port has to agree on MPS, otherwise a TLP larger
+  than the receiver's MPS is treated as malformed.
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigureMaxPayload(INT16 Root)
+{
+  TopologyDevice *Device;
+  UINT16 Control;
+  UINT16 NewControl;
+  UINT8 Mps = 5;
+  UINTN Index;
+
+  if (MPS_POLICY == MPS_POLICY_HOT_PLUG_SAFE)
+  {
+    Mps = 0;
+  }
+  else
+  {
+    for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+    {
+      Device = &gHotPlugTopology.Devices[Index];
+
+      if (Device->Root != Root || Device->PcieCap == 0)
+        continue;
+
+      Mps = MIN(Mps, (UINT8)(PcieCapRead32(Device, PCIE_REG_DEVICE_CAPABILITY) & DEVCAP_MPS_MASK));
+    }
+  }
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root || Device->PcieCap == 0)
+      continue;
+
+    Control = PcieCapRead16(Device, PCIE_REG_DEVICE_CONTROL);
+    NewControl = (Control & ~DEVCTL_MPS_MASK) | (Mps << DEVCTL_MPS_SHIFT);
+
+    if (NewControl != Control)
+      PcieCapWrite16(Device, PCIE_REG_DEVICE_CONTROL, NewControl);
+
+    DEBUG((DEBUG_INFO, "ConfigureMaxPayload(): %02X:%02X.%X MPS %u -> %u\n",
+           Device->Bus, Device->Device, Device->Function,
+           ENCODED_SIZE((Control & DEVCTL_MPS_MASK) >> DEVCTL_MPS_SHIFT), ENCODED_SIZE(Mps)));
+  }
+}
+
+/**
+  Check that every device from a device up to its hot plug root port
+  has a capability bit set
+
+  @param  Device              Device at the bottom of the path
+  @param  Register            PCI Express capability register to check
+  @param  Mask                Bit(s) which must be set
+
+  @retval TRUE                Everything on the path has the capability
+  @retval FALSE               At least one device doesn't
+**/
+BOOLEAN PathSupports(TopologyDevice *Device, UINT8 Register, UINT32 Mask)
+{
+  for (;;)
+  {
+    if (Device->PcieCap == 0 || (PcieCapRead32(Device, Register) & Mask) != Mask)
+      return FALSE;
+
+    if (Device->Parent < 0)
+      return TRUE;
+
+    Device = &gHotPlugTopology.Devices[Device->Parent];
+  }
+}
+
+/**
+  Pick a completion timeout value the device supports
+
+  @param  Ranges              Supported ranges from DevCap2
+
+  @retval (value)             DevCtl2 encoding, 0 to leave the default alone
+**/
+UINT8 PickCompletionTimeout(UINT32 Ranges)
+{
+  UINTN Range;
+
+  // Not programmable
+  if (Ranges == 0)
+    return 0;
+
+  for (Range = 0; Range < ARRAY_SIZE(mCompletionTimeoutRangeStart); Range++)
+  {
+    if ((Ranges & (1 << Range)) == 0)
+      continue;
+
+    // Wanted value falls within this range
+    if (Range + 1 == ARRAY_SIZE(mCompletionTimeoutRangeStart) || COMPLETION_TIMEOUT_VALUE < mCompletionTimeoutRangeStart[Range + 1])
+    {
+      if (COMPLETION_TIMEOUT_VALUE >= mCompletionTimeoutRangeStart[Range])
+        return COMPLETION_TIMEOUT_VALUE;
+
+      return mCompletionTimeoutRangeStart[Range];
+    }
+  }
+
+  return 0;
+}
+
+/**
+  Apply the requester policy to each device in a hot plug hierarchy: extended and
+  10-bit tags, relaxed ordering, no snoop and completion timeout.
+
+  Tags are only widened where everything between the device and the root port
+  can cope with them, as the root port is the completer for DMA to memory.
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigureRequesterPolicy(INT16 Root)
+{
+  TopologyDevice *Device;
+  UINT16 Control;
+  UINT16 NewControl;
+  UINT16 Control2;
+  UINT16 NewControl2;
+  UINT32 Capability2;
+  UINT8 Timeout;
+  UINTN Index;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root || Device->PcieCap == 0)
+      continue;
+
+    Control = NewControl = PcieCapRead16(Device, PCIE_REG_DEVICE_CONTROL);
+    Control2 = NewControl2 = PcieCapRead16(Device, PCIE_REG_DEVICE_CONTROL2);
+    Capability2 = PcieCapRead32(Device, PCIE_REG_DEVICE_CAPABILITY2);
+
+    if (IsEndpoint(Device))
+    {
+      if (PathSupports(Device, PCIE_REG_DEVICE_CAPABILITY, DEVCAP_EXTENDED_TAG))
+        NewControl |= DEVCTL_EXTENDED_TAG;
+
+      if ((Capability2 & DEVCAP2_10BIT_TAG_REQUESTER) && Device->Parent >= 0 &&
+          PathSupports(&gHotPlugTopology.Devices[Device->Parent], PCIE_REG_DEVICE_CAPABILITY2, DEVCAP2_10BIT_TAG_COMPLETER))
+        NewControl2 |= DEVCTL2_10BIT_TAG_REQUESTER;
+
+      NewControl &= ~(DEVCTL_RELAXED_ORDERING | DEVCTL_NO_SNOOP);
+
+      if (ENABLE_RELAXED_ORDERING)
+        NewControl |= DEVCTL_RELAXED_ORDERING;
+
+      if (ENABLE_NO_SNOOP)
+        NewControl |= DEVCTL_NO_SNOOP;
+    }
+
+    Timeout = PickCompletionTimeout(Capability2 & DEVCAP2_CPL_TIMEOUT_RANGES);
+
+    if (Timeout != 0)
+      NewControl2 = (NewControl2 & ~DEVCTL2_CPL_TIMEOUT_MASK) | Timeout;
+
+    if (NewControl != Control)
+      PcieCapWrite16(Device, PCIE_REG_DEVICE_CONTROL, NewControl);
+
+    if (NewControl2 != Control2)
+      PcieCapWrite16(Device, PCIE_REG_DEVICE_CONTROL2, NewControl2);
+
+    DEBUG((DEBUG_INFO, "ConfigureRequesterPolicy(): %02X:%02X.%X ExtTag %u 10BitTag %u RO %u NS %u CplTimeout 0x%x -> 0x%x\n",
+           Device->Bus, Device->Device, Device->Function,
+           (NewControl & DEVCTL_EXTENDED_TAG) ? 1 : 0, (NewControl2 & DEVCTL2_10BIT_TAG_REQUESTER) ? 1 : 0,
+           (NewControl & DEVCTL_RELAXED_ORDERING) ? 1 : 0, (NewControl & DEVCTL_NO_SNOOP) ? 1 : 0,
+           Control2 & DEVCTL2_CPL_TIMEOUT_MASK, NewControl2 & DEVCTL2_CPL_TIMEOUT_MASK));
+  }
+}
+
+/**
+  Enable ARI Forwarding on ports whose devices support ARI, so routing IDs
+  beyond function 7 reach them. SR-IOV devices have already been handled by
+  PrepareAriHierarchy() as PciBus found them, this catches everything else.
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigureAriForwarding(INT16 Root)
+{
+  TopologyDevice *Port;
+  TopologyDevice *Device;
+  BOOLEAN AllAri;
+  BOOLEAN Found;
+  UINTN Index;
+  UINTN Child;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Port = &gHotPlugTopology.Devices[Index];
+
+    if (Port->Root != Root || Port->PcieCap == 0 || IsEndpoint(Port))
+      continue;
+
+    if ((PcieCapRead32(Port, PCIE_REG_DEVICE_CAPABILITY2) & DEVCAP2_ARI_FORWARDING) == 0)
+      continue;
+
+    AllAri = TRUE;
+    Found = FALSE;
+
+    for (Child = 0; Child < gHotPlugTopology.Count; Child++)
+    {
+      Device = &gHotPlugTopology.Devices[Child];
+
+      if (Device->Parent != (INT16)Index)
+        continue;
+
+      Found = TRUE;
+
+      if (!IsEndpoint(Device) || FindExtendedCapability(Device, PCIE_EXT_CAP_ID_ARI) == 0)
+        AllAri = FALSE;
+    }
+
+    if (!Found || !AllAri)
+      continue;
+
+    PcieCapWrite16(Port, PCIE_REG_DEVICE_CONTROL2, PcieCapRead16(Port, PCIE_REG_DEVICE_CONTROL2) | DEVCTL2_ARI_FORWARDING);
+
+    DEBUG((DEBUG_INFO, "ConfigureAriForwarding(): %02X:%02X.%X ARI forwarding enabled\n", Port->Bus, Port->Device, Port->Function));
+  }
+}
+
+/**
+  Find an extended capability through a root bridge mapping, for use before
+  the hot plug topology exists
+
+  @param  Mapping             Root bridge the function is on
+  @param  Bus, Device, Function  Location of the function
+  @param  CapabilityId        Extended capability ID
+
+  @retval (value)             Offset of the capability, 0 if not found
+**/
+UINT16 MappingFindExtendedCapability(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 CapabilityId)
+{
+  UINT16 Offset = PCIE_EXTENDED_CAPABILITY_BASE;
+  UINT32 Header;
+  UINTN Limit;
+
+  for (Limit = 0; Offset >= PCIE_EXTENDED_CAPABILITY_BASE && Limit < 256; Limit++)
+  {
+    Header = PruneCfgRead(Mapping, EfiPciWidthUint32, Bus, Device, Function, Offset);
+
+    if (Header == 0 || Header == 0xFFFFFFFF)
+      return 0;
+
+    if ((Header & 0xFFFF) == CapabilityId)
+      return Offset;
+
+    Offset = (UINT16)((Header >> 20) & 0xFFC);
+  }
+
+  return 0;
+}
+
+/**
+  Set up ARI for an SR-IOV device as PciBus finds it. First VF Offset and VF
+  Stride depend on the ARI Capable Hierarchy bit, and PciBus reserves buses for
+  the VFs from them straight after this, so the bit has to be right already.
+  Setting it once the hierarchy is tuned left PciBus working from the non-ARI
+  values.
+
+  Every function of an ARI device implements ARI, and a link only carries
+  device 0, so function 0 speaks for everything below the port.
+
+  @param  Mapping             Root bridge the device is on
+  @param  Bus, Device, Function  Location of the device
+**/
+VOID PrepareAriHierarchy(RootBridgeIoProtocolMapping *Mapping, UINT8 Bus, UINT8 Device, UINT8 Function)
+{
+  PRUNE_BUS *Entry = &Mapping->PruneBus[Bus];
+  UINT16 Control;
+  UINT16 Offset;
+
+  if (Device != 0 || Function != 0 || (Entry->Flags & PRUNE_LINK) == 0)
+    return;
+
+  if ((PruneCfgRead(Mapping, EfiPciWidthUint32, Entry->PortBus, Entry->PortDevice, Entry->PortFunction, Entry->PortPcieCap + PCIE_REG_DEVICE_CAPABILITY2) & DEVCAP2_ARI_FORWARDING) == 0)
+    return;
+
+  Offset = MappingFindExtendedCapability(Mapping, Bus, 0, 0, PCIE_EXT_CAP_ID_SRIOV);
+
+  if (Offset == 0 || MappingFindExtendedCapability(Mapping, Bus, 0, 0, PCIE_EXT_CAP_ID_ARI) == 0)
+    return;
+
+  // Only writable while VF Enable is clear
+  Control = (UINT16)PruneCfgRead(Mapping, EfiPciWidthUint16, Bus, 0, 0, Offset + SRIOV_CONTROL);
+
+  if ((Control & SRIOV_CTL_VF_ENABLE) != 0)
+    return;
+
+  // Through the substitute, so the pruning code sees forwarding go on
+  Control = (UINT16)PruneCfgRead(Mapping, EfiPciWidthUint16, Entry->PortBus, Entry->PortDevice, Entry->PortFunction, Entry->PortPcieCap + PCIE_REG_DEVICE_CONTROL2) | DEVCTL2_ARI_FORWARDING;
+  Mapping->SubstitutedProtocol.Pci.Write(&Mapping->SubstitutedProtocol, EfiPciWidthUint16,
+                                         EFI_PCI_ADDRESS(Entry->PortBus, Entry->PortDevice, Entry->PortFunction, Entry->PortPcieCap + PCIE_REG_DEVICE_CONTROL2), 1, &Control);
+
+  Control = (UINT16)PruneCfgRead(Mapping, EfiPciWidthUint16, Bus, 0, 0, Offset + SRIOV_CONTROL) | SRIOV_CTL_ARI_HIERARCHY;
+  Mapping->SubstitutedProtocol.Pci.Write(&Mapping->SubstitutedProtocol, EfiPciWidthUint16, EFI_PCI_ADDRESS(Bus, 0, 0, Offset + SRIOV_CONTROL), 1, &Control);
+
+  DEBUG((DEBUG_INFO, "PrepareAriHierarchy(): %02X:00.0 ARI capable hierarchy set, forwarding enabled on %02X:%02X.%X\n",
+         Bus, Entry->PortBus, Entry->PortDevice, Entry->PortFunction));
+}
+
+/**
+  Apply PCI Express tuning to every hot plug hierarchy on a root bridge.
+  Called once resources have been allocated and PciBus has finished
+  programming the devices.
+
+  @param  Mapping             Root bridge to tune
+**/
+VOID TuneHotPlugHierarchies(RootBridgeIoProtocolMapping *Mapping)
+{
+  EFI_STATUS Status;
+  UINTN Index;
+
+  Status = BuildHotPlugTopology(Mapping->OriginalProtocol);
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "TuneHotPlugHierarchies(): Couldn't build topology: %r\n", Status));
+    return;
+  }
+
+  // Whatever went wrong during enumeration, before tuning retrains anything
+  CollectAerErrors();
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    if (gHotPlugTopology.Devices[Index].Parent >= 0)
+      continue;
+
+    ConfigureMaxPayload((INT16)Index);
+    ConfigureRequesterPolicy((INT16)Index);
+    ConfigureAriForwarding((INT16)Index);
+    ConfigureLinkPower((INT16)Index);
+    VerifyLinkTraining((INT16)Index);
+    ConfigurePtm((INT16)Index);
+    ConfigureAcs((INT16)Index);
+    ReportLargePageMappable((INT16)Index);
+  }
+
+  ApplyWriteCombining();
+}
@@ -0,0 +1,60 @@
+/**
+ * File: PciHotPlugRescan.h
+ * Author: Matthew Millman
+ *
+ * Hot plug port rescan protocol, installed by PciDxeShim. Re-enumerates just
+ * the hierarchy below one hot plug port, inside that port's padding.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PCI_HOT_PLUG_RESCAN_H
+#define _PCI_HOT_PLUG_RESCAN_H
+
+#define PCI_HOT_PLUG_RESCAN_PROTOCOL_REVISION   1
+
+typedef struct _PCI_HOT_PLUG_RESCAN_PROTOCOL PCI_HOT_PLUG_RESCAN_PROTOCOL;
+
+/**
+  Throw away whatever PciBus knows about the devices below a hot plug port,
+  enumerate them again, and connect drivers to what's found
+
+  @param  This                  Protocol instance
+  @param  PortDevicePath        Device path of the hot plug port
+  @param  NumberOfChildren      Optional, receives the number of devices directly below the port
+
+  @retval EFI_SUCCESS           Port rescanned
+  @retval EFI_NOT_FOUND         No such port
+  @retval EFI_UNSUPPORTED       PciBus doesn't do hot plug requests
+  @retval other                 PciBus couldn't enumerate or allocate resources for the new devices,
+                                or a driver failed to start on one of them
+**/
+typedef
+EFI_STATUS
+(EFIAPI *PCI_HOT_PLUG_RESCAN_PORT)(
+    IN PCI_HOT_PLUG_RESCAN_PROTOCOL *This,
+    IN EFI_DEVICE_PATH_PROTOCOL *PortDevicePath,
+    OUT UINTN *NumberOfChildren OPTIONAL);
+
+struct _PCI_HOT_PLUG_RESCAN_PROTOCOL
+{
+  UINT32 Revision;
+  PCI_HOT_PLUG_RESCAN_PORT RescanPort;
+};
+
+extern EFI_GUID gPciHotPlugRescanProtocolGuid;
+
+#endif /* _PCI_HOT_PLUG_RESCAN_H */
@@ -0,0 +1,156 @@
+/**
+ * File: PciLargePage.c
+ * Author: Matthew Millman
+ *
+ * Places prefetchable memory so the OS can map it with large pages, and
+ * reports how much of it ended up that way.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+// Set to FALSE to submit resources exactly as PciBus asked for them
+#define LARGE_PAGE_PLACEMENT        TRUE
+
+#define LARGE_PAGE_2MB              SIZE_2MB
+#define LARGE_PAGE_1GB              SIZE_1GB
+
+/**
+  Raise the alignment of the prefetchable memory in a resource submission, so
+  the root bridge's prefetchable range starts on a large page boundary. Each
+  hot plug window inside it is aligned by its own padding, see
+  GetPaddingAlignment() in PciHotPlug.
+
+  2MB alignment costs at most 2MB of aperture, so it's applied to anything
+  that large. 1GB alignment is only applied above 4GB, where there is room
+  to spare, the 32-bit aperture can't afford it.
+
+  @param  Configuration       Resource descriptors from PciBus, updated in place
+**/
+VOID AlignForLargePages(VOID *Configuration)
+{
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
+  UINT64 Alignment;
+
+  if (!LARGE_PAGE_PLACEMENT)
+    return;
+
+  for (Descriptor = (EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *)Configuration; Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Descriptor++)
+  {
+    if (Descriptor->ResType != ACPI_ADDRESS_SPACE_TYPE_MEM || (Descriptor->SpecificFlag & EFI_ACPI_MEMORY_RESOURCE_SPECIFIC_FLAG_CACHEABLE_PREFETCHABLE) == 0)
+      continue;
+
+    if (Descriptor->AddrSpaceGranularity == 64 && Descriptor->AddrLen >= LARGE_PAGE_1GB)
+      Alignment = LARGE_PAGE_1GB;
+    else if (Descriptor->AddrLen >= LARGE_PAGE_2MB)
+      Alignment = LARGE_PAGE_2MB;
+    else
+      continue;
+
+    // AddrRangeMax carries the alignment mask. Never lower it.
+    if (Descriptor->AddrRangeMax >= Alignment - 1)
+      continue;
+
+    DEBUG((DEBUG_INFO, "AlignForLargePages(): PMem%u 0x%lx, alignment 0x%lx -> 0x%lx\n",
+           Descriptor->AddrSpaceGranularity, Descriptor->AddrLen, Descriptor->AddrRangeMax + 1, Alignment));
+
+    Descriptor->AddrRangeMax = Alignment - 1;
+  }
+}
+
+/**
+  Get the largest page size a range can be mapped with
+
+  @param  Base                Start of the range
+  @param  Length              Size of the range
+
+  @retval (value)             Page size, 0 if only small pages fit
+**/
+UINT64 LargestPageFor(UINT64 Base, UINT64 Length)
+{
+  if ((Base & (LARGE_PAGE_1GB - 1)) == 0 && Length >= LARGE_PAGE_1GB)
+    return LARGE_PAGE_1GB;
+
+  if ((Base & (LARGE_PAGE_2MB - 1)) == 0 && Length >= LARGE_PAGE_2MB)
+    return LARGE_PAGE_2MB;
+
+  return 0;
+}
+
+/**
+  Report how many prefetchable windows and BARs in a hot plug hierarchy can
+  be mapped with 2MB or 1GB pages
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ReportLargePageMappable(INT16 Root)
+{
+  TopologyDevice *Device;
+  UINTN Counts[2][3];   // [Window/BAR][Small/2MB/1GB]
+  UINT64 Base;
+  UINT64 Limit;
+  UINT64 Page;
+  UINT64 Size;
+  UINT32 Bar;
+  BOOLEAN Prefetchable;
+  UINTN BarIndex;
+  UINTN Index;
+
+  ZeroMem(Counts, sizeof(Counts));
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root)
+      continue;
+
+    if ((Device->HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_PCI_TO_PCI_BRIDGE)
+    {
+      Bar = PciCfgRead32(Device->Bus, Device->Device, Device->Function, 0x24);
+      Base = LShiftU64(PciCfgRead32(Device->Bus, Device->Device, Device->Function, 0x28), 32) | ((Bar & 0xFFF0) << 16);
+      Limit = LShiftU64(PciCfgRead32(Device->Bus, Device->Device, Device->Function, 0x2C), 32) | (Bar & 0xFFF00000) | 0xFFFFF;
+
+      if (Limit > Base)
+      {
+        Page = LargestPageFor(Base, Limit - Base + 1);
+        Counts[0][(Page == LARGE_PAGE_1GB) ? 2 : (Page == LARGE_PAGE_2MB) ? 1 : 0]++;
+      }
+
+      continue;
+    }
+
+    // Every 64-bit BAR steps past its upper half, prefetchable or not
+    for (BarIndex = 0; BarIndex < PCI_MAX_BAR; BarIndex++)
+    {
+      Size = SizeMemoryBar(Device, &BarIndex, &Base, &Prefetchable);
+
+      if (Size == 0 || !Prefetchable)
+        continue;
+
+      Page = LargestPageFor(Base, Size);
+      Counts[1][(Page == LARGE_PAGE_1GB) ? 2 : (Page == LARGE_PAGE_2MB) ? 1 : 0]++;
+    }
+  }
+
+  DEBUG((DEBUG_INFO, "ReportLargePageMappable(): %02X:%02X.%X PMem windows: %u 1GB, %u 2MB, %u small only\n",
+         gHotPlugTopology.Devices[Root].Bus, gHotPlugTopology.Devices[Root].Device, gHotPlugTopology.Devices[Root].Function,
+         Counts[0][2], Counts[0][1], Counts[0][0]));
+  DEBUG((DEBUG_INFO, "ReportLargePageMappable(): %02X:%02X.%X PMem BARs: %u 1GB, %u 2MB, %u small only\n",
+         gHotPlugTopology.Devices[Root].Bus, gHotPlugTopology.Devices[Root].Device, gHotPlugTopology.Devices[Root].Function,
+         Counts[1][2], Counts[1][1], Counts[1][0]));
+}
@@ -0,0 +1,434 @@
+/**
+ * File: PciLinkPower.c
+ * Author: Matthew Millman
+ *
+ * Common clock, ASPM and LTR configuration for the links below the hot plug
+ * root ports.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+//
+// LINK_POLICY_LATENCY: ASPM off everywhere, and devices may not ask the platform to
+//                      tolerate any extra latency. For low latency NICs and the like.
+// LINK_POLICY_POWER:   ASPM wherever every endpoint's acceptable latency allows it.
+//
+#define LINK_POLICY_LATENCY         0
+#define LINK_POLICY_POWER           1
+
+#define LINK_POLICY_DEFAULT         LINK_POLICY_POWER
+
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 Policy;
+} LINK_POLICY;
+
+// Hot plug root ports which don't use LINK_POLICY_DEFAULT
+GLOBAL_REMOVE_IF_UNREFERENCED LINK_POLICY mLinkPolicies[] = {
+  { 0x00, 0x1C, 0x04, LINK_POLICY_LATENCY }
+};
+
+// LTR max snoop / no-snoop latency for each policy, in ns
+#define LTR_MAX_LATENCY_LATENCY_NS  0
+#define LTR_MAX_LATENCY_POWER_NS    3145728
+
+#define RETRAIN_TIMEOUT_US          100000
+#define RETRAIN_POLL_US             100
+
+// Added to the L1 exit latency for each switch between the link and the endpoint
+#define SWITCH_L1_EXIT_NS           1000
+
+#define LINKCAP_ASPM_L0S            BIT10
+#define LINKCAP_ASPM_L1             BIT11
+#define LINKCAP_L0S_EXIT(x)         (((x) >> 12) & 0x7)
+#define LINKCAP_L1_EXIT(x)          (((x) >> 15) & 0x7)
+#define LINKCTL_ASPM_MASK           (BIT0 | BIT1)
+#define LINKCTL_ASPM_L0S            BIT0
+#define LINKCTL_ASPM_L1             BIT1
+#define LINKCTL_RETRAIN             BIT5
+#define LINKCTL_COMMON_CLOCK        BIT6
+#define LINKSTS_TRAINING            BIT11
+#define LINKSTS_SLOT_CLOCK          BIT12
+#define DEVCAP_L0S_ACCEPTABLE(x)    (((x) >> 6) & 0x7)
+#define DEVCAP_L1_ACCEPTABLE(x)     (((x) >> 9) & 0x7)
+#define DEVCAP2_LTR                 BIT11
+#define DEVCTL2_LTR                 BIT10
+
+#define PCIE_EXT_CAP_ID_LTR         0x0018
+#define LTR_MAX_SNOOP_LATENCY       0x04
+#define LTR_MAX_NO_SNOOP_LATENCY    0x06
+
+#define NO_LIMIT                    MAX_UINT32
+
+/**
+  Get the policy for a hot plug root port
+
+  @param  Port                The root port
+
+  @retval (value)             LINK_POLICY_xxx
+**/
+UINT8 GetLinkPolicy(TopologyDevice *Port)
+{
+  UINTN Index;
+
+  for (Index = 0; Index < ARRAY_SIZE(mLinkPolicies); Index++)
+  {
+    if (mLinkPolicies[Index].Bus == Port->Bus && mLinkPolicies[Index].Device == Port->Device && mLinkPolicies[Index].Function == Port->Function)
+      return mLinkPolicies[Index].Policy;
+  }
+
+  return LINK_POLICY_DEFAULT;
+}
+
+/**
+  Check whether a device is the downstream port of a link, i.e. it has something below it
+
+  @param  Index               Index of the device
+
+  @retval TRUE                There is at least one device on the other end
+  @retval FALSE               Nothing there, or not a port
+**/
+BOOLEAN HasLinkPartner(INT16 Index)
+{
+  UINTN Child;
+
+  for (Child = 0; Child < gHotPlugTopology.Count; Child++)
+  {
+    if (gHotPlugTopology.Devices[Child].Parent == Index && gHotPlugTopology.Devices[Child].PcieCap != 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+  Retrain a link from its downstream port, and wait for it to come back
+
+  @param  Port                Downstream port of the link
+
+  @retval TRUE                Link trained
+  @retval FALSE               Timed out
+**/
+BOOLEAN RetrainLink(TopologyDevice *Port)
+{
+  UINTN Waited;
+
+  PcieCapWrite16(Port, PCIE_REG_LINK_CONTROL, PcieCapRead16(Port, PCIE_REG_LINK_CONTROL) | LINKCTL_RETRAIN);
+
+  for (Waited = 0; Waited < RETRAIN_TIMEOUT_US; Waited += RETRAIN_POLL_US)
+  {
+    if ((PcieCapRead16(Port, PCIE_REG_LINK_STATUS) & LINKSTS_TRAINING) == 0)
+      return TRUE;
+
+    gBS->Stall(RETRAIN_POLL_US);
+  }
+
+  return FALSE;
+}
+
+/**
+  Set Common Clock Configuration on both ends of each link where the slot
+  clock is shared, then retrain so the new exit latencies take effect
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigureCommonClock(INT16 Root)
+{
+  TopologyDevice *Port;
+  TopologyDevice *Child;
+  BOOLEAN Common;
+  UINTN Index;
+  UINTN ChildIndex;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Port = &gHotPlugTopology.Devices[Index];
+
+    if (Port->Root != Root || Port->PcieCap == 0 || !HasLinkPartner((INT16)Index))
+      continue;
+
+    Common = (PcieCapRead16(Port, PCIE_REG_LINK_STATUS) & LINKSTS_SLOT_CLOCK) != 0;
+
+    for (ChildIndex = 0; ChildIndex < gHotPlugTopology.Count && Common; ChildIndex++)
+    {
+      Child = &gHotPlugTopology.Devices[ChildIndex];
+
+      if (Child->Parent == (INT16)Index && Child->PcieCap != 0)
+        Common = (PcieCapRead16(Child, PCIE_REG_LINK_STATUS) & LINKSTS_SLOT_CLOCK) != 0;
+    }
+
+    if (!Common || (PcieCapRead16(Port, PCIE_REG_LINK_CONTROL) & LINKCTL_COMMON_CLOCK) != 0)
+      continue;
+
+    for (ChildIndex = 0; ChildIndex < gHotPlugTopology.Count; ChildIndex++)
+    {
+      Child = &gHotPlugTopology.Devices[ChildIndex];
+
+      if (Child->Parent == (INT16)Index && Child->PcieCap != 0)
+        PcieCapWrite16(Child, PCIE_REG_LINK_CONTROL, PcieCapRead16(Child, PCIE_REG_LINK_CONTROL) | LINKCTL_COMMON_CLOCK);
+    }
+
+    PcieCapWrite16(Port, PCIE_REG_LINK_CONTROL, PcieCapRead16(Port, PCIE_REG_LINK_CONTROL) | LINKCTL_COMMON_CLOCK);
+
+    DEBUG((DEBUG_INFO, "ConfigureCommonClock(): %02X:%02X.%X common clock set, retrain %a\n",
+           Port->Bus, Port->Device, Port->Function, RetrainLink(Port) ? "OK" : "timed out"));
+  }
+}
+
+/**
+  Work out the worst case exit latencies of a link from the capabilities of both ends
+
+  @param  Port                Index of the downstream port of the link
+  @param  L0s                 Returns the L0s exit latency in ns, NO_LIMIT if L0s isn't supported
+  @param  L1                  Returns the L1 exit latency in ns, NO_LIMIT if L1 isn't supported
+**/
+VOID GetLinkExitLatency(INT16 Port, UINT32 *L0s, UINT32 *L1)
+{
+  TopologyDevice *Device;
+  UINT32 Capability;
+  UINTN Index;
+
+  *L0s = 0;
+  *L1 = 0;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if ((INT16)Index != Port && Device->Parent != Port)
+      continue;
+
+    if (Device->PcieCap == 0)
+      continue;
+
+    Capability = PcieCapRead32(Device, PCIE_REG_LINK_CAPABILITY);
+
+    // Encodings are upper bounds, 64ns << n for L0s and 1us << n for L1
+    if (*L0s != NO_LIMIT)
+      *L0s = (Capability & LINKCAP_ASPM_L0S) ? MAX(*L0s, 64U << LINKCAP_L0S_EXIT(Capability)) : NO_LIMIT;
+
+    if (*L1 != NO_LIMIT)
+      *L1 = (Capability & LINKCAP_ASPM_L1) ? MAX(*L1, 1000U << LINKCAP_L1_EXIT(Capability)) : NO_LIMIT;
+  }
+}
+
+/**
+  Enable ASPM on each link of a hot plug hierarchy where every endpoint below
+  it can tolerate the exit latency, or disable it everywhere for LINK_POLICY_LATENCY.
+
+  @param  Root                Index of the hot plug root port
+  @param  Policy              LINK_POLICY_xxx
+**/
+VOID ConfigureAspm(INT16 Root, UINT8 Policy)
+{
+  UINT16 Allowed[MAX_TOPOLOGY_DEVICES];
+  UINT32 L0sExit[MAX_TOPOLOGY_DEVICES];
+  UINT32 L1Exit[MAX_TOPOLOGY_DEVICES];
+  TopologyDevice *Device;
+  UINT32 Capability;
+  UINT32 L0sAcceptable;
+  UINT32 L1Acceptable;
+  UINT32 L0sTotal;
+  UINT32 Hops;
+  UINT16 Control;
+  INT16 Link;
+  INTN Index;
+
+  for (Index = 0; Index < (INTN)gHotPlugTopology.Count; Index++)
+  {
+    Allowed[Index] = 0;
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root || Device->PcieCap == 0 || !HasLinkPartner((INT16)Index))
+      continue;
+
+    GetLinkExitLatency((INT16)Index, &L0sExit[Index], &L1Exit[Index]);
+
+    if (Policy == LINK_POLICY_POWER)
+    {
+      Allowed[Index] = ((L0sExit[Index] != NO_LIMIT) ? LINKCTL_ASPM_L0S : 0) |
+                       ((L1Exit[Index] != NO_LIMIT) ? LINKCTL_ASPM_L1 : 0);
+    }
+  }
+
+  //
+  // Walk up from each endpoint. L0s exit latencies add up link by link, L1 exits
+  // happen in parallel but each switch on the way adds its own delay.
+  //
+  for (Index = 0; Index < (INTN)gHotPlugTopology.Count && Policy == LINK_POLICY_POWER; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root || !IsEndpoint(Device))
+      continue;
+
+    Capability = PcieCapRead32(Device, PCIE_REG_DEVICE_CAPABILITY);
+    L0sAcceptable = (DEVCAP_L0S_ACCEPTABLE(Capability) == 7) ? NO_LIMIT : (64U << DEVCAP_L0S_ACCEPTABLE(Capability));
+    L1Acceptable = (DEVCAP_L1_ACCEPTABLE(Capability) == 7) ? NO_LIMIT : (1000U << DEVCAP_L1_ACCEPTABLE(Capability));
+    L0sTotal = 0;
+    Hops = 0;
+
+    for (Link = Device->Parent; Link >= 0; Link = gHotPlugTopology.Devices[Link].Parent)
+    {
+      if (gHotPlugTopology.Devices[Link].PcieCap == 0)
+        continue;
+
+      if (Allowed[Link] & LINKCTL_ASPM_L0S)
+      {
+        L0sTotal += L0sExit[Link];
+
+        if (L0sTotal > L0sAcceptable)
+          Allowed[Link] &= ~LINKCTL_ASPM_L0S;
+      }
+
+      if ((Allowed[Link] & LINKCTL_ASPM_L1) && L1Acceptable != NO_LIMIT && L1Exit[Link] + Hops * SWITCH_L1_EXIT_NS > L1Acceptable)
+        Allowed[Link] &= ~LINKCTL_ASPM_L1;
+
+      // Only switch downstream ports have a switch above them on the path
+      if (gHotPlugTopology.Devices[Link].PortType == PCIE_DEVICE_PORT_TYPE_DOWNSTREAM_PORT)
+        Hops++;
+    }
+  }
+
+  //
+  // Program. Both ends of a link get the same setting, upstream end first when
+  // enabling L1 and last when disabling it.
+  //
+  for (Index = 0; Index < (INTN)gHotPlugTopology.Count; Index++)
+  {
+    UINTN Child;
+
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root || Device->PcieCap == 0 || !HasLinkPartner((INT16)Index))
+      continue;
+
+    Control = PcieCapRead16(Device, PCIE_REG_LINK_CONTROL);
+
+    if (Allowed[Index] & LINKCTL_ASPM_L1)
+      PcieCapWrite16(Device, PCIE_REG_LINK_CONTROL, (Control & ~LINKCTL_ASPM_MASK) | Allowed[Index]);
+
+    for (Child = 0; Child < gHotPlugTopology.Count; Child++)
+    {
+      TopologyDevice *Partner = &gHotPlugTopology.Devices[Child];
+
+      if (Partner->Parent == (INT16)Index && Partner->PcieCap != 0)
+        PcieCapWrite16(Partner, PCIE_REG_LINK_CONTROL, (PcieCapRead16(Partner, PCIE_REG_LINK_CONTROL) & ~LINKCTL_ASPM_MASK) | Allowed[Index]);
+    }
+
+    if ((Allowed[Index] & LINKCTL_ASPM_L1) == 0)
+      PcieCapWrite16(Device, PCIE_REG_LINK_CONTROL, (Control & ~LINKCTL_ASPM_MASK) | Allowed[Index]);
+
+    DEBUG((DEBUG_INFO, "ConfigureAspm(): %02X:%02X.%X exit L0s %uns L1 %uns, ASPM %a%a\n",
+           Device->Bus, Device->Device, Device->Function, L0sExit[Index], L1Exit[Index],
+           (Allowed[Index] & LINKCTL_ASPM_L0S) ? "L0s " : "", (Allowed[Index] & LINKCTL_ASPM_L1) ? "L1" : "off"));
+  }
+}
+
+/**
+  Encode a latency in ns into the LTR value / scale format
+
+  @param  Latency             Latency in ns
+
+  @retval (value)             Encoded latency
+**/
+UINT16 EncodeLtrLatency(UINT32 Latency)
+{
+  UINT16 Scale = 0;
+
+  // Scale n is in units of 32^n ns, the value is 10 bits
+  while (Latency > 0x3FF && Scale < 5)
+  {
+    Latency = (Latency + 31) >> 5;
+    Scale++;
+  }
+
+  return (UINT16)(MIN(Latency, 0x3FF) | (Scale << 10));
+}
+
+/**
+  Enable LTR from the root port down wherever the whole path supports it, and
+  set how much latency the devices are allowed to ask for
+
+  @param  Root                Index of the hot plug root port
+  @param  Policy              LINK_POLICY_xxx
+**/
+VOID ConfigureLtr(INT16 Root, UINT8 Policy)
+{
+  BOOLEAN Enabled[MAX_TOPOLOGY_DEVICES];
+  TopologyDevice *Device;
+  UINT16 Latency;
+  UINT16 Offset;
+  UINTN Index;
+
+  Latency = EncodeLtrLatency((Policy == LINK_POLICY_LATENCY) ? LTR_MAX_LATENCY_LATENCY_NS : LTR_MAX_LATENCY_POWER_NS);
+
+  // Parents come before children, so the upstream end is always enabled first
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Enabled[Index] = FALSE;
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Root != Root || Device->PcieCap == 0)
+      continue;
+
+    if ((PcieCapRead32(Device, PCIE_REG_DEVICE_CAPABILITY2) & DEVCAP2_LTR) == 0)
+      continue;
+
+    if (Device->Parent >= 0 && !Enabled[Device->Parent])
+      continue;
+
+    PcieCapWrite16(Device, PCIE_REG_DEVICE_CONTROL2, PcieCapRead16(Device, PCIE_REG_DEVICE_CONTROL2) | DEVCTL2_LTR);
+    Enabled[Index] = TRUE;
+
+    // The limits live in the upstream port / function 0 of each device
+    Offset = FindExtendedCapability(Device, PCIE_EXT_CAP_ID_LTR);
+
+    if (Offset != 0)
+    {
+      PciCfgWrite16(Device->Bus, Device->Device, Device->Function, Offset + LTR_MAX_SNOOP_LATENCY, Latency);
+      PciCfgWrite16(Device->Bus, Device->Device, Device->Function, Offset + LTR_MAX_NO_SNOOP_LATENCY, Latency);
+    }
+
+    DEBUG((DEBUG_INFO, "ConfigureLtr(): %02X:%02X.%X LTR enabled%a\n",
+           Device->Bus, Device->Device, Device->Function, (Offset != 0) ? ", max latency set" : ""));
+  }
+}
+
+/**
+  Configure common clock, ASPM and LTR for one hot plug hierarchy, following
+  the policy of its root port
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigureLinkPower(INT16 Root)
+{
+  UINT8 Policy = GetLinkPolicy(&gHotPlugTopology.Devices[Root]);
+
+  DEBUG((DEBUG_INFO, "ConfigureLinkPower(): %02X:%02X.%X policy %a\n",
+         gHotPlugTopology.Devices[Root].Bus, gHotPlugTopology.Devices[Root].Device, gHotPlugTopology.Devices[Root].Function,
+         (Policy == LINK_POLICY_LATENCY) ? "latency" : "power"));
+
+  // Exit latencies depend on the clock configuration, so this goes first
+  ConfigureCommonClock(Root);
+  ConfigureAspm(Root, Policy);
+  ConfigureLtr(Root, Policy);
+}
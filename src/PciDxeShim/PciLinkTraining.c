@@ -0,0 +1,104 @@
+/**
+ * File: PciLinkTraining.c
+ * Author: Matthew Millman
+ *
+ * Checks that the links below the hot plug root ports trained at the speed
+ * and width both ends are capable of, and retrains the ones that didn't.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+#define LINK_RETRAIN_ATTEMPTS       3
+#define LINK_RETRAIN_SETTLE_US      10000   // Give the link a moment after training before checking it
+
+#define LINK_SPEED(x)               ((x) & 0x000F)
+#define LINK_WIDTH(x)               (((x) >> 4) & 0x003F)
+
+/**
+  Work out the speed and width a link ought to run at
+
+  @param  Port                Index of the downstream port of the link
+  @param  Speed               Returns the expected speed (1 = 2.5GT/s, 2 = 5GT/s...)
+  @param  Width               Returns the expected width
+**/
+VOID GetExpectedLink(INT16 Port, UINT8 *Speed, UINT8 *Width)
+{
+  TopologyDevice *Device = &gHotPlugTopology.Devices[Port];
+  UINT32 Capability;
+  UINTN Index;
+
+  Capability = PcieCapRead32(Device, PCIE_REG_LINK_CAPABILITY);
+
+  // The downstream port's target speed caps what the link will try for
+  *Speed = (UINT8)MIN(LINK_SPEED(Capability), LINK_SPEED(PcieCapRead16(Device, PCIE_REG_LINK_CONTROL2)));
+  *Width = (UINT8)LINK_WIDTH(Capability);
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Parent != Port || Device->PcieCap == 0)
+      continue;
+
+    Capability = PcieCapRead32(Device, PCIE_REG_LINK_CAPABILITY);
+    *Speed = (UINT8)MIN(*Speed, LINK_SPEED(Capability));
+    *Width = (UINT8)MIN(*Width, LINK_WIDTH(Capability));
+  }
+}
+
+/**
+  Check every link of a hot plug hierarchy against what both ends can do,
+  retrain those which came up short, and report where each one ended up
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID VerifyLinkTraining(INT16 Root)
+{
+  TopologyDevice *Port;
+  UINT16 Status;
+  UINT8 Speed;
+  UINT8 Width;
+  UINTN Attempt;
+  UINTN Index;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Port = &gHotPlugTopology.Devices[Index];
+
+    if (Port->Root != Root || Port->PcieCap == 0 || !HasLinkPartner((INT16)Index))
+      continue;
+
+    GetExpectedLink((INT16)Index, &Speed, &Width);
+    Status = PcieCapRead16(Port, PCIE_REG_LINK_STATUS);
+
+    for (Attempt = 0; Attempt < LINK_RETRAIN_ATTEMPTS && (LINK_SPEED(Status) < Speed || LINK_WIDTH(Status) < Width); Attempt++)
+    {
+      DEBUG((DEBUG_WARN, "VerifyLinkTraining(): %02X:%02X.%X at Gen%u x%u, expected Gen%u x%u. Retraining (%u/%u)\n",
+             Port->Bus, Port->Device, Port->Function, LINK_SPEED(Status), LINK_WIDTH(Status), Speed, Width,
+             Attempt + 1, LINK_RETRAIN_ATTEMPTS));
+
+      RetrainLink(Port);
+      gBS->Stall(LINK_RETRAIN_SETTLE_US);
+      Status = PcieCapRead16(Port, PCIE_REG_LINK_STATUS);
+    }
+
+    DEBUG((((LINK_SPEED(Status) < Speed || LINK_WIDTH(Status) < Width) ? DEBUG_ERROR : DEBUG_INFO),
+           "VerifyLinkTraining(): %02X:%02X.%X Gen%u x%u (capable of Gen%u x%u)\n",
+           Port->Bus, Port->Device, Port->Function, LINK_SPEED(Status), LINK_WIDTH(Status), Speed, Width));
+  }
+}
@@ -0,0 +1,626 @@
+/**
+ * File: PciOptionRom.c
+ * Author: Matthew Millman
+ *
+ * Option ROM policy for devices behind the hot plug ports. Applied through
+ * EFI_PCI_OVERRIDE_PROTOCOL: PciBus asks it for each device's ROM before
+ * dispatching, and handing back an empty one stops the dispatch.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+#include <Protocol/PciOverride.h>
+#include <Library/UefiDecompressLib.h>
+#include <IndustryStandard/Pci.h>
+#include <IndustryStandard/PeImage.h>
+
+//
+// OPROM_POLICY_ALLOW: Dispatch as normal.
+// OPROM_POLICY_SKIP:  Never dispatch. The device gets no UEFI driver from its ROM.
+// OPROM_POLICY_DEFER: Dispatch at ReadyToBoot, once the boot device is up. For
+//                     devices whose driver the OS is better off having run
+//                     (e.g. GOP) but which aren't needed to boot.
+//
+#define OPROM_POLICY_ALLOW          0
+#define OPROM_POLICY_SKIP           1
+#define OPROM_POLICY_DEFER          2
+
+// For devices behind a hot plug port which isn't in mOpRomPortPolicies
+#define OPROM_POLICY_DEFAULT        OPROM_POLICY_SKIP
+
+#define OPROM_ANY_ID                0xFFFF
+
+#define MAX_DEFERRED_ROMS           16
+
+// How long each device's ROM took to dispatch (LoadImage and StartImage), by VID/DID.
+// Measured around PciBus's own dispatch for allowed devices, and around the shim's for
+// deferred ones. Skipped and deferred devices log it as the time saved.
+#define OPROM_COST_VARIABLE         L"HotPlugOpRomCost"
+
+// A skipped device with no time recorded is deferred once instead, so the next boot
+// can report what skipping it saves. Set to FALSE if a skipped ROM must never run.
+#define OPROM_MEASURE_SKIPPED       TRUE
+
+#define MAX_OPROM_COSTS             16
+
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT8 Policy;
+} OPROM_PORT_POLICY;
+
+typedef struct
+{
+  UINT16 VendorId;
+  UINT16 DeviceId;      // OPROM_ANY_ID for all devices from the vendor
+  UINT8 Policy;
+} OPROM_DEVICE_POLICY;
+
+// Hot plug root ports which don't use OPROM_POLICY_DEFAULT, e.g. { 0x00, 0x1C, 0x04, OPROM_POLICY_DEFER }
+GLOBAL_REMOVE_IF_UNREFERENCED OPROM_PORT_POLICY mOpRomPortPolicies[] = {};
+
+// Devices which don't use their port's policy, checked first
+GLOBAL_REMOVE_IF_UNREFERENCED OPROM_DEVICE_POLICY mOpRomDevicePolicies[] = {
+  { 0x10DE, OPROM_ANY_ID, OPROM_POLICY_DEFER },  // eGPU, GOP for the OS console
+  { 0x1002, OPROM_ANY_ID, OPROM_POLICY_DEFER }
+};
+
+typedef struct
+{
+  UINT16 VendorId;
+  UINT16 DeviceId;
+  UINT32 Microseconds;
+} OPROM_COST;
+
+typedef struct
+{
+  EFI_HANDLE Handle;
+  EFI_PCI_IO_PROTOCOL *PciIo;
+  UINT16 VendorId;
+  UINT16 DeviceId;
+  UINTN Bus;
+  UINTN Device;
+  UINTN Function;
+  VOID *RomImage;
+  UINT64 RomSize;
+} DEFERRED_ROM;
+
+EFI_STATUS EFIAPI OpRomPlatformNotify(IN EFI_PCI_PLATFORM_PROTOCOL *This, IN EFI_HANDLE HostBridge, IN EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE Phase, IN EFI_PCI_EXECUTION_PHASE ExecPhase);
+EFI_STATUS EFIAPI OpRomPlatformPrepController(IN EFI_PCI_PLATFORM_PROTOCOL *This, IN EFI_HANDLE HostBridge, IN EFI_HANDLE RootBridge, IN EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS PciAddress, IN EFI_PCI_CONTROLLER_RESOURCE_ALLOCATION_PHASE Phase, IN EFI_PCI_EXECUTION_PHASE ExecPhase);
+EFI_STATUS EFIAPI OpRomGetPlatformPolicy(IN CONST EFI_PCI_PLATFORM_PROTOCOL *This, OUT EFI_PCI_PLATFORM_POLICY *PciPolicy);
+EFI_STATUS EFIAPI OpRomGetPciRom(IN CONST EFI_PCI_PLATFORM_PROTOCOL *This, IN EFI_HANDLE PciHandle, OUT VOID **RomImage, OUT UINTN *RomSize);
+
+EFI_PCI_OVERRIDE_PROTOCOL gPciOpRomOverride = {
+    OpRomPlatformNotify,
+    OpRomPlatformPrepController,
+    OpRomGetPlatformPolicy,
+    OpRomGetPciRom};
+
+STATIC DEFERRED_ROM mDeferredRoms[MAX_DEFERRED_ROMS];
+STATIC UINTN mDeferredRomCount = 0;
+STATIC UINT8 mEmptyRom[sizeof(EFI_PCI_EXPANSION_ROM_HEADER)];
+STATIC UINT64 mTscPerMs = 0;
+STATIC OPROM_COST mOpRomCosts[MAX_OPROM_COSTS];
+STATIC BOOLEAN mOpRomCostsLoaded = FALSE;
+STATIC BOOLEAN mOpRomCostsChanged = FALSE;
+
+// The allowed device PciBus is dispatching, until its bus specific driver override appears
+STATIC EFI_HANDLE mTimedHandle = NULL;
+STATIC UINT16 mTimedIds[2];
+STATIC UINT64 mTimedStart;
+STATIC EFI_EVENT mDispatchedEvent = NULL;
+STATIC EFI_EVENT mReadyToBootEvent = NULL;
+STATIC VOID *mDispatchedRegistration;
+
+EFI_STATUS EFIAPI OpRomPlatformNotify(IN EFI_PCI_PLATFORM_PROTOCOL *This, IN EFI_HANDLE HostBridge, IN EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE Phase, IN EFI_PCI_EXECUTION_PHASE ExecPhase)
+{
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI OpRomPlatformPrepController(IN EFI_PCI_PLATFORM_PROTOCOL *This, IN EFI_HANDLE HostBridge, IN EFI_HANDLE RootBridge, IN EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS PciAddress, IN EFI_PCI_CONTROLLER_RESOURCE_ALLOCATION_PHASE Phase, IN EFI_PCI_EXECUTION_PHASE ExecPhase)
+{
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS EFIAPI OpRomGetPlatformPolicy(IN CONST EFI_PCI_PLATFORM_PROTOCOL *This, OUT EFI_PCI_PLATFORM_POLICY *PciPolicy)
+{
+  return EFI_UNSUPPORTED;
+}
+
+/**
+  Convert TSC ticks to microseconds, calibrating against Stall() the first time
+
+  @param  Ticks               TSC ticks
+
+  @retval (value)             Microseconds
+**/
+UINT64 TscToMicroseconds(UINT64 Ticks)
+{
+  UINT64 Start;
+
+  if (mTscPerMs == 0)
+  {
+    Start = AsmReadTsc();
+    gBS->Stall(1000);
+    mTscPerMs = MAX(AsmReadTsc() - Start, 1);
+  }
+
+  return DivU64x64Remainder(MultU64x32(Ticks, 1000), mTscPerMs, NULL);
+}
+
+/**
+  Find the dispatch time recorded for a device's ROM, loading the table on first use
+
+  @param  VendorId            Vendor ID
+  @param  DeviceId            Device ID
+
+  @retval (value)             The entry, or NULL if it's never been measured
+**/
+OPROM_COST *FindOpRomCost(UINT16 VendorId, UINT16 DeviceId)
+{
+  UINTN Size = sizeof(mOpRomCosts);
+  UINTN Index;
+
+  if (!mOpRomCostsLoaded)
+  {
+    if (EFI_ERROR(gRT->GetVariable(OPROM_COST_VARIABLE, &gPciDxeShimVariableGuid, NULL, &Size, mOpRomCosts)))
+      ZeroMem(mOpRomCosts, sizeof(mOpRomCosts));
+
+    mOpRomCostsLoaded = TRUE;
+  }
+
+  for (Index = 0; Index < MAX_OPROM_COSTS; Index++)
+  {
+    if (mOpRomCosts[Index].Microseconds != 0 && mOpRomCosts[Index].VendorId == VendorId && mOpRomCosts[Index].DeviceId == DeviceId)
+      return &mOpRomCosts[Index];
+  }
+
+  return NULL;
+}
+
+/**
+  Record how long a device's ROM took to dispatch. A new device takes a free
+  entry, or failing that, the last one.
+
+  @param  VendorId            Vendor ID
+  @param  DeviceId            Device ID
+  @param  Microseconds        Dispatch time
+
+  @retval TRUE                The table changed
+**/
+BOOLEAN RecordOpRomCost(UINT16 VendorId, UINT16 DeviceId, UINT64 Microseconds)
+{
+  OPROM_COST *Cost;
+  UINTN Index;
+
+  Cost = FindOpRomCost(VendorId, DeviceId);
+
+  if (Cost == NULL)
+  {
+    for (Index = 0; Index < MAX_OPROM_COSTS - 1 && mOpRomCosts[Index].Microseconds != 0; Index++)
+      ;
+
+    Cost = &mOpRomCosts[Index];
+  }
+
+  // Zero means unused
+  Microseconds = MIN(MAX(Microseconds, 1), MAX_UINT32);
+
+  if (Cost->VendorId == VendorId && Cost->DeviceId == DeviceId && Cost->Microseconds == Microseconds)
+    return FALSE;
+
+  Cost->VendorId = VendorId;
+  Cost->DeviceId = DeviceId;
+  Cost->Microseconds = (UINT32)Microseconds;
+  return TRUE;
+}
+
+/**
+  Write the dispatch times back, if any of them moved
+**/
+VOID SaveOpRomCosts()
+{
+  if (!mOpRomCostsChanged)
+    return;
+
+  mOpRomCostsChanged = FALSE;
+
+  gRT->SetVariable(
+      OPROM_COST_VARIABLE,
+      &gPciDxeShimVariableGuid,
+      EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+      sizeof(mOpRomCosts),
+      mOpRomCosts);
+}
+
+/**
+  PciBus installs the bus specific driver override protocol on a device once
+  it has loaded and started the drivers in its ROM. That's the end of the
+  dispatch being timed.
+
+  @param  Event               Event whose notification function is being invoked.
+  @param  Context             Not used.
+**/
+VOID EFIAPI OnOpRomDispatched(IN EFI_EVENT Event, IN VOID *Context)
+{
+  EFI_HANDLE Handle;
+  UINTN Size;
+  UINT64 Elapsed;
+
+  for (;;)
+  {
+    Size = sizeof(Handle);
+
+    if (EFI_ERROR(gBS->LocateHandle(ByRegisterNotify, NULL, mDispatchedRegistration, &Size, &Handle)))
+      break;
+
+    if (Handle != mTimedHandle)
+      continue;
+
+    Elapsed = TscToMicroseconds(AsmReadTsc() - mTimedStart);
+    mTimedHandle = NULL;
+
+    if (RecordOpRomCost(mTimedIds[0], mTimedIds[1], Elapsed))
+      mOpRomCostsChanged = TRUE;
+
+    DEBUG((DEBUG_INFO, "OnOpRomDispatched(): %04X:%04X took %lu us to dispatch in PciBus start\n", mTimedIds[0], mTimedIds[1], Elapsed));
+  }
+}
+
+/**
+  Start timing PciBus's dispatch of an allowed device's ROM
+
+  @param  PciHandle           The device
+  @param  Ids                 Its vendor and device ID
+**/
+VOID TimePciBusDispatch(EFI_HANDLE PciHandle, UINT16 *Ids)
+{
+  if (mDispatchedEvent == NULL)
+  {
+    mDispatchedEvent = EfiCreateProtocolNotifyEvent(&gEfiBusSpecificDriverOverrideProtocolGuid, TPL_CALLBACK,
+                                                    OnOpRomDispatched, NULL, &mDispatchedRegistration);
+
+    if (mDispatchedEvent == NULL)
+      return;
+  }
+
+  // A ROM none of whose images started never gets the protocol, the next device just takes over
+  mTimedHandle = PciHandle;
+  mTimedIds[0] = Ids[0];
+  mTimedIds[1] = Ids[1];
+  mTimedStart = AsmReadTsc();
+}
+
+/**
+  Get the option ROM policy for a device, if it's below a hot plug port
+
+  @param  PciIo               The device
+  @param  HotPlug             Set to TRUE if the device is below a hot plug port
+
+  @retval (value)             OPROM_POLICY_xxx
+**/
+UINT8 GetOpRomPolicy(EFI_PCI_IO_PROTOCOL *PciIo, BOOLEAN *HotPlug)
+{
+  TopologyDevice *Port;
+  UINTN Segment, Bus, Device, Function;
+  UINT16 Ids[2];
+  UINTN Index;
+  INT16 Root;
+
+  *HotPlug = FALSE;
+
+  if (EFI_ERROR(PciIo->GetLocation(PciIo, &Segment, &Bus, &Device, &Function)))
+    return OPROM_POLICY_ALLOW;
+
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint16, PCI_VENDOR_ID_OFFSET, 2, Ids);
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    if (gHotPlugTopology.Devices[Index].Bus == Bus && gHotPlugTopology.Devices[Index].Device == Device && gHotPlugTopology.Devices[Index].Function == Function)
+      break;
+  }
+
+  // Not below a hot plug port, so none of our business
+  if (Index == gHotPlugTopology.Count || gHotPlugTopology.Devices[Index].Root < 0)
+    return OPROM_POLICY_ALLOW;
+
+  *HotPlug = TRUE;
+  Root = gHotPlugTopology.Devices[Index].Root;
+
+  for (Index = 0; Index < ARRAY_SIZE(mOpRomDevicePolicies); Index++)
+  {
+    if (mOpRomDevicePolicies[Index].VendorId == Ids[0] &&
+        (mOpRomDevicePolicies[Index].DeviceId == OPROM_ANY_ID || mOpRomDevicePolicies[Index].DeviceId == Ids[1]))
+      return mOpRomDevicePolicies[Index].Policy;
+  }
+
+  Port = &gHotPlugTopology.Devices[Root];
+
+  for (Index = 0; Index < ARRAY_SIZE(mOpRomPortPolicies); Index++)
+  {
+    if (mOpRomPortPolicies[Index].Bus == Port->Bus && mOpRomPortPolicies[Index].Device == Port->Device && mOpRomPortPolicies[Index].Function == Port->Function)
+      return mOpRomPortPolicies[Index].Policy;
+  }
+
+  return OPROM_POLICY_DEFAULT;
+}
+
+/**
+  Count the UEFI images in an option ROM
+
+  @param  Rom                 ROM image
+  @param  RomSize             Size of the image
+
+  @retval (value)             Number of UEFI images
+**/
+UINTN CountEfiImages(UINT8 *Rom, UINT64 RomSize)
+{
+  EFI_PCI_EXPANSION_ROM_HEADER *Header;
+  PCI_DATA_STRUCTURE *Pcir;
+  UINT64 Offset = 0;
+  UINTN Count = 0;
+
+  while (Offset + sizeof(EFI_PCI_EXPANSION_ROM_HEADER) <= RomSize)
+  {
+    Header = (EFI_PCI_EXPANSION_ROM_HEADER *)(Rom + Offset);
+
+    if (Header->Signature != PCI_EXPANSION_ROM_HEADER_SIGNATURE || Offset + Header->PcirOffset + sizeof(PCI_DATA_STRUCTURE) > RomSize)
+      break;
+
+    Pcir = (PCI_DATA_STRUCTURE *)(Rom + Offset + Header->PcirOffset);
+
+    if (Pcir->CodeType == PCI_CODE_TYPE_EFI_IMAGE && Header->EfiSignature == EFI_PCI_EXPANSION_ROM_HEADER_EFISIGNATURE)
+      Count++;
+
+    if ((Pcir->Indicator & 0x80) != 0 || Pcir->ImageLength == 0)
+      break;
+
+    Offset += (UINT64)Pcir->ImageLength * 512;
+  }
+
+  return Count;
+}
+
+/**
+  Load and start the UEFI drivers in an option ROM, the way PciBus would have
+
+  @param  Rom                 The deferred ROM
+**/
+VOID DispatchDeferredRom(DEFERRED_ROM *Rom)
+{
+  EFI_PCI_EXPANSION_ROM_HEADER *Header;
+  MEDIA_RELATIVE_OFFSET_RANGE_DEVICE_PATH OffsetNode;
+  EFI_DEVICE_PATH_PROTOCOL *FilePath;
+  PCI_DATA_STRUCTURE *Pcir;
+  EFI_HANDLE ImageHandle;
+  EFI_STATUS Status;
+  UINT8 *Image = (UINT8 *)Rom->RomImage;
+  UINT64 Offset = 0;
+  UINT64 ImageSize;
+  VOID *Buffer;
+  VOID *Scratch;
+  UINT32 Size;
+  UINT32 ScratchSize;
+
+  while (Offset + sizeof(EFI_PCI_EXPANSION_ROM_HEADER) <= Rom->RomSize)
+  {
+    Header = (EFI_PCI_EXPANSION_ROM_HEADER *)(Image + Offset);
+
+    if (Header->Signature != PCI_EXPANSION_ROM_HEADER_SIGNATURE || Offset + Header->PcirOffset + sizeof(PCI_DATA_STRUCTURE) > Rom->RomSize)
+      break;
+
+    Pcir = (PCI_DATA_STRUCTURE *)(Image + Offset + Header->PcirOffset);
+    ImageSize = (UINT64)Pcir->ImageLength * 512;
+
+    if (ImageSize == 0 || Offset + ImageSize > Rom->RomSize)
+      break;
+
+    if (Pcir->CodeType == PCI_CODE_TYPE_EFI_IMAGE && Header->EfiSignature == EFI_PCI_EXPANSION_ROM_HEADER_EFISIGNATURE &&
+        Header->EfiMachineType == EFI_IMAGE_MACHINE_X64 && Header->EfiSubsystem == EFI_IMAGE_SUBSYSTEM_EFI_BOOT_SERVICE_DRIVER)
+    {
+      Buffer = Image + Offset + Header->EfiImageHeaderOffset;
+      Size = (UINT32)(ImageSize - Header->EfiImageHeaderOffset);
+      Scratch = NULL;
+
+      if (Header->CompressionType == EFI_PCI_EXPANSION_ROM_HEADER_COMPRESSED)
+      {
+        VOID *Compressed = Buffer;
+
+        Buffer = NULL;
+
+        if (!RETURN_ERROR(UefiDecompressGetInfo(Compressed, Size, &Size, &ScratchSize)))
+        {
+          Buffer = AllocatePool(Size);
+          Scratch = AllocatePool(ScratchSize);
+
+          if (Buffer != NULL && Scratch != NULL && RETURN_ERROR(UefiDecompress(Compressed, Buffer, Scratch)))
+          {
+            FreePool(Buffer);
+            Buffer = NULL;
+          }
+        }
+      }
+
+      if (Buffer != NULL)
+      {
+        // Same device path PciBus gives ROM images, so the security policy sees the same thing
+        OffsetNode.Header.Type = MEDIA_DEVICE_PATH;
+        OffsetNode.Header.SubType = MEDIA_RELATIVE_OFFSET_RANGE_DP;
+        SetDevicePathNodeLength(&OffsetNode.Header, sizeof(OffsetNode));
+        OffsetNode.Reserved = 0;
+        OffsetNode.StartingOffset = Offset;
+        OffsetNode.EndingOffset = Offset + ImageSize - 1;
+
+        FilePath = AppendDevicePathNode(DevicePathFromHandle(Rom->Handle), &OffsetNode.Header);
+        Status = gBS->LoadImage(FALSE, gImageHandle, FilePath, Buffer, Size, &ImageHandle);
+
+        if (!EFI_ERROR(Status))
+          Status = gBS->StartImage(ImageHandle, NULL, NULL);
+
+        DEBUG((DEBUG_INFO, "DispatchDeferredRom(): Image at 0x%lx: %r\n", Offset, Status));
+
+        if (FilePath != NULL)
+          FreePool(FilePath);
+
+        if (Header->CompressionType == EFI_PCI_EXPANSION_ROM_HEADER_COMPRESSED)
+          FreePool(Buffer);
+      }
+
+      if (Scratch != NULL)
+        FreePool(Scratch);
+    }
+
+    if ((Pcir->Indicator & 0x80) != 0)
+      break;
+
+    Offset += ImageSize;
+  }
+}
+
+/**
+  Dispatch the deferred option ROMs, now the boot device is up
+
+  @param  Event               Event whose notification function is being invoked.
+  @param  Context             Not used.
+**/
+VOID EFIAPI OnReadyToBootDispatchRoms(IN EFI_EVENT Event, IN VOID *Context)
+{
+  DEFERRED_ROM *Rom;
+  UINT64 Start;
+  UINT64 Dispatched;
+  UINTN Index;
+
+  gBS->CloseEvent(Event);
+
+  for (Index = 0; Index < mDeferredRomCount; Index++)
+  {
+    Rom = &mDeferredRoms[Index];
+    Start = AsmReadTsc();
+
+    // Drivers may look for tables in the ROM, so give them the real one back
+    Rom->PciIo->RomImage = Rom->RomImage;
+    Rom->PciIo->RomSize = Rom->RomSize;
+
+    DispatchDeferredRom(Rom);
+
+    // Only the dispatch is recorded, that's the part PciBus would have done during its start
+    Dispatched = AsmReadTsc();
+
+    if (RecordOpRomCost(Rom->VendorId, Rom->DeviceId, TscToMicroseconds(Dispatched - Start)))
+      mOpRomCostsChanged = TRUE;
+
+    gBS->ConnectController(Rom->Handle, NULL, NULL, TRUE);
+
+    DEBUG((DEBUG_INFO, "OnReadyToBootDispatchRoms(): %02X:%02X.%X dispatch %lu us, connect %lu us, off the PciBus start path\n",
+           Rom->Bus, Rom->Device, Rom->Function, TscToMicroseconds(Dispatched - Start), TscToMicroseconds(AsmReadTsc() - Dispatched)));
+  }
+
+  if (mDispatchedEvent != NULL)
+  {
+    gBS->CloseEvent(mDispatchedEvent);
+    mDispatchedEvent = NULL;
+  }
+
+  SaveOpRomCosts();
+}
+
+/**
+  Called by PciBus for each device before it dispatches the device's option ROM.
+  Skipped and deferred devices get an empty ROM, so there's nothing to dispatch.
+
+  @param  This                Protocol instance
+  @param  PciHandle           The device
+  @param  RomImage            Receives the ROM PciBus should use
+  @param  RomSize             Receives its size
+
+  @retval EFI_SUCCESS         Use the returned ROM
+  @retval EFI_NOT_FOUND       Use the device's own ROM
+**/
+EFI_STATUS EFIAPI OpRomGetPciRom(IN CONST EFI_PCI_PLATFORM_PROTOCOL *This, IN EFI_HANDLE PciHandle, OUT VOID **RomImage, OUT UINTN *RomSize)
+{
+  EFI_PCI_IO_PROTOCOL *PciIo;
+  UINTN Segment, Bus, Device, Function;
+  OPROM_COST *Cost;
+  BOOLEAN HotPlug;
+  BOOLEAN Measuring = FALSE;
+  UINT16 Ids[2];
+  UINT8 Policy;
+  UINTN Images;
+
+  if (EFI_ERROR(gBS->HandleProtocol(PciHandle, &gEfiPciIoProtocolGuid, (VOID **)&PciIo)))
+    return EFI_NOT_FOUND;
+
+  if (PciIo->RomImage == NULL || PciIo->RomSize == 0)
+    return EFI_NOT_FOUND;
+
+  Images = CountEfiImages((UINT8 *)PciIo->RomImage, PciIo->RomSize);
+
+  if (Images == 0)
+    return EFI_NOT_FOUND;
+
+  Policy = GetOpRomPolicy(PciIo, &HotPlug);
+  PciIo->GetLocation(PciIo, &Segment, &Bus, &Device, &Function);
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint16, PCI_VENDOR_ID_OFFSET, 2, Ids);
+  Cost = FindOpRomCost(Ids[0], Ids[1]);
+
+  // Deferred ROMs are dispatched there, and the times get saved
+  if (HotPlug && mReadyToBootEvent == NULL)
+    EfiCreateEventReadyToBootEx(TPL_CALLBACK, OnReadyToBootDispatchRoms, NULL, &mReadyToBootEvent);
+
+  if (OPROM_MEASURE_SKIPPED && Policy == OPROM_POLICY_SKIP && Cost == NULL && mDeferredRomCount < MAX_DEFERRED_ROMS)
+  {
+    Policy = OPROM_POLICY_DEFER;
+    Measuring = TRUE;
+  }
+
+  if (Policy == OPROM_POLICY_DEFER && mDeferredRomCount == MAX_DEFERRED_ROMS)
+    Policy = OPROM_POLICY_ALLOW;
+
+  if (Policy == OPROM_POLICY_ALLOW)
+  {
+    if (HotPlug)
+      TimePciBusDispatch(PciHandle, Ids);
+
+    return EFI_NOT_FOUND;
+  }
+
+  if (Policy == OPROM_POLICY_DEFER)
+  {
+    mDeferredRoms[mDeferredRomCount].Handle = PciHandle;
+    mDeferredRoms[mDeferredRomCount].PciIo = PciIo;
+    mDeferredRoms[mDeferredRomCount].VendorId = Ids[0];
+    mDeferredRoms[mDeferredRomCount].DeviceId = Ids[1];
+    mDeferredRoms[mDeferredRomCount].Bus = Bus;
+    mDeferredRoms[mDeferredRomCount].Device = Device;
+    mDeferredRoms[mDeferredRomCount].Function = Function;
+    mDeferredRoms[mDeferredRomCount].RomImage = PciIo->RomImage;
+    mDeferredRoms[mDeferredRomCount].RomSize = PciIo->RomSize;
+    mDeferredRomCount++;
+  }
+
+  DEBUG((DEBUG_INFO, "OpRomGetPciRom(): %02X:%02X.%X: %a %u UEFI image(s), %lu KB\n",
+         Bus, Device, Function,
+         Measuring ? "deferred once to time" : Policy == OPROM_POLICY_DEFER ? "deferred" : "skipped", Images, DivU64x32(PciIo->RomSize, 1024)));
+
+  // Known from the first time a ROM with the same VID/DID was dispatched, by PciBus or by us
+  if (Cost != NULL)
+    DEBUG((DEBUG_INFO, "OpRomGetPciRom(): %02X:%02X.%X: ~%u us saved from PciBus start\n", Bus, Device, Function, Cost->Microseconds));
+
+  *RomImage = mEmptyRom;
+  *RomSize = 0;
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,143 @@
+/**
+ * File: PciPtm.c
+ * Author: Matthew Millman
+ *
+ * Enables Precision Time Measurement from the hot plug root ports down to
+ * every endpoint which can use it.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+#define PCIE_EXT_CAP_ID_PTM         0x001F
+#define PTM_CAPABILITY              0x04
+#define PTM_CONTROL                 0x08
+
+#define PTM_CAP_REQUESTER           BIT0
+#define PTM_CAP_RESPONDER           BIT1
+#define PTM_CAP_ROOT                BIT2
+#define PTM_CAP_GRANULARITY(x)      (((x) >> 8) & 0xFF)
+
+#define PTM_CTL_ENABLE              BIT0
+#define PTM_CTL_ROOT_SELECT         BIT1
+#define PTM_CTL_GRANULARITY_SHIFT   8
+
+/**
+  Find the nearest device above this one on the path which takes part in PTM.
+  Switch downstream ports don't have the capability, the switch's upstream
+  port speaks for them.
+
+  @param  PtmCap              PTM capability offset of each device
+  @param  Index               Device to start from
+
+  @retval (value)             Index of the device, -1 if the path is broken
+**/
+INT16 FindPtmUpstream(UINT16 *PtmCap, INT16 Index)
+{
+  INT16 Upstream = gHotPlugTopology.Devices[Index].Parent;
+
+  while (Upstream >= 0 && PtmCap[Upstream] == 0)
+  {
+    if (gHotPlugTopology.Devices[Upstream].PortType != PCIE_DEVICE_PORT_TYPE_DOWNSTREAM_PORT)
+      return -1;
+
+    Upstream = gHotPlugTopology.Devices[Upstream].Parent;
+  }
+
+  return Upstream;
+}
+
+/**
+  Enable PTM at every hop of a hot plug hierarchy where the path back to the
+  root port supports it, and report the granularity at each hop
+
+  @param  Root                Index of the hot plug root port
+**/
+VOID ConfigurePtm(INT16 Root)
+{
+  UINT16 PtmCap[MAX_TOPOLOGY_DEVICES];
+  UINT8 Granularity[MAX_TOPOLOGY_DEVICES];
+  BOOLEAN Enabled[MAX_TOPOLOGY_DEVICES];
+  TopologyDevice *Device;
+  UINT32 Capability;
+  UINT32 Control;
+  INT16 Upstream;
+  UINTN Index;
+
+  // Parents come before children, so each hop is decided before the ones below it
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+    PtmCap[Index] = 0;
+    Granularity[Index] = 0;
+    Enabled[Index] = FALSE;
+
+    if (Device->Root != Root)
+      continue;
+
+    PtmCap[Index] = FindExtendedCapability(Device, PCIE_EXT_CAP_ID_PTM);
+
+    if (PtmCap[Index] == 0)
+      continue;
+
+    Capability = PciCfgRead32(Device->Bus, Device->Device, Device->Function, PtmCap[Index] + PTM_CAPABILITY);
+    Control = PciCfgRead32(Device->Bus, Device->Device, Device->Function, PtmCap[Index] + PTM_CONTROL) & ~(PTM_CTL_ENABLE | PTM_CTL_ROOT_SELECT | (0xFF << PTM_CTL_GRANULARITY_SHIFT));
+
+    if (Device->Parent < 0)
+    {
+      // The root port is where PTM time comes from
+      if ((Capability & PTM_CAP_ROOT) == 0)
+      {
+        DEBUG((DEBUG_INFO, "ConfigurePtm(): %02X:%02X.%X isn't a PTM root, nothing below it can use PTM\n",
+               Device->Bus, Device->Device, Device->Function));
+        return;
+      }
+
+      Granularity[Index] = (UINT8)PTM_CAP_GRANULARITY(Capability);
+      Control |= PTM_CTL_ROOT_SELECT;
+    }
+    else
+    {
+      Upstream = FindPtmUpstream(PtmCap, (INT16)Index);
+
+      if (Upstream < 0 || !Enabled[Upstream] || (Capability & PTM_CAP_REQUESTER) == 0)
+      {
+        DEBUG((DEBUG_INFO, "ConfigurePtm(): %02X:%02X.%X can't use PTM, %a\n", Device->Bus, Device->Device, Device->Function,
+               ((Capability & PTM_CAP_REQUESTER) == 0) ? "not a requester" : "path to the root port doesn't support it"));
+        continue;
+      }
+
+      // Switches have to be responders too, or nothing below them will get an answer
+      if (!IsEndpoint(Device) && (Capability & PTM_CAP_RESPONDER) == 0)
+        continue;
+
+      // 0 means unknown. Otherwise the coarsest clock on the way down wins.
+      if (Granularity[Upstream] != 0 && PTM_CAP_GRANULARITY(Capability) != 0)
+        Granularity[Index] = (UINT8)MAX(Granularity[Upstream], PTM_CAP_GRANULARITY(Capability));
+      else if (IsEndpoint(Device))
+        Granularity[Index] = Granularity[Upstream];
+    }
+
+    Control |= PTM_CTL_ENABLE | ((UINT32)Granularity[Index] << PTM_CTL_GRANULARITY_SHIFT);
+    PciCfgWrite32(Device->Bus, Device->Device, Device->Function, PtmCap[Index] + PTM_CONTROL, Control);
+    Enabled[Index] = TRUE;
+
+    DEBUG((DEBUG_INFO, "ConfigurePtm(): %*a%02X:%02X.%X PTM enabled, local granularity %uns, effective %uns\n",
+           Device->Depth * 2, "", Device->Bus, Device->Device, Device->Function,
+           PTM_CAP_GRANULARITY(Capability), Granularity[Index]));
+  }
+}
@@ -0,0 +1,154 @@
+/**
+ * File: PciRescan.c
+ * Author: Matthew Millman
+ *
+ * Rescans a single hot plug port through PciBus's hot plug request protocol,
+ * so a dock plugged in after enumeration can be picked up without
+ * disconnecting the whole root bridge.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+#include <Protocol/PciHotPlugRequest.h>
+
+#define RESCAN_MAX_CHILDREN         255
+
+EFI_GUID gPciHotPlugRescanProtocolGuid = {0x9A4C2E61, 0x57D8, 0x4B13, {0x8F, 0x26, 0xC1, 0x0B, 0x93, 0x7E, 0x44, 0xA5}};
+
+EFI_STATUS EFIAPI RescanHotPlugPort(PCI_HOT_PLUG_RESCAN_PROTOCOL *This, EFI_DEVICE_PATH_PROTOCOL *PortDevicePath, UINTN *NumberOfChildren);
+
+PCI_HOT_PLUG_RESCAN_PROTOCOL gPciHotPlugRescan = {
+    PCI_HOT_PLUG_RESCAN_PROTOCOL_REVISION,
+    RescanHotPlugPort};
+
+/**
+  Find the root bridge mapping a device path sits under
+
+  @param  DevicePath          Device path below a root bridge
+
+  @retval (value)             Mapping, NULL if there isn't one
+**/
+RootBridgeIoProtocolMapping *FindRootBridgeIoMappingByDevicePath(EFI_DEVICE_PATH_PROTOCOL *DevicePath)
+{
+  LIST_ENTRY *mappingEntry;
+  EFI_HANDLE Handle;
+
+  if (EFI_ERROR(gBS->LocateDevicePath(&gEfiPciRootBridgeIoProtocolGuid, &DevicePath, &Handle)))
+    return NULL;
+
+  for (mappingEntry = GetFirstNode(&RootBridgeIoProtocolList); !IsNull(&RootBridgeIoProtocolList, mappingEntry); mappingEntry = GetNextNode(&RootBridgeIoProtocolList, mappingEntry))
+  {
+    RootBridgeIoProtocolMapping *mapping = (RootBridgeIoProtocolMapping *)mappingEntry;
+
+    if (mapping->Controller == Handle)
+      return mapping;
+  }
+
+  return NULL;
+}
+
+/**
+  Throw away whatever PciBus knows about the devices below a hot plug port,
+  enumerate them again, and connect drivers to what's found. PciBus only
+  allocates from the port's own windows here, so this relies on the padding
+  reserved at boot.
+
+  @param  This                  Protocol instance
+  @param  PortDevicePath        Device path of the hot plug port
+  @param  NumberOfChildren      Optional, receives the number of devices directly below the port
+
+  @retval EFI_SUCCESS           Port rescanned
+  @retval EFI_NOT_FOUND         No such port
+  @retval EFI_UNSUPPORTED       PciBus doesn't do hot plug requests
+  @retval other                 PciBus couldn't enumerate or allocate resources for the new devices,
+                                or a driver failed to start on one of them
+**/
+EFI_STATUS EFIAPI RescanHotPlugPort(PCI_HOT_PLUG_RESCAN_PROTOCOL *This, EFI_DEVICE_PATH_PROTOCOL *PortDevicePath, UINTN *NumberOfChildren)
+{
+  EFI_PCI_HOTPLUG_REQUEST_PROTOCOL *HotPlugRequest;
+  RootBridgeIoProtocolMapping *Mapping;
+  EFI_DEVICE_PATH_PROTOCOL *Remaining = PortDevicePath;
+  EFI_HANDLE Children[RESCAN_MAX_CHILDREN];
+  EFI_HANDLE Port;
+  EFI_STATUS Status;
+  EFI_STATUS ConnectStatus = EFI_SUCCESS;
+  UINT8 Count = 0;
+  UINTN Index;
+
+  if (NumberOfChildren != NULL)
+    *NumberOfChildren = 0;
+
+  if (PortDevicePath == NULL)
+    return EFI_INVALID_PARAMETER;
+
+  Status = gBS->LocateProtocol(&gEfiPciHotPlugRequestProtocolGuid, NULL, (VOID **)&HotPlugRequest);
+
+  if (EFI_ERROR(Status))
+    return EFI_UNSUPPORTED;
+
+  Status = gBS->LocateDevicePath(&gEfiPciIoProtocolGuid, &Remaining, &Port);
+
+  if (EFI_ERROR(Status) || !IsDevicePathEnd(Remaining))
+    return EFI_NOT_FOUND;
+
+  // PciBus only enumerates a bridge with no children, so clear out what's there first.
+  // A zero count removes everything, but PciBus still insists on a buffer.
+  Status = HotPlugRequest->Notify(HotPlugRequest, EfiPciHotplugRequestRemove, Port, NULL, &Count, Children);
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "RescanHotPlugPort(): Couldn't remove old devices: %r\n", Status));
+    return Status;
+  }
+
+  Status = HotPlugRequest->Notify(HotPlugRequest, EfiPciHotPlugRequestAdd, Port, NULL, &Count, Children);
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "RescanHotPlugPort(): Couldn't add devices: %r\n", Status));
+    return Status;
+  }
+
+  DEBUG((DEBUG_INFO, "RescanHotPlugPort(): %u device(s) found\n", Count));
+
+  // Same tuning as at boot, before any drivers start using the new devices
+  Mapping = FindRootBridgeIoMappingByDevicePath(PortDevicePath);
+
+  if (Mapping != NULL)
+  {
+    TuneHotPlugHierarchies(Mapping);
+    RefreshPruning(Mapping);
+  }
+
+  for (Index = 0; Index < Count; Index++)
+  {
+    Status = gBS->ConnectController(Children[Index], NULL, NULL, TRUE);
+
+    // Not found just means nothing has a driver for it
+    if (EFI_ERROR(Status) && Status != EFI_NOT_FOUND)
+    {
+      DEBUG((DEBUG_ERROR, "RescanHotPlugPort(): Couldn't connect child %u: %r\n", Index, Status));
+
+      if (!EFI_ERROR(ConnectStatus))
+        ConnectStatus = Status;
+    }
+  }
+
+  if (NumberOfChildren != NULL)
+    *NumberOfChildren = Count;
+
+  // The devices are enumerated either way, so the count is still worth returning
+  return ConnectStatus;
+}
@@ -0,0 +1,359 @@
+/**
+ * File: PciResizableBar.c
+ * Author: Matthew Millman
+ *
+ * Grows resizable BARs of devices behind the hot plug root ports before
+ * PciBus sizes them, so drivers get the whole BAR rather than the minimum.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+#define PCIE_EXT_CAP_ID_REBAR       0x0015
+#define REBAR_CAPABILITY(n)         (0x04 + (n) * 8)
+#define REBAR_CONTROL(n)            (0x08 + (n) * 8)
+
+#define REBAR_CTL_BAR_INDEX(x)      ((x) & 0x7)
+#define REBAR_CTL_BAR_COUNT(x)      (((x) >> 5) & 0x7)
+#define REBAR_CTL_SIZE_SHIFT        8
+#define REBAR_CTL_SIZE_MASK         (0x3F << REBAR_CTL_SIZE_SHIFT)
+#define REBAR_CAP_SIZES(x)          ((x) >> 4)      // Bit n set: 1MB << n supported
+
+#define REBAR_SIZE(n)               LShiftU64(SIZE_1MB, (n))
+
+#define MAX_RESIZED_BARS            16
+
+#define REBAR_MAX_CONTROLS          6       // One per BAR at most
+#define REBAR_MAX_SIZE              27      // Largest size the capability register reports, 128TB
+
+#define BRIDGE_BAR_COUNT            2
+
+// Set when allocation failed with resized BARs, holding the CRC of the devices which were
+// plugged in. While the same devices are there, BARs are left at their default size.
+#define REBAR_FALLBACK_VARIABLE     L"HotPlugReBarFallback"
+
+EFI_GUID gPciDxeShimVariableGuid = {0x5B3E9C07, 0x1F64, 0x4D2A, {0x9E, 0x83, 0x7A, 0x0C, 0x4B, 0xD1, 0x62, 0xF5}};
+
+typedef struct
+{
+  UINT8 Bus;
+  UINT8 Device;
+  UINT8 Function;
+  UINT16 Control;       // Offset of the control register
+  UINT32 Original;      // What it held before we touched it
+} RESIZED_BAR;
+
+RESIZED_BAR mResizedBars[MAX_RESIZED_BARS];
+UINTN mResizedBarCount = 0;
+UINT32 mHotPlugDeviceCrc = 0;
+
+/**
+  Work out a CRC of the IDs of everything in the hot plug topology, so a
+  fallback can be tied to the devices which caused it
+
+  @retval (value)             CRC, 0 if it couldn't be calculated
+**/
+UINT32 GetHotPlugDeviceCrc()
+{
+  UINT32 Ids[MAX_TOPOLOGY_DEVICES];
+  UINT32 Crc = 0;
+  UINTN Index;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Ids[Index] = PciCfgRead32(gHotPlugTopology.Devices[Index].Bus, gHotPlugTopology.Devices[Index].Device,
+                              gHotPlugTopology.Devices[Index].Function, PCI_VENDOR_ID_OFFSET);
+  }
+
+  if (gHotPlugTopology.Count != 0)
+    gBS->CalculateCrc32(Ids, gHotPlugTopology.Count * sizeof(UINT32), &Crc);
+
+  return Crc;
+}
+
+/**
+  Ask the hot plug init protocol how much memory and prefetchable memory
+  padding a root port gets
+
+  @param  HotPlugInit         Hot plug init protocol
+  @param  Port                The root port
+  @param  Mem                 Returns the memory padding in bytes
+  @param  PMem                Returns the prefetchable memory padding in bytes
+**/
+VOID GetPortPadding(EFI_PCI_HOT_PLUG_INIT_PROTOCOL *HotPlugInit, TopologyDevice *Port, UINT64 *Mem, UINT64 *PMem)
+{
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Padding = NULL;
+  EFI_HPC_STATE State;
+  EFI_HPC_PADDING_ATTRIBUTES Attributes;
+
+  *Mem = 0;
+  *PMem = 0;
+
+  if (Port->HpcDevicePath == NULL)
+    return;
+
+  if (EFI_ERROR(HotPlugInit->GetResourcePadding(HotPlugInit, Port->HpcDevicePath, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0),
+                                                &State, (VOID **)&Padding, &Attributes)))
+    return;
+
+  for (Descriptor = Padding; Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Descriptor++)
+  {
+    if (Descriptor->ResType != ACPI_ADDRESS_SPACE_TYPE_MEM)
+      continue;
+
+    if (Descriptor->SpecificFlag & EFI_ACPI_MEMORY_RESOURCE_SPECIFIC_FLAG_CACHEABLE_PREFETCHABLE)
+      *PMem += Descriptor->AddrLen;
+    else
+      *Mem += Descriptor->AddrLen;
+  }
+
+  FreePool(Padding);
+}
+
+/**
+  Take the BARs already below a root port out of its padding. PciBus makes the
+  window the larger of the padding and what's below it, so only what's left of
+  the padding can go on growth without the window getting any bigger.
+
+  @param  Root                Index of the hot plug root port
+  @param  Mem                 Memory padding of the port, updated
+  @param  PMem                Prefetchable memory padding of the port, updated
+**/
+VOID SubtractPortBars(INT16 Root, UINT64 *Mem, UINT64 *PMem)
+{
+  TopologyDevice *Device;
+  BOOLEAN Prefetchable;
+  UINT64 *Window;
+  UINT64 Base;
+  UINT64 Size;
+  UINTN BarCount;
+  UINTN BarIndex;
+  UINTN Index;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    // The port's own BARs sit outside its window
+    if (Device->Root != Root || Device->Parent < 0)
+      continue;
+
+    if ((Device->HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_PCI_TO_PCI_BRIDGE)
+      BarCount = BRIDGE_BAR_COUNT;
+    else
+      BarCount = PCI_MAX_BAR;
+
+    for (BarIndex = 0; BarIndex < BarCount; BarIndex++)
+    {
+      Size = SizeMemoryBar(Device, &BarIndex, &Base, &Prefetchable);
+
+      if (Size == 0)
+        continue;
+
+      Window = Prefetchable ? PMem : Mem;
+      *Window = (*Window > Size) ? *Window - Size : 0;
+    }
+  }
+}
+
+/**
+  Resize the BARs of one device to the largest supported size which still fits
+  in what's left of its port's padding
+
+  @param  Device              Device with a resizable BAR capability
+  @param  Offset              Offset of the capability
+  @param  Mem                 Memory padding left under the port, updated
+  @param  PMem                Prefetchable memory padding left under the port, updated
+**/
+VOID ResizeDeviceBars(TopologyDevice *Device, UINT16 Offset, UINT64 *Mem, UINT64 *PMem)
+{
+  UINT32 Capability;
+  UINT32 Control;
+  UINT32 Bar;
+  UINT32 Sizes;
+  UINT64 *Window;
+  UINT64 Growth;
+  UINTN Current;
+  UINTN Size;
+  UINTN Count;
+  UINTN Index;
+
+  Count = REBAR_CTL_BAR_COUNT(PciCfgRead32(Device->Bus, Device->Device, Device->Function, Offset + REBAR_CONTROL(0)));
+
+  for (Index = 0; Index < Count && Index < REBAR_MAX_CONTROLS; Index++)
+  {
+    Capability = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Offset + REBAR_CAPABILITY(Index));
+    Control = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Offset + REBAR_CONTROL(Index));
+    Bar = PciCfgRead32(Device->Bus, Device->Device, Device->Function, PCI_BASE_ADDRESSREG_OFFSET + REBAR_CTL_BAR_INDEX(Control) * 4);
+    Sizes = REBAR_CAP_SIZES(Capability);
+    Current = (Control & REBAR_CTL_SIZE_MASK) >> REBAR_CTL_SIZE_SHIFT;
+    Window = (Bar & BIT3) ? PMem : Mem;
+
+    // Largest supported size the growth of which fits in the padding
+    for (Size = REBAR_MAX_SIZE; Size > Current; Size--)
+    {
+      Growth = REBAR_SIZE(Size) - REBAR_SIZE(Current);
+
+      if ((Sizes & (1U << Size)) && Growth <= *Window)
+        break;
+    }
+
+    if (Size == Current || mResizedBarCount >= MAX_RESIZED_BARS)
+    {
+      DEBUG((DEBUG_INFO, "ResizeDeviceBars(): %02X:%02X.%X BAR%u left at %luMB (supported 0x%x)\n",
+             Device->Bus, Device->Device, Device->Function, REBAR_CTL_BAR_INDEX(Control), RShiftU64(REBAR_SIZE(Current), 20), Sizes));
+      continue;
+    }
+
+    mResizedBars[mResizedBarCount].Bus = Device->Bus;
+    mResizedBars[mResizedBarCount].Device = Device->Device;
+    mResizedBars[mResizedBarCount].Function = Device->Function;
+    mResizedBars[mResizedBarCount].Control = Offset + REBAR_CONTROL(Index);
+    mResizedBars[mResizedBarCount].Original = Control;
+    mResizedBarCount++;
+
+    PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Offset + REBAR_CONTROL(Index),
+                  (Control & ~REBAR_CTL_SIZE_MASK) | ((UINT32)Size << REBAR_CTL_SIZE_SHIFT));
+
+    *Window -= Growth;
+
+    DEBUG((DEBUG_INFO, "ResizeDeviceBars(): %02X:%02X.%X BAR%u %luMB -> %luMB\n",
+           Device->Bus, Device->Device, Device->Function, REBAR_CTL_BAR_INDEX(Control),
+           RShiftU64(REBAR_SIZE(Current), 20), RShiftU64(REBAR_SIZE(Size), 20)));
+  }
+}
+
+/**
+  Grow the resizable BARs of devices behind the hot plug root ports. Called
+  once bus numbers are assigned, before PciBus sizes the BARs.
+
+  @param  Mapping             Root bridge to look under
+**/
+VOID ResizeHotPlugBars(RootBridgeIoProtocolMapping *Mapping)
+{
+  EFI_STATUS Status;
+  EFI_PCI_HOT_PLUG_INIT_PROTOCOL *HotPlugInit;
+  TopologyDevice *Device;
+  UINT64 Mem = 0;
+  UINT64 PMem = 0;
+  UINT16 Command;
+  UINT16 Offset;
+  UINT32 FailedCrc;
+  UINTN Size = sizeof(FailedCrc);
+  UINTN Index;
+
+  Status = gBS->LocateProtocol(&gEfiPciHotPlugInitProtocolGuid, NULL, (VOID **)&HotPlugInit);
+
+  if (!EFI_ERROR(Status))
+    Status = BuildHotPlugTopology(Mapping->OriginalProtocol);
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "ResizeHotPlugBars(): Couldn't build topology: %r\n", Status));
+    return;
+  }
+
+  mHotPlugDeviceCrc = GetHotPlugDeviceCrc();
+
+  // Something else plugged in gets another go
+  Status = gRT->GetVariable(REBAR_FALLBACK_VARIABLE, &gPciDxeShimVariableGuid, NULL, &Size, &FailedCrc);
+
+  if (!EFI_ERROR(Status) && FailedCrc == mHotPlugDeviceCrc)
+  {
+    DEBUG((DEBUG_INFO, "ResizeHotPlugBars(): Allocation failed with resized BARs before, leaving them alone\n"));
+    return;
+  }
+
+  // Parents come before children, so each port's padding is known before its devices
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if (Device->Parent < 0)
+    {
+      GetPortPadding(HotPlugInit, Device, &Mem, &PMem);
+      SubtractPortBars((INT16)Index, &Mem, &PMem);
+      continue;
+    }
+
+    Offset = FindExtendedCapability(Device, PCIE_EXT_CAP_ID_REBAR);
+
+    if (Offset == 0)
+      continue;
+
+    // Decode has to be off while the size changes
+    Command = PciCfgRead16(Device->Bus, Device->Device, Device->Function, PCI_COMMAND_OFFSET);
+
+    if (Command & EFI_PCI_COMMAND_MEMORY_SPACE)
+      PciCfgWrite16(Device->Bus, Device->Device, Device->Function, PCI_COMMAND_OFFSET, Command & ~EFI_PCI_COMMAND_MEMORY_SPACE);
+
+    ResizeDeviceBars(Device, Offset, &Mem, &PMem);
+
+    if (Command & EFI_PCI_COMMAND_MEMORY_SPACE)
+      PciCfgWrite16(Device->Bus, Device->Device, Device->Function, PCI_COMMAND_OFFSET, Command);
+  }
+}
+
+/**
+  Allocation failed. Put every resized BAR back to its default size, and
+  remember not to resize on the following boots while the same devices are
+  plugged in.
+
+  This doesn't rescue the current boot. PciBus has already sized the BARs,
+  and its retry asks for the same sizes again, dropping devices until the
+  rest fit. Only the next boot comes up with the default sizes. Restoring
+  the size now just means the BARs decode no more than they did originally,
+  which is harmless.
+**/
+VOID RestoreResizedBars()
+{
+  UINTN Index;
+
+  if (mResizedBarCount == 0)
+    return;
+
+  for (Index = 0; Index < mResizedBarCount; Index++)
+  {
+    PciCfgWrite32(mResizedBars[Index].Bus, mResizedBars[Index].Device, mResizedBars[Index].Function,
+                  mResizedBars[Index].Control, mResizedBars[Index].Original);
+  }
+
+  DEBUG((DEBUG_ERROR, "RestoreResizedBars(): Allocation failed, %u BAR(s) back to default size\n", mResizedBarCount));
+
+  mResizedBarCount = 0;
+
+  gRT->SetVariable(
+      REBAR_FALLBACK_VARIABLE,
+      &gPciDxeShimVariableGuid,
+      EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+      sizeof(mHotPlugDeviceCrc),
+      &mHotPlugDeviceCrc);
+}
+
+/**
+  Allocation succeeded. If that was with resized BARs, any fallback left
+  from an earlier failure no longer applies.
+**/
+VOID ClearReBarFallback()
+{
+  if (mResizedBarCount == 0)
+    return;
+
+  // Deleting a variable which isn't there doesn't touch the store
+  gRT->SetVariable(REBAR_FALLBACK_VARIABLE, &gPciDxeShimVariableGuid, 0, 0, NULL);
+}
@@ -63,10 +63,47 @@ NotifyPhase(
     IN EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE Phase)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
   DEBUG((DEBUG_INFO, "NotifyPhase(%s)\n", mNotifyPhaseTypes[Phase]));
+  RecordShimPhase(Phase);
   Status = OriginalProtocol->NotifyPhase(OriginalProtocol, Phase);
   ASSERT_EFI_ERROR(Status);
+
+  // Bus numbers are assigned, but PciBus hasn't sized any BARs yet
+  if (!EFI_ERROR(Status) && Phase == EfiPciHostBridgeEndBusAllocation)
+  {
+    RootBridgeIoProtocolMapping *Mapping = FindRootBridgeIoMappingByResourceAllocation(This);
+
+    if (Mapping != NULL)
+    {
+      ResizeHotPlugBars(Mapping);
+      PrescanHotPlugBuses(Mapping);
+    }
+  }
+
+  if (EFI_ERROR(Status) && Phase == EfiPciHostBridgeAllocateResources)
+    RestoreResizedBars();
+
+  if (!EFI_ERROR(Status) && Phase == EfiPciHostBridgeAllocateResources)
+    ClearReBarFallback();
+
+  // BARs and bridge windows are all programmed by now, so the hierarchy is stable
+  if (!EFI_ERROR(Status) && Phase == EfiPciHostBridgeEndResourceAllocation)
+  {
+    RootBridgeIoProtocolMapping *Mapping = FindRootBridgeIoMappingByResourceAllocation(This);
+
+    if (Mapping != NULL)
+    {
+      // PciBus is done probing, and hot added devices mustn't be hidden
+      InvalidateConfigCache(Mapping);
+      TuneHotPlugHierarchies(Mapping);
+      RefreshPruning(Mapping);
+      SaveHotPlugS3State();
+    }
+  }
+
+  RecordShimCall(PCI_SHIM_STAT_NOTIFY_PHASE, Start, 0);
   return Status;
 }
 
@@ -93,10 +130,12 @@ GetNextRootBridge(
     IN OUT EFI_HANDLE *RootBridgeHandle)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
   DEBUG((DEBUG_INFO, "GetNextRootBridge()\n"));
   Status = OriginalProtocol->GetNextRootBridge(OriginalProtocol, RootBridgeHandle);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_GET_NEXT_ROOT_BRIDGE, Start, 0);
   return Status;
 }
 
@@ -124,10 +163,12 @@ GetAttributes(
     OUT UINT64 *Attributes)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
   DEBUG((DEBUG_INFO, "GetAttributes()\n"));
   Status = OriginalProtocol->GetAllocAttributes(OriginalProtocol, RootBridgeHandle, Attributes);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_GET_ALLOC_ATTRIBUTES, Start, 0);
   return Status;
 }
 
@@ -153,10 +194,12 @@ StartBusEnumeration(
     OUT VOID **Configuration)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
   DEBUG((DEBUG_INFO, "StartBusEnumeration()\n"));
   Status = OriginalProtocol->StartBusEnumeration(OriginalProtocol, RootBridgeHandle, Configuration);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_START_BUS_ENUMERATION, Start, 0);
   return Status;
 }
 
@@ -181,10 +224,12 @@ SetBusNumbers(
     IN VOID *Configuration)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
   DEBUG((DEBUG_INFO, "SetBusNumbers()\n"));
   Status = OriginalProtocol->SetBusNumbers(OriginalProtocol, RootBridgeHandle, Configuration);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_SET_BUS_NUMBERS, Start, 0);
   return Status;
 }
 
@@ -208,6 +253,7 @@ SubmitResources(
     IN VOID *Configuration)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
 
@@ -234,8 +280,11 @@ SubmitResources(
 
   }
 
+  AlignForLargePages(Configuration);
+
   Status = OriginalProtocol->SubmitResources(OriginalProtocol, RootBridgeHandle, Configuration);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_SUBMIT_RESOURCES, Start, 0);
   return Status;
 }
 
@@ -262,10 +311,12 @@ GetProposedResources(
     OUT VOID **Configuration)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
   DEBUG((DEBUG_INFO, "GetProposedResources()\n"));
   Status = OriginalProtocol->GetProposedResources(OriginalProtocol, RootBridgeHandle, Configuration);
   ASSERT_EFI_ERROR(Status);
+  RecordShimCall(PCI_SHIM_STAT_GET_PROPOSED_RESOURCES, Start, 0);
   return Status;
 }
 
@@ -292,9 +343,17 @@ PreprocessController(
     IN EFI_PCI_CONTROLLER_RESOURCE_ALLOCATION_PHASE Phase)
 {
   EFI_STATUS Status;
+  UINT64 Start = AsmReadTsc();
   EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PROTOCOL *OriginalProtocol = FindResourceAllocationProtocolMappingBySubstitute(This);
+  RootBridgeIoProtocolMapping *Mapping;
   DEBUG((DEBUG_INFO, "PreprocessController()\n"));
   Status = OriginalProtocol->PreprocessController(OriginalProtocol, RootBridgeHandle, PciAddress, Phase);
   ASSERT_EFI_ERROR(Status);
+
+  // PciBus reads the device straight after this, VF Offset and Stride included
+  if (!EFI_ERROR(Status) && Phase == EfiPciBeforeChildBusEnumeration && (Mapping = FindRootBridgeIoMappingByHandle(RootBridgeHandle)) != NULL)
+    PrepareAriHierarchy(Mapping, PciAddress.Bus, PciAddress.Device, PciAddress.Function);
+
+  RecordShimCall(PCI_SHIM_STAT_PREPROCESS_CONTROLLER, Start, 0);
   return Status;
 }
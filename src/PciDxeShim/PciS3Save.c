@@ -0,0 +1,213 @@
+/**
+ * File: PciS3Save.c
+ * Author: Matthew Millman
+ *
+ * Records the final configuration of everything below the hot plug root ports
+ * into the S3 boot script, so resume doesn't come back to unconfigured bridges.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+#include <Protocol/S3SaveState.h>
+
+#define S3_SAVE_HOT_PLUG_STATE      TRUE
+
+// Give the link below a hot plug root port time to come back before anything
+// behind it is written. The 100ms PCI Express allows between link up and the
+// first config request. A fixed stall rather than a poll, because a poll that
+// times out fails the whole boot script, and the dock may have gone.
+#define S3_LINK_STALL_US            100000
+
+#define LINKSTS_DLL_ACTIVE          BIT13
+
+typedef struct
+{
+  UINT16 Register;
+  EFI_BOOT_SCRIPT_WIDTH Width;
+} S3_SAVE_REGISTER;
+
+BOOLEAN mS3StateSaved = FALSE;
+
+// The platform's own boot script. S3BootScriptLib linked into this driver would
+// keep a private table, which the platform's resume path never runs.
+EFI_S3_SAVE_STATE_PROTOCOL *mS3SaveState = NULL;
+
+// Bus numbers first, so everything recorded after them is reachable on resume.
+// The secondary status is left out, it's write 1 to clear.
+GLOBAL_REMOVE_IF_UNREFERENCED S3_SAVE_REGISTER mBridgeRegisters[] = {
+  {0x18, EfiBootScriptWidthUint32}, // Primary, secondary, subordinate bus
+  {0x10, EfiBootScriptWidthUint32}, // BAR0
+  {0x14, EfiBootScriptWidthUint32}, // BAR1
+  {0x1C, EfiBootScriptWidthUint16}, // I/O base and limit
+  {0x20, EfiBootScriptWidthUint32}, // Memory base and limit
+  {0x24, EfiBootScriptWidthUint32}, // Prefetchable base and limit
+  {0x28, EfiBootScriptWidthUint32}, // Prefetchable base upper 32 bits
+  {0x2C, EfiBootScriptWidthUint32}, // Prefetchable limit upper 32 bits
+  {0x30, EfiBootScriptWidthUint32}, // I/O base and limit upper 16 bits
+  {0x3E, EfiBootScriptWidthUint16}, // Bridge control
+};
+
+// Upper halves of 64-bit BARs are just another dword here
+GLOBAL_REMOVE_IF_UNREFERENCED S3_SAVE_REGISTER mDeviceRegisters[] = {
+  {0x10, EfiBootScriptWidthUint32},
+  {0x14, EfiBootScriptWidthUint32},
+  {0x18, EfiBootScriptWidthUint32},
+  {0x1C, EfiBootScriptWidthUint32},
+  {0x20, EfiBootScriptWidthUint32},
+  {0x24, EfiBootScriptWidthUint32},
+};
+
+// What tuning set up: MPS, read request size, ASPM, target link speed and the
+// like. Retrain and FLR read back as zero, so replaying the read back values
+// doesn't kick anything off. Relative to the PCI Express capability.
+GLOBAL_REMOVE_IF_UNREFERENCED S3_SAVE_REGISTER mPcieRegisters[] = {
+  {PCIE_REG_DEVICE_CONTROL, EfiBootScriptWidthUint16},
+  {PCIE_REG_DEVICE_CONTROL2, EfiBootScriptWidthUint16},
+  {PCIE_REG_LINK_CONTROL, EfiBootScriptWidthUint16},
+  {PCIE_REG_LINK_CONTROL2, EfiBootScriptWidthUint16},
+};
+
+/**
+  Record the current value of a config register, as read back from the device
+
+  @param  Device              Device to record
+  @param  Register            Register offset
+  @param  Width               EfiBootScriptWidthUint16 or EfiBootScriptWidthUint32
+
+  @retval EFI_SUCCESS         Recorded
+  @retval other               Boot script wouldn't take it
+**/
+EFI_STATUS SaveConfigRegister(TopologyDevice *Device, UINT16 Register, EFI_BOOT_SCRIPT_WIDTH Width)
+{
+  UINT32 Value;
+
+  if (Width == EfiBootScriptWidthUint16)
+    Value = PciCfgRead16(Device->Bus, Device->Device, Device->Function, Register);
+  else
+    Value = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Register);
+
+  return mS3SaveState->Write(
+      mS3SaveState,
+      EFI_BOOT_SCRIPT_PCI_CONFIGURATION_WRITE_OPCODE,
+      Width,
+      EFI_PCI_ADDRESS(Device->Bus, Device->Device, Device->Function, Register),
+      (UINTN)1,
+      &Value);
+}
+
+/**
+  Record a list of registers for one device
+
+  @param  Device              Device to record
+  @param  Base                Added to each register offset
+  @param  Registers           Registers to record
+  @param  Count               Number of registers
+
+  @retval EFI_SUCCESS         Recorded
+  @retval other               Boot script wouldn't take it
+**/
+EFI_STATUS SaveConfigRegisters(TopologyDevice *Device, UINT16 Base, S3_SAVE_REGISTER *Registers, UINTN Count)
+{
+  EFI_STATUS Status;
+  UINTN Index;
+
+  for (Index = 0; Index < Count; Index++)
+  {
+    Status = SaveConfigRegister(Device, Base + Registers[Index].Register, Registers[Index].Width);
+
+    if (EFI_ERROR(Status))
+      return Status;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Have resume wait for the link below a hot plug root port to come up, if
+  there was anything on it at boot
+
+  @param  Device              Hot plug root port
+
+  @retval EFI_SUCCESS         Recorded, or nothing to wait for
+  @retval other               Boot script wouldn't take it
+**/
+EFI_STATUS SaveLinkStall(TopologyDevice *Device)
+{
+  if (Device->PcieCap == 0 || (PcieCapRead16(Device, PCIE_REG_LINK_STATUS) & LINKSTS_DLL_ACTIVE) == 0)
+    return EFI_SUCCESS;
+
+  return mS3SaveState->Write(mS3SaveState, EFI_BOOT_SCRIPT_STALL_OPCODE, (UINTN)S3_LINK_STALL_US);
+}
+
+/**
+  Record the configuration of everything below the hot plug root ports into
+  the S3 boot script. Called once tuning has finished at EndResourceAllocation,
+  with the topology still current.
+
+  The topology is in scan order, parents first, so replaying it in order
+  brings each bus up before anything on it is written.
+
+  The boot script can only be appended to, so this records the boot time
+  configuration once. Anything recorded later would replay after it, old
+  copy first. Devices added by a later rescan are left for the OS to
+  configure on resume.
+**/
+VOID SaveHotPlugS3State()
+{
+  TopologyDevice *Device;
+  UINTN Index;
+  EFI_STATUS Status = EFI_SUCCESS;
+
+  if (!S3_SAVE_HOT_PLUG_STATE || mS3StateSaved)
+    return;
+
+  // Whatever happens, don't leave a second partial copy behind a first
+  mS3StateSaved = TRUE;
+
+  Status = gBS->LocateProtocol(&gEfiS3SaveStateProtocolGuid, NULL, (VOID **)&mS3SaveState);
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "SaveHotPlugS3State(): No S3 save state protocol: %r\n", Status));
+    return;
+  }
+
+  for (Index = 0; Index < gHotPlugTopology.Count && !EFI_ERROR(Status); Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if ((Device->HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_PCI_TO_PCI_BRIDGE)
+      Status = SaveConfigRegisters(Device, 0, mBridgeRegisters, ARRAY_SIZE(mBridgeRegisters));
+    else
+      Status = SaveConfigRegisters(Device, 0, mDeviceRegisters, ARRAY_SIZE(mDeviceRegisters));
+
+    if (!EFI_ERROR(Status) && Device->PcieCap != 0)
+      Status = SaveConfigRegisters(Device, Device->PcieCap, mPcieRegisters, ARRAY_SIZE(mPcieRegisters));
+
+    if (!EFI_ERROR(Status) && Device->Parent < 0)
+      Status = SaveLinkStall(Device);
+  }
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "SaveHotPlugS3State(): Boot script save failed: %r\n", Status));
+    return;
+  }
+
+  DEBUG((DEBUG_INFO, "SaveHotPlugS3State(): Recorded %u devices\n", gHotPlugTopology.Count));
+}
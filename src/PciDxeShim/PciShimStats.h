@@ -0,0 +1,117 @@
+/**
+ * File: PciShimStats.h
+ * Author: Matthew Millman
+ *
+ * Statistics protocol, installed by PciDxeShim and read by the PciShimStats
+ * shell application.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PCI_SHIM_STATS_H
+#define _PCI_SHIM_STATS_H
+
+#define PCI_SHIM_STATS_PROTOCOL_GUID \
+  {0x6E3B7D29, 0x1F84, 0x4C6A, {0xA0, 0x5D, 0x93, 0x2C, 0xE7, 0x18, 0xB4, 0x6F}}
+
+#define PCI_SHIM_STATS_PROTOCOL_REVISION    1
+
+//
+// Substituted methods, indexes into PCI_SHIM_STATISTICS.Methods
+//
+#define PCI_SHIM_STAT_POLL_MEM              0
+#define PCI_SHIM_STAT_POLL_IO               1
+#define PCI_SHIM_STAT_MEM_READ              2
+#define PCI_SHIM_STAT_MEM_WRITE             3
+#define PCI_SHIM_STAT_IO_READ               4
+#define PCI_SHIM_STAT_IO_WRITE              5
+#define PCI_SHIM_STAT_COPY_MEM              6
+#define PCI_SHIM_STAT_PCI_READ              7
+#define PCI_SHIM_STAT_PCI_WRITE             8
+#define PCI_SHIM_STAT_MAP                   9
+#define PCI_SHIM_STAT_UNMAP                 10
+#define PCI_SHIM_STAT_ALLOCATE_BUFFER       11
+#define PCI_SHIM_STAT_FREE_BUFFER           12
+#define PCI_SHIM_STAT_FLUSH                 13
+#define PCI_SHIM_STAT_GET_ATTRIBUTES        14
+#define PCI_SHIM_STAT_SET_ATTRIBUTES        15
+#define PCI_SHIM_STAT_CONFIGURATION         16
+#define PCI_SHIM_STAT_NOTIFY_PHASE          17
+#define PCI_SHIM_STAT_GET_NEXT_ROOT_BRIDGE  18
+#define PCI_SHIM_STAT_GET_ALLOC_ATTRIBUTES  19
+#define PCI_SHIM_STAT_START_BUS_ENUMERATION 20
+#define PCI_SHIM_STAT_SET_BUS_NUMBERS       21
+#define PCI_SHIM_STAT_SUBMIT_RESOURCES      22
+#define PCI_SHIM_STAT_GET_PROPOSED_RESOURCES 23
+#define PCI_SHIM_STAT_PREPROCESS_CONTROLLER 24
+#define PCI_SHIM_STAT_METHODS               25
+
+typedef struct _PCI_SHIM_STATS_PROTOCOL PCI_SHIM_STATS_PROTOCOL;
+
+typedef struct
+{
+  UINT64 Calls;
+  UINT64 Bytes;         // Width * Count for accesses, mapped or allocated size for DMA
+  UINT64 Microseconds;  // Inside the method, including the original protocol
+} PCI_SHIM_METHOD_STATS;
+
+typedef struct
+{
+  UINT32 Revision;
+  UINT32 Phase;         // Last EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE, EfiMaxPciHostBridgeEnumerationPhase before the first
+  UINT64 CacheHits;     // Config reads answered from the cache, all root bridges
+  UINT64 PrunedCycles;  // Config reads answered by pruning, all root bridges
+  BOOLEAN EcamEnabled;  // Config accesses going straight to ECAM on any root bridge
+  PCI_SHIM_METHOD_STATS Methods[PCI_SHIM_STAT_METHODS];
+} PCI_SHIM_STATISTICS;
+
+/**
+  Take a copy of the statistics
+
+  @param  This                  Protocol instance
+  @param  Statistics            Receives the copy
+
+  @retval EFI_SUCCESS           Copied
+  @retval EFI_INVALID_PARAMETER Statistics is NULL
+**/
+typedef
+EFI_STATUS
+(EFIAPI *PCI_SHIM_STATS_GET)(
+    IN PCI_SHIM_STATS_PROTOCOL *This,
+    OUT PCI_SHIM_STATISTICS *Statistics);
+
+/**
+  Zero the counters. The phase is left as it is.
+
+  @param  This                  Protocol instance
+
+  @retval EFI_SUCCESS           Counters zeroed
+**/
+typedef
+EFI_STATUS
+(EFIAPI *PCI_SHIM_STATS_RESET)(
+    IN PCI_SHIM_STATS_PROTOCOL *This);
+
+struct _PCI_SHIM_STATS_PROTOCOL
+{
+  UINT32 Revision;
+  PCI_SHIM_STATS_GET GetStatistics;
+  PCI_SHIM_STATS_RESET Reset;
+};
+
+extern EFI_GUID gPciShimStatsProtocolGuid;
+
+#endif /* _PCI_SHIM_STATS_H */
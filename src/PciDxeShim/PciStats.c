@@ -0,0 +1,150 @@
+/**
+ * File: PciStats.c
+ * Author: Matthew Millman
+ *
+ * Counts calls, bytes and time through each substituted method, and publishes
+ * them through the statistics protocol.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+typedef struct
+{
+  UINT64 Calls;
+  UINT64 Bytes;
+  UINT64 Ticks;         // TSC, converted when someone asks
+} SHIM_METHOD_COUNTERS;
+
+EFI_GUID gPciShimStatsProtocolGuid = PCI_SHIM_STATS_PROTOCOL_GUID;
+
+// Not locked. The shim is only ever called on the BSP at or below TPL_NOTIFY,
+// and a lost count here and there wouldn't matter anyway.
+SHIM_METHOD_COUNTERS mShimCounters[PCI_SHIM_STAT_METHODS];
+EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE mShimPhase = EfiMaxPciHostBridgeEnumerationPhase;
+
+EFI_STATUS EFIAPI GetShimStatistics(PCI_SHIM_STATS_PROTOCOL *This, PCI_SHIM_STATISTICS *Statistics);
+EFI_STATUS EFIAPI ResetShimStatistics(PCI_SHIM_STATS_PROTOCOL *This);
+
+PCI_SHIM_STATS_PROTOCOL gPciShimStats = {
+    PCI_SHIM_STATS_PROTOCOL_REVISION,
+    GetShimStatistics,
+    ResetShimStatistics};
+
+/**
+  Work out how many bytes an access moves
+
+  @param  Width               Width of each access
+  @param  Count               Number of accesses
+
+  @retval (value)             Bytes moved
+**/
+UINT64 AccessBytes(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width, UINTN Count)
+{
+  // Normal, FIFO and Fill widths all repeat the same four sizes
+  return LShiftU64(Count, Width & 0x03);
+}
+
+/**
+  Count a call to a substituted method
+
+  @param  Method              PCI_SHIM_STAT_xxx
+  @param  Start               TSC on entry to the method
+  @param  Bytes               Bytes moved by the call
+**/
+VOID RecordShimCall(UINTN Method, UINT64 Start, UINT64 Bytes)
+{
+  mShimCounters[Method].Calls++;
+  mShimCounters[Method].Bytes += Bytes;
+  mShimCounters[Method].Ticks += AsmReadTsc() - Start;
+}
+
+/**
+  Note the phase the host bridge has been told to enter
+
+  @param  Phase               Phase passed to NotifyPhase()
+**/
+VOID RecordShimPhase(EFI_PCI_HOST_BRIDGE_RESOURCE_ALLOCATION_PHASE Phase)
+{
+  mShimPhase = Phase;
+}
+
+/**
+  Take a copy of the statistics
+
+  @param  This                  Protocol instance
+  @param  Statistics            Receives the copy
+
+  @retval EFI_SUCCESS           Copied
+  @retval EFI_INVALID_PARAMETER Statistics is NULL
+**/
+EFI_STATUS EFIAPI GetShimStatistics(PCI_SHIM_STATS_PROTOCOL *This, PCI_SHIM_STATISTICS *Statistics)
+{
+  RootBridgeIoProtocolMapping *Mapping;
+  LIST_ENTRY *Entry;
+  UINTN Index;
+
+  if (Statistics == NULL)
+    return EFI_INVALID_PARAMETER;
+
+  ZeroMem(Statistics, sizeof(PCI_SHIM_STATISTICS));
+  Statistics->Revision = PCI_SHIM_STATS_PROTOCOL_REVISION;
+  Statistics->Phase = mShimPhase;
+
+  for (Index = 0; Index < PCI_SHIM_STAT_METHODS; Index++)
+  {
+    Statistics->Methods[Index].Calls = mShimCounters[Index].Calls;
+    Statistics->Methods[Index].Bytes = mShimCounters[Index].Bytes;
+    Statistics->Methods[Index].Microseconds = TscToMicroseconds(mShimCounters[Index].Ticks);
+  }
+
+  for (Entry = GetFirstNode(&RootBridgeIoProtocolList); !IsNull(&RootBridgeIoProtocolList, Entry); Entry = GetNextNode(&RootBridgeIoProtocolList, Entry))
+  {
+    Mapping = (RootBridgeIoProtocolMapping *)Entry;
+
+    Statistics->CacheHits += Mapping->CacheHits;
+    Statistics->PrunedCycles += Mapping->PrunedCycles;
+    Statistics->EcamEnabled |= Mapping->EcamEnabled;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Zero the counters. The phase is left as it is.
+
+  @param  This                  Protocol instance
+
+  @retval EFI_SUCCESS           Counters zeroed
+**/
+EFI_STATUS EFIAPI ResetShimStatistics(PCI_SHIM_STATS_PROTOCOL *This)
+{
+  RootBridgeIoProtocolMapping *Mapping;
+  LIST_ENTRY *Entry;
+
+  ZeroMem(mShimCounters, sizeof(mShimCounters));
+
+  for (Entry = GetFirstNode(&RootBridgeIoProtocolList); !IsNull(&RootBridgeIoProtocolList, Entry); Entry = GetNextNode(&RootBridgeIoProtocolList, Entry))
+  {
+    Mapping = (RootBridgeIoProtocolMapping *)Entry;
+
+    Mapping->CacheHits = 0;
+    Mapping->PrunedCycles = 0;
+  }
+
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,399 @@
+/**
+ * File: PciTopology.c
+ * Author: Matthew Millman
+ *
+ * Discovers the devices below each hot plug root port, and provides config
+ * space helpers for the passes which tune them.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+
+HotPlugTopology gHotPlugTopology;
+
+UINT8 PciCfgRead8(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register)
+{
+  UINT8 Value = 0xFF;
+  gHotPlugTopology.PciRootBridgeIo->Pci.Read(gHotPlugTopology.PciRootBridgeIo, EfiPciWidthUint8, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Value);
+  return Value;
+}
+
+UINT16 PciCfgRead16(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register)
+{
+  UINT16 Value = 0xFFFF;
+  gHotPlugTopology.PciRootBridgeIo->Pci.Read(gHotPlugTopology.PciRootBridgeIo, EfiPciWidthUint16, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Value);
+  return Value;
+}
+
+UINT32 PciCfgRead32(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register)
+{
+  UINT32 Value = 0xFFFFFFFF;
+  gHotPlugTopology.PciRootBridgeIo->Pci.Read(gHotPlugTopology.PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Value);
+  return Value;
+}
+
+VOID PciCfgWrite16(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register, UINT16 Value)
+{
+  gHotPlugTopology.PciRootBridgeIo->Pci.Write(gHotPlugTopology.PciRootBridgeIo, EfiPciWidthUint16, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Value);
+}
+
+VOID PciCfgWrite32(UINT8 Bus, UINT8 Device, UINT8 Function, UINT16 Register, UINT32 Value)
+{
+  gHotPlugTopology.PciRootBridgeIo->Pci.Write(gHotPlugTopology.PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Bus, Device, Function, Register), 1, &Value);
+}
+
+UINT16 PcieCapRead16(TopologyDevice *Device, UINT8 Register)
+{
+  return PciCfgRead16(Device->Bus, Device->Device, Device->Function, Device->PcieCap + Register);
+}
+
+UINT32 PcieCapRead32(TopologyDevice *Device, UINT8 Register)
+{
+  return PciCfgRead32(Device->Bus, Device->Device, Device->Function, Device->PcieCap + Register);
+}
+
+VOID PcieCapWrite16(TopologyDevice *Device, UINT8 Register, UINT16 Value)
+{
+  PciCfgWrite16(Device->Bus, Device->Device, Device->Function, Device->PcieCap + Register, Value);
+}
+
+/**
+  Find a capability in the standard capability list
+
+  @param  Bus, Device, Function   Device to search
+  @param  CapabilityId            EFI_PCI_CAPABILITY_ID_xxx
+
+  @retval (value)                 Offset of the capability, 0 if not found
+**/
+UINT8 FindCapability(UINT8 Bus, UINT8 Device, UINT8 Function, UINT8 CapabilityId)
+{
+  UINT8 Offset;
+  UINTN Limit;
+
+  if ((PciCfgRead16(Bus, Device, Function, PCI_PRIMARY_STATUS_OFFSET) & EFI_PCI_STATUS_CAPABILITY) == 0)
+    return 0;
+
+  Offset = PciCfgRead8(Bus, Device, Function, PCI_CAPBILITY_POINTER_OFFSET) & 0xFC;
+
+  // Bound the walk in case a broken device links its list into a loop
+  for (Limit = 0; Offset != 0 && Limit < 48; Limit++)
+  {
+    if (PciCfgRead8(Bus, Device, Function, Offset) == CapabilityId)
+      return Offset;
+
+    Offset = PciCfgRead8(Bus, Device, Function, Offset + 1) & 0xFC;
+  }
+
+  return 0;
+}
+
+/**
+  Find a capability in the PCI Express extended capability list
+
+  @param  Device                  Device to search
+  @param  CapabilityId            Extended capability ID
+
+  @retval (value)                 Offset of the capability, 0 if not found
+**/
+UINT16 FindExtendedCapability(TopologyDevice *Device, UINT16 CapabilityId)
+{
+  UINT16 Offset = PCIE_EXTENDED_CAPABILITY_BASE;
+  UINT32 Header;
+  UINTN Limit;
+
+  if (Device->PcieCap == 0)
+    return 0;
+
+  for (Limit = 0; Offset >= PCIE_EXTENDED_CAPABILITY_BASE && Limit < 256; Limit++)
+  {
+    Header = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Offset);
+
+    if (Header == 0 || Header == 0xFFFFFFFF)
+      return 0;
+
+    if ((Header & 0xFFFF) == CapabilityId)
+      return Offset;
+
+    Offset = (UINT16)((Header >> 20) & 0xFFC);
+  }
+
+  return 0;
+}
+
+/**
+  Check whether a device is an endpoint, as opposed to some kind of port or bridge
+
+  @param  Device              Device to check
+
+  @retval TRUE                Endpoint
+  @retval FALSE               Port, bridge or something without a PCI Express capability
+**/
+BOOLEAN IsEndpoint(TopologyDevice *Device)
+{
+  if (Device->PcieCap == 0)
+    return FALSE;
+
+  return (Device->PortType == PCIE_DEVICE_PORT_TYPE_PCIE_ENDPOINT ||
+          Device->PortType == PCIE_DEVICE_PORT_TYPE_LEGACY_PCIE_ENDPOINT ||
+          Device->PortType == PCIE_DEVICE_PORT_TYPE_ROOT_COMPLEX_INTEGRATED_ENDPOINT);
+}
+
+/**
+  Size a memory BAR. Decode is turned off while the BAR reads back its mask,
+  so nothing decodes the all-ones address in the meantime.
+
+  @param  Device              Device the BAR belongs to
+  @param  BarIndex            BAR to size, stepped past the upper half of a 64-bit BAR
+  @param  Base                Address the BAR is programmed with
+  @param  Prefetchable        Set to the BAR's prefetchable bit
+
+  @retval (value)             Size of the BAR, 0 for an I/O BAR or one that isn't implemented
+**/
+UINT64 SizeMemoryBar(TopologyDevice *Device, UINTN *BarIndex, UINT64 *Base, BOOLEAN *Prefetchable)
+{
+  UINT16 Register = (UINT16)(PCI_BASE_ADDRESSREG_OFFSET + *BarIndex * 4);
+  UINT16 Command;
+  UINT32 Bar;
+  UINT32 Mask;
+  UINT32 Upper = 0;
+  UINT32 UpperMask = 0xFFFFFFFF;
+  BOOLEAN Is64Bit;
+
+  Bar = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Register);
+
+  if (Bar & BIT0)
+    return 0;
+
+  Is64Bit = ((Bar & 0x6) == 0x4);
+
+  if (Is64Bit)
+    (*BarIndex)++;
+
+  Command = PciCfgRead16(Device->Bus, Device->Device, Device->Function, PCI_COMMAND_OFFSET);
+  PciCfgWrite16(Device->Bus, Device->Device, Device->Function, PCI_COMMAND_OFFSET, Command & ~EFI_PCI_COMMAND_MEMORY_SPACE);
+
+  PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Register, 0xFFFFFFFF);
+  Mask = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Register) & 0xFFFFFFF0;
+  PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Register, Bar);
+
+  if (Is64Bit)
+  {
+    Upper = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Register + 4);
+    PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Register + 4, 0xFFFFFFFF);
+    UpperMask = PciCfgRead32(Device->Bus, Device->Device, Device->Function, Register + 4);
+    PciCfgWrite32(Device->Bus, Device->Device, Device->Function, Register + 4, Upper);
+  }
+
+  PciCfgWrite16(Device->Bus, Device->Device, Device->Function, PCI_COMMAND_OFFSET, Command);
+
+  if (Mask == 0)
+    return 0;
+
+  *Base = LShiftU64(Upper, 32) | (Bar & 0xFFFFFFF0);
+  *Prefetchable = (Bar & BIT3) != 0;
+
+  return ~(LShiftU64(UpperMask, 32) | Mask) + 1;
+}
+
+/**
+  Add a device to the topology
+
+  @param  Bus, Device, Function   Location of the device
+  @param  Parent                  Index of the upstream bridge, -1 for a hot plug root port
+  @param  Root                    Index of the hot plug root port, -1 if this is one
+
+  @retval (value)                 Index of the new entry, -1 if the table is full
+**/
+INT16 AddTopologyDevice(UINT8 Bus, UINT8 Device, UINT8 Function, INT16 Parent, INT16 Root)
+{
+  TopologyDevice *Entry;
+  UINT32 BusNumbers;
+
+  if (gHotPlugTopology.Count >= MAX_TOPOLOGY_DEVICES)
+  {
+    DEBUG((DEBUG_ERROR, "AddTopologyDevice(): Table full, ignoring %02X:%02X.%X\n", Bus, Device, Function));
+    return -1;
+  }
+
+  Entry = &gHotPlugTopology.Devices[gHotPlugTopology.Count];
+  ZeroMem(Entry, sizeof(TopologyDevice));
+
+  Entry->Bus = Bus;
+  Entry->Device = Device;
+  Entry->Function = Function;
+  Entry->HeaderType = PciCfgRead8(Bus, Device, Function, PCI_HEADER_TYPE_OFFSET);
+  Entry->PcieCap = FindCapability(Bus, Device, Function, EFI_PCI_CAPABILITY_ID_PCIEXP);
+  Entry->Parent = Parent;
+  Entry->Root = (Root < 0) ? (INT16)gHotPlugTopology.Count : Root;
+  Entry->Depth = (Parent < 0) ? 0 : gHotPlugTopology.Devices[Parent].Depth + 1;
+
+  if (Entry->PcieCap != 0)
+    Entry->PortType = (UINT8)((PcieCapRead16(Entry, PCIE_REG_CAPABILITY) >> 4) & 0x0F);
+
+  if ((Entry->HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_PCI_TO_PCI_BRIDGE)
+  {
+    BusNumbers = PciCfgRead32(Bus, Device, Function, PCI_BRIDGE_PRIMARY_BUS_REGISTER_OFFSET);
+    Entry->SecondaryBus = (UINT8)(BusNumbers >> 8);
+    Entry->SubordinateBus = (UINT8)(BusNumbers >> 16);
+  }
+
+  return (INT16)gHotPlugTopology.Count++;
+}
+
+/**
+  Scan a bus, and everything below it
+
+  @param  Bus                 Bus to scan
+  @param  Parent              Index of the bridge whose secondary bus this is
+**/
+VOID ScanTopologyBus(UINT8 Bus, INT16 Parent)
+{
+  UINT8 Device;
+  UINT8 Function;
+  INT16 Index;
+
+  for (Device = 0; Device <= PCI_MAX_DEVICE; Device++)
+  {
+    for (Function = 0; Function <= PCI_MAX_FUNC; Function++)
+    {
+      if (PciCfgRead16(Bus, Device, Function, PCI_VENDOR_ID_OFFSET) == 0xFFFF)
+      {
+        if (Function == 0)
+          break;
+
+        continue;
+      }
+
+      Index = AddTopologyDevice(Bus, Device, Function, Parent, gHotPlugTopology.Devices[Parent].Root);
+
+      if (Index < 0)
+        return;
+
+      // Only descend forwards, a bridge that points backwards hasn't been set up yet
+      if (gHotPlugTopology.Devices[Index].SecondaryBus > Bus)
+        ScanTopologyBus(gHotPlugTopology.Devices[Index].SecondaryBus, Index);
+
+      if (Function == 0 && (gHotPlugTopology.Devices[Index].HeaderType & HEADER_TYPE_MULTI_FUNCTION) == 0)
+        break;
+    }
+  }
+}
+
+/**
+  Get the first bus decoded by a root bridge
+
+  @param  PciRootBridgeIo     Root bridge to ask
+
+  @retval (value)             Bus number. 0 if the root bridge won't say.
+**/
+UINT8 GetRootBridgeBaseBus(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo)
+{
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
+
+  if (EFI_ERROR(PciRootBridgeIo->Configuration(PciRootBridgeIo, (VOID **)&Descriptor)))
+    return 0;
+
+  for (; Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Descriptor++)
+  {
+    if (Descriptor->ResType == ACPI_ADDRESS_SPACE_TYPE_BUS)
+      return (UINT8)Descriptor->AddrRangeMin;
+  }
+
+  return 0;
+}
+
+/**
+  Build a picture of everything below the hot plug root ports reported by
+  the hot plug init protocol. Bus numbers have to be assigned by this point.
+
+  @param  PciRootBridgeIo     Original root bridge I/O protocol
+
+  @retval EFI_SUCCESS         Topology built
+  @retval other               Something went wrong.
+**/
+EFI_STATUS BuildHotPlugTopology(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo)
+{
+  EFI_STATUS Status;
+  EFI_PCI_HOT_PLUG_INIT_PROTOCOL *HotPlugInit;
+  EFI_HPC_LOCATION *HpcList;
+  UINTN HpcCount;
+  UINTN Index;
+
+  gHotPlugTopology.PciRootBridgeIo = PciRootBridgeIo;
+  gHotPlugTopology.Count = 0;
+
+  Status = gBS->LocateProtocol(&gEfiPciHotPlugInitProtocolGuid, NULL, (VOID **)&HotPlugInit);
+
+  if (EFI_ERROR(Status))
+    return Status;
+
+  Status = HotPlugInit->GetRootHpcList(HotPlugInit, &HpcCount, &HpcList);
+
+  if (EFI_ERROR(Status))
+    return Status;
+
+  for (Index = 0; Index < HpcCount; Index++)
+  {
+    EFI_DEVICE_PATH_PROTOCOL *Node = HpcList[Index].HpcDevicePath;
+    UINT8 Bus = GetRootBridgeBaseBus(PciRootBridgeIo);
+    UINT8 Device = 0;
+    UINT8 Function = 0;
+    BOOLEAN Found = FALSE;
+    INT16 Port;
+
+    // Follow the PCI nodes down from the root bridge to the port
+    for (; !IsDevicePathEnd(Node); Node = NextDevicePathNode(Node))
+    {
+      if (DevicePathType(Node) != HARDWARE_DEVICE_PATH || DevicePathSubType(Node) != HW_PCI_DP)
+        continue;
+
+      if (Found)
+        Bus = PciCfgRead8(Bus, Device, Function, PCI_BRIDGE_SECONDARY_BUS_REGISTER_OFFSET);
+
+      Device = ((PCI_DEVICE_PATH *)Node)->Device;
+      Function = ((PCI_DEVICE_PATH *)Node)->Function;
+      Found = TRUE;
+    }
+
+    if (!Found)
+      continue;
+
+    Port = AddTopologyDevice(Bus, Device, Function, -1, -1);
+
+    if (Port < 0)
+      break;
+
+    gHotPlugTopology.Devices[Port].HpcDevicePath = HpcList[Index].HpcDevicePath;
+
+    DEBUG((DEBUG_INFO, "BuildHotPlugTopology(): Hot plug port %02X:%02X.%X, buses 0x%02X-0x%02X\n",
+           gHotPlugTopology.Devices[Port].Bus, gHotPlugTopology.Devices[Port].Device, gHotPlugTopology.Devices[Port].Function,
+           gHotPlugTopology.Devices[Port].SecondaryBus, gHotPlugTopology.Devices[Port].SubordinateBus));
+
+    if (gHotPlugTopology.Devices[Port].SecondaryBus > gHotPlugTopology.Devices[Port].Bus)
+      ScanTopologyBus(gHotPlugTopology.Devices[Port].SecondaryBus, Port);
+  }
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    TopologyDevice *Device = &gHotPlugTopology.Devices[Index];
+
+    DEBUG((DEBUG_INFO, "BuildHotPlugTopology(): %*a%02X:%02X.%X type %u\n", Device->Depth * 2, "",
+           Device->Bus, Device->Device, Device->Function, Device->PortType));
+  }
+
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,243 @@
+/**
+ * File: PciWriteCombine.c
+ * Author: Matthew Millman
+ *
+ * Marks the framebuffers of display devices behind the hot plug root ports
+ * write-combining, using as few variable MTRRs as possible.
+ *
+ * Only display class BARs are touched. Plenty of other devices (NVMe CMBs,
+ * NIC doorbell pages, ...) mark BARs prefetchable but have drivers which rely
+ * on uncached, in-order writes, so marking whole windows WC isn't safe. The
+ * padding around the BARs is left alone for the same reason, nobody knows yet
+ * what will be plugged into it.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciDxeShim.h"
+#include <Library/DxeServicesTableLib.h>
+
+#define MSR_IA32_MTRRCAP            0x000000FE
+#define MSR_IA32_MTRR_PHYSMASK0     0x00000201
+#define MTRRCAP_VCNT(x)             ((UINTN)((x) & 0xFF))
+#define MTRR_PHYSMASK_VALID         BIT11
+
+// Left free for the OS and anything else that needs one after us
+#define MTRR_RESERVED               1
+
+#define MAX_WC_RANGES               16
+
+typedef struct
+{
+  UINT64 Base;
+  UINT64 Length;
+} WC_RANGE;
+
+/**
+  Count the variable MTRRs nobody is using yet
+
+  @retval (value)             Free variable MTRRs
+**/
+UINTN CountFreeVariableMtrrs()
+{
+  UINTN Count = MTRRCAP_VCNT(AsmReadMsr64(MSR_IA32_MTRRCAP));
+  UINTN Free = 0;
+  UINTN Index;
+
+  for (Index = 0; Index < Count; Index++)
+  {
+    if ((AsmReadMsr64(MSR_IA32_MTRR_PHYSMASK0 + (UINT32)Index * 2) & MTRR_PHYSMASK_VALID) == 0)
+      Free++;
+  }
+
+  return Free;
+}
+
+/**
+  Split a range into the naturally aligned power of two blocks a variable
+  MTRR can describe, largest alignment first
+
+  @param  Base                Start of the range
+  @param  Length              Size of the range
+  @param  Blocks              Blocks found, appended to
+  @param  Count               Blocks in the array, updated
+**/
+VOID SplitForMtrrs(UINT64 Base, UINT64 Length, WC_RANGE *Blocks, UINTN *Count)
+{
+  UINT64 Size;
+
+  while (Length != 0 && *Count < MAX_WC_RANGES)
+  {
+    // Largest block which is aligned at Base and fits in what's left
+    Size = (Base == 0) ? GetPowerOfTwo64(Length) : MIN(Base & (~Base + 1), GetPowerOfTwo64(Length));
+
+    Blocks[*Count].Base = Base;
+    Blocks[*Count].Length = Size;
+    (*Count)++;
+
+    Base += Size;
+    Length -= Size;
+  }
+}
+
+/**
+  Mark a block write-combining through the GCD, which has the CPU driver
+  program the MTRRs
+
+  @param  Block               Block to mark
+
+  @retval EFI_SUCCESS         Done
+  @retval other               Something went wrong.
+**/
+EFI_STATUS SetWriteCombining(WC_RANGE *Block)
+{
+  EFI_STATUS Status;
+  EFI_GCD_MEMORY_SPACE_DESCRIPTOR Descriptor;
+
+  Status = gDS->GetMemorySpaceDescriptor(Block->Base, &Descriptor);
+
+  if (EFI_ERROR(Status))
+    return Status;
+
+  // Has to sit within one GCD entry, the host bridge adds the whole aperture as one
+  if (Descriptor.GcdMemoryType != EfiGcdMemoryTypeMemoryMappedIo || Descriptor.BaseAddress + Descriptor.Length < Block->Base + Block->Length)
+    return EFI_UNSUPPORTED;
+
+  if ((Descriptor.Capabilities & EFI_MEMORY_WC) == 0)
+  {
+    Status = gDS->SetMemorySpaceCapabilities(Descriptor.BaseAddress, Descriptor.Length, Descriptor.Capabilities | EFI_MEMORY_WC);
+
+    if (EFI_ERROR(Status))
+      return Status;
+  }
+
+  return gDS->SetMemorySpaceAttributes(Block->Base, Block->Length, (Descriptor.Attributes & ~EFI_MEMORY_CACHETYPE_MASK) | EFI_MEMORY_WC);
+}
+
+/**
+  Coalesce the framebuffer BARs of every display device behind the hot plug
+  root ports into the fewest MTRR sized blocks and mark them write-combining.
+  If there aren't enough MTRRs to go round, the largest blocks win and the
+  rest stay uncached.
+**/
+VOID ApplyWriteCombining()
+{
+  WC_RANGE Windows[MAX_TOPOLOGY_DEVICES];
+  WC_RANGE Blocks[MAX_WC_RANGES];
+  TopologyDevice *Device;
+  UINTN WindowCount = 0;
+  UINTN BlockCount = 0;
+  UINTN Free;
+  UINTN Used = 0;
+  UINTN Index;
+  UINTN Other;
+  UINTN BarIndex;
+  UINT64 Base;
+  UINT64 Limit;
+  UINT64 Size;
+  BOOLEAN Prefetchable;
+  WC_RANGE Swap;
+
+  for (Index = 0; Index < gHotPlugTopology.Count; Index++)
+  {
+    Device = &gHotPlugTopology.Devices[Index];
+
+    if ((Device->HeaderType & HEADER_LAYOUT_CODE) != HEADER_TYPE_DEVICE)
+      continue;
+
+    if (PciCfgRead8(Device->Bus, Device->Device, Device->Function, PCI_CLASSCODE_OFFSET + 2) != PCI_CLASS_DISPLAY)
+      continue;
+
+    for (BarIndex = 0; BarIndex < PCI_MAX_BAR && WindowCount < MAX_TOPOLOGY_DEVICES; BarIndex++)
+    {
+      Size = SizeMemoryBar(Device, &BarIndex, &Base, &Prefetchable);
+
+      // Control registers live in the non-prefetchable BARs
+      if (Size == 0 || !Prefetchable || Base == 0)
+        continue;
+
+      Windows[WindowCount].Base = Base;
+      Windows[WindowCount].Length = Size;
+      WindowCount++;
+    }
+  }
+
+  // Sort by base, then merge windows which touch
+  for (Index = 0; Index < WindowCount; Index++)
+  {
+    for (Other = Index + 1; Other < WindowCount; Other++)
+    {
+      if (Windows[Other].Base < Windows[Index].Base)
+      {
+        Swap = Windows[Index];
+        Windows[Index] = Windows[Other];
+        Windows[Other] = Swap;
+      }
+    }
+  }
+
+  for (Index = 0; Index < WindowCount; Index++)
+  {
+    Base = Windows[Index].Base;
+    Limit = Base + Windows[Index].Length;
+
+    while (Index + 1 < WindowCount && Windows[Index + 1].Base == Limit)
+    {
+      Index++;
+      Limit += Windows[Index].Length;
+    }
+
+    SplitForMtrrs(Base, Limit - Base, Blocks, &BlockCount);
+  }
+
+  if (BlockCount == 0)
+    return;
+
+  // Largest first, so they're the ones that get MTRRs if there aren't enough
+  for (Index = 0; Index < BlockCount; Index++)
+  {
+    for (Other = Index + 1; Other < BlockCount; Other++)
+    {
+      if (Blocks[Other].Length > Blocks[Index].Length)
+      {
+        Swap = Blocks[Index];
+        Blocks[Index] = Blocks[Other];
+        Blocks[Other] = Swap;
+      }
+    }
+  }
+
+  Free = CountFreeVariableMtrrs();
+  Free = (Free > MTRR_RESERVED) ? Free - MTRR_RESERVED : 0;
+
+  DEBUG((DEBUG_INFO, "ApplyWriteCombining(): %u framebuffer(s) make %u block(s), %u MTRR(s) to spare\n", WindowCount, BlockCount, Free));
+
+  for (Index = 0; Index < BlockCount; Index++)
+  {
+    EFI_STATUS Status = EFI_OUT_OF_RESOURCES;
+
+    if (Used < Free)
+    {
+      Status = SetWriteCombining(&Blocks[Index]);
+
+      if (!EFI_ERROR(Status))
+        Used++;
+    }
+
+    DEBUG((EFI_ERROR(Status) ? DEBUG_WARN : DEBUG_INFO, "ApplyWriteCombining(): 0x%lx-0x%lx %a (%r)\n",
+           Blocks[Index].Base, Blocks[Index].Base + Blocks[Index].Length - 1, EFI_ERROR(Status) ? "left uncached" : "write-combining", Status));
+  }
+}
@@ -0,0 +1,200 @@
+/**
+ * File: MmioBudget.c
+ * Author: Matthew Millman
+ *
+ * Shares the root bridge's 32-bit MMIO aperture between the padding
+ * windows of every hot plug root port.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciHotPlug.h"
+
+// Used if the root bridge won't report its aperture
+#define MMIO32_APERTURE_BASE    0xC0000000
+#define MMIO32_APERTURE_LIMIT   0xDFFFFFFF
+
+#define MAX_PADDING_WINDOWS     (MAX_PORT_PROFILES * 2)
+
+BOOLEAN mMmioBudgetSolved = FALSE;
+
+/**
+  Get the size of the MMIO aperture below 4GB of the root bridge the hot plug
+  root ports sit under. There can be more than one root bridge, each with its
+  own aperture.
+
+  @retval (value)       Aperture size in bytes
+**/
+UINT64 GetMmio32Aperture()
+{
+  EFI_STATUS Status;
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *First;
+  EFI_HANDLE *Handles = NULL;
+  UINTN HandleCount = 0;
+  UINTN Index;
+  UINT64 Aperture = 0;
+  BOOLEAN Ours;
+
+  Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiPciRootBridgeIoProtocolGuid, NULL, &HandleCount, &Handles);
+
+  for (Index = 0; !EFI_ERROR(Status) && Index < HandleCount && Aperture == 0; Index++)
+  {
+    if (EFI_ERROR(gBS->HandleProtocol(Handles[Index], &gEfiPciRootBridgeIoProtocolGuid, (VOID **)&PciRootBridgeIo)) ||
+        PciRootBridgeIo->SegmentNumber != 0 ||
+        EFI_ERROR(PciRootBridgeIo->Configuration(PciRootBridgeIo, (VOID **)&First)))
+      continue;
+
+    Ours = FALSE;
+
+    for (Descriptor = First; Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Descriptor++)
+    {
+      if (Descriptor->ResType == ACPI_ADDRESS_SPACE_TYPE_BUS &&
+          mRootPorts[0].Bus >= Descriptor->AddrRangeMin && mRootPorts[0].Bus < Descriptor->AddrRangeMin + Descriptor->AddrLen)
+        Ours = TRUE;
+    }
+
+    if (!Ours)
+      continue;
+
+    for (Descriptor = First; Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Descriptor++)
+    {
+      if (Descriptor->ResType == ACPI_ADDRESS_SPACE_TYPE_MEM && Descriptor->AddrRangeMin < SIZE_4GB)
+        Aperture += Descriptor->AddrLen;
+    }
+  }
+
+  if (Handles != NULL)
+    FreePool(Handles);
+
+  if (Aperture == 0)
+  {
+    DEBUG((DEBUG_INFO, "GetMmio32Aperture : Root bridge didn't say (%r), assuming 0x%x-0x%x\n", Status, MMIO32_APERTURE_BASE, MMIO32_APERTURE_LIMIT));
+    Aperture = (UINT64)MMIO32_APERTURE_LIMIT - MMIO32_APERTURE_BASE + 1;
+  }
+
+  return Aperture;
+}
+
+/**
+  Work out how much memory and prefetchable memory padding each root port can have.
+
+  Whatever is left of the 32-bit aperture once the fixed devices are accounted for is
+  shared out so that the smallest window, scaled by
+  the port's weight, is as large as it can be. Windows which want less than their fair
+  share get exactly what they asked for, and the remainder is shared between the rest.
+
+  The result lands in MemBudgetMB / PMemBudgetMB of each root port. It is only worked
+  out once.
+**/
+VOID SolveMmioBudget()
+{
+  UINT32 Cap[MAX_PADDING_WINDOWS];
+  UINT32 Weight[MAX_PADDING_WINDOWS];
+  UINT32 Grant[MAX_PADDING_WINDOWS];
+  BOOLEAN Settled[MAX_PADDING_WINDOWS];
+  UINTN PortCount;
+  UINTN Windows;
+  UINTN Index;
+  UINT64 Aperture;
+  UINT64 Used;
+  UINT32 Remaining;
+  UINT32 RemainingWeight = 0;
+  BOOLEAN Changed;
+
+  if (mMmioBudgetSolved)
+    return;
+
+  mMmioBudgetSolved = TRUE;
+
+  PortCount = MIN(mRootPortCount, MAX_PORT_PROFILES);
+  Windows = PortCount * 2;
+
+  Aperture = GetMmio32Aperture();
+  Used = GetFixedMmio();
+
+  for (Index = 0; Index < PortCount; Index++)
+  {
+    HOT_PLUG_ROOT_PORT *Port = &mRootPorts[Index];
+    HOT_PLUG_PORT_PROFILE *Profile = FindPortProfile(Port->Bus, Port->Device, Port->Function);
+
+    // Devices already behind the port aren't counted as used. PciBus sizes the window
+    // as the larger of the padding and what's behind it, so they come out of the grant.
+    Cap[Index * 2] = Port->MemPaddingMB;
+    Cap[Index * 2 + 1] = Port->PMemPaddingMB;
+
+    // SR-IOV devices behind the port need room for their VFs on top of the padding
+    if (Profile != NULL)
+    {
+      Cap[Index * 2] += (UINT32)RShiftU64(Profile->VfMem + SIZE_1MB - 1, 20);
+      Cap[Index * 2 + 1] += (UINT32)RShiftU64(Profile->VfPMem + SIZE_1MB - 1, 20);
+    }
+    Weight[Index * 2] = Weight[Index * 2 + 1] = MAX(Port->Weight, 1);
+  }
+
+  Remaining = (Aperture > Used) ? (UINT32)RShiftU64(Aperture - Used, 20) : 0;
+
+  DEBUG((DEBUG_INFO, "SolveMmioBudget : Aperture 0x%lx, in use 0x%lx, %u MB to share between %u window(s)\n", Aperture, Used, Remaining, Windows));
+
+  for (Index = 0; Index < Windows; Index++)
+  {
+    Grant[Index] = 0;
+    Settled[Index] = FALSE;
+    RemainingWeight += Weight[Index];
+  }
+
+  //
+  // Water fill. Any window whose cap sits below the current per-weight level is
+  // satisfied in full, which raises the level for everybody else. Repeat until
+  // nothing changes, then everyone left gets the same level.
+  //
+  do
+  {
+    Changed = FALSE;
+
+    for (Index = 0; Index < Windows && RemainingWeight != 0; Index++)
+    {
+      if (Settled[Index] || Cap[Index] * RemainingWeight > Weight[Index] * Remaining)
+        continue;
+
+      Grant[Index] = Cap[Index];
+      Settled[Index] = TRUE;
+      Remaining -= Cap[Index];
+      RemainingWeight -= Weight[Index];
+      Changed = TRUE;
+    }
+  } while (Changed && RemainingWeight != 0);
+
+  for (Index = 0; Index < Windows; Index++)
+  {
+    if (!Settled[Index])
+      Grant[Index] = (Remaining * Weight[Index]) / RemainingWeight;
+  }
+
+  for (Index = 0; Index < PortCount; Index++)
+  {
+    HOT_PLUG_ROOT_PORT *Port = &mRootPorts[Index];
+
+    // VF space can take a cap past what the padding fields hold
+    Port->MemBudgetMB = (UINT16)MIN(Grant[Index * 2], MAX_UINT16);
+    Port->PMemBudgetMB = (UINT16)MIN(Grant[Index * 2 + 1], MAX_UINT16);
+
+    DEBUG((DEBUG_INFO, "SolveMmioBudget : %02X:%02X.%X (weight %u) Mem %u/%u MB, PMem %u/%u MB\n",
+           Port->Bus, Port->Device, Port->Function, Weight[Index * 2],
+           Port->MemBudgetMB, Port->MemPaddingMB, Port->PMemBudgetMB, Port->PMemPaddingMB));
+  }
+}
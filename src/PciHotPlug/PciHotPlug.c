@@ -28,15 +28,34 @@
 #define PADDING_IO (1)
 #define PADDING_NUM (PADDING_BUS + PADDING_NONPREFETCH_MEM + PADDING_PREFETCH_MEM + PADDING_IO)
 
-GLOBAL_REMOVE_IF_UNREFERENCED EFI_HPC_LOCATION mPcieLocation[1];
-
-#define HPC_COUNT 1
-
 // AIC Root port
 #define RP_BUS      0x00
 #define RP_DEV      0x1C
 #define RP_FUNC     0x04
 
+// Root port padding. Alignments of 0 are derived from the largest BAR recorded behind the port.
+#define RP_MEM_PADDING_MB     512
+#define RP_PMEM_PADDING_MB    512
+#define RP_IO_PADDING_KB      4
+#define RP_IO_POLICY          IO_PADDING_AUTO
+#define RP_MEM_ALIGNMENT      0
+#define RP_PMEM_ALIGNMENT     0
+#define RP_MMIO_WEIGHT        1     // Share of the MMIO budget relative to other root ports
+
+//
+// One entry per Thunderbolt controller. All of them have to share the root bridge's
+// 32-bit MMIO aperture, see SolveMmioBudget().
+//
+HOT_PLUG_ROOT_PORT mRootPorts[] = {
+  { RP_BUS, RP_DEV, RP_FUNC, RP_MMIO_WEIGHT, RP_MEM_PADDING_MB, RP_PMEM_PADDING_MB, RP_IO_PADDING_KB, RP_IO_POLICY, RP_MEM_ALIGNMENT, RP_PMEM_ALIGNMENT }
+};
+
+UINTN mRootPortCount = sizeof(mRootPorts) / sizeof(mRootPorts[0]);
+
+#define HPC_COUNT (sizeof(mRootPorts) / sizeof(mRootPorts[0]))
+
+GLOBAL_REMOVE_IF_UNREFERENCED EFI_HPC_LOCATION mPcieLocation[HPC_COUNT];
+
 // Thunderbolt port 1
 #define HP1_BUS      0x05
 #define HP1_DEV      0x01
@@ -47,6 +66,20 @@ GLOBAL_REMOVE_IF_UNREFERENCED EFI_HPC_LOCATION mPcieLocation[1];
 #define HP2_DEV      0x04
 #define HP2_FUNC     0x00
 
+// Bus number reservation for the Thunderbolt downstream ports
+#define TBT_MAX_CHAIN_DEPTH       3   // Docks daisy chained behind a single port
+#define TBT_BUSES_PER_HOP         6   // Upstream port + internal bus + downstream ports of one dock
+#define TBT_BUS_RESERVE_AFTER     8   // Left for root ports enumerated after the controller
+#define TBT_DEFAULT_BUS_PADDING   20  // Used if the root bridge bus range can't be read
+
+GLOBAL_REMOVE_IF_UNREFERENCED HOT_PLUG_DOWNSTREAM_PORT mDownstreamPorts[] = {
+  { HP1_BUS, HP1_DEV, HP1_FUNC, TBT_MAX_CHAIN_DEPTH, FALSE, TBT_DEFAULT_BUS_PADDING },
+  { HP2_BUS, HP2_DEV, HP2_FUNC, TBT_MAX_CHAIN_DEPTH, FALSE, TBT_DEFAULT_BUS_PADDING }
+};
+
+#define DOWNSTREAM_PORT_COUNT (sizeof(mDownstreamPorts) / sizeof(mDownstreamPorts[0]))
+
+BOOLEAN mBusPaddingAllocated = FALSE;
 
 typedef struct _EFI_GLOBAL_NVS_AREA_PROTOCOL
 {
@@ -66,28 +99,35 @@ EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Syste
   EFI_STATUS Status;
   UINTN RpDev;
   UINTN RpFunc;
+  UINTN Index;
   PCI_HOT_PLUG_INSTANCE *PciHotPlug;
   PCIE_HOT_PLUG_DEVICE_PATH *HotplugPcieDevicePath;
+  EFI_EVENT ReadyToBootEvent;
 
-  HotplugPcieDevicePath = NULL;
-  HotplugPcieDevicePath = AllocatePool(sizeof(PCIE_HOT_PLUG_DEVICE_PATH));
-  ASSERT(HotplugPcieDevicePath != NULL);
-  if (HotplugPcieDevicePath == NULL)
+  LoadPortProfiles();
+
+  for (Index = 0; Index < HPC_COUNT; Index++)
   {
-    return EFI_OUT_OF_RESOURCES;
-  }
+    HotplugPcieDevicePath = NULL;
+    HotplugPcieDevicePath = AllocatePool(sizeof(PCIE_HOT_PLUG_DEVICE_PATH));
+    ASSERT(HotplugPcieDevicePath != NULL);
+    if (HotplugPcieDevicePath == NULL)
+    {
+      return EFI_OUT_OF_RESOURCES;
+    }
 
-  RpDev = RP_DEV;
-  RpFunc = RP_FUNC;
+    RpDev = mRootPorts[Index].Device;
+    RpFunc = mRootPorts[Index].Function;
 
-  CopyMem(HotplugPcieDevicePath, &mHotplugPcieDevicePathTemplate, sizeof(PCIE_HOT_PLUG_DEVICE_PATH));
-  HotplugPcieDevicePath->PciRootPortNode.Device = (UINT8)RpDev;    // Update real Device no
-  HotplugPcieDevicePath->PciRootPortNode.Function = (UINT8)RpFunc; // Update real Function no
+    CopyMem(HotplugPcieDevicePath, &mHotplugPcieDevicePathTemplate, sizeof(PCIE_HOT_PLUG_DEVICE_PATH));
+    HotplugPcieDevicePath->PciRootPortNode.Device = (UINT8)RpDev;    // Update real Device no
+    HotplugPcieDevicePath->PciRootPortNode.Function = (UINT8)RpFunc; // Update real Function no
 
-  mPcieLocation[0].HpcDevicePath = (EFI_DEVICE_PATH_PROTOCOL *)HotplugPcieDevicePath;
-  mPcieLocation[0].HpbDevicePath = (EFI_DEVICE_PATH_PROTOCOL *)HotplugPcieDevicePath;
+    mPcieLocation[Index].HpcDevicePath = (EFI_DEVICE_PATH_PROTOCOL *)HotplugPcieDevicePath;
+    mPcieLocation[Index].HpbDevicePath = (EFI_DEVICE_PATH_PROTOCOL *)HotplugPcieDevicePath;
 
-  DEBUG((DEBUG_INFO, "PciHotPlug (PCH RP#) : Bus 0x00, Device 0x%x, Function 0x%x is added to the Hotplug Device Path list \n", RpDev, RpFunc));
+    DEBUG((DEBUG_INFO, "PciHotPlug (PCH RP#) : Bus 0x00, Device 0x%x, Function 0x%x is added to the Hotplug Device Path list \n", RpDev, RpFunc));
+  }
 
   PciHotPlug = AllocatePool(sizeof(PCI_HOT_PLUG_INSTANCE));
   ASSERT(PciHotPlug != NULL);
@@ -113,6 +153,9 @@ EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Syste
       &PciHotPlug->HotPlugInitProtocol);
   ASSERT_EFI_ERROR(Status);
 
+  // Check what we were given, and remember what is plugged in for next time
+  EfiCreateEventReadyToBootEx(TPL_CALLBACK, OnReadyToBootRecordProfiles, NULL, &ReadyToBootEvent);
+
   return Status;
 }
 
@@ -186,6 +229,228 @@ InitializeRootHpc(
   return EFI_SUCCESS;
 }
 
+/**
+  Find a hot plug root port in the port table
+
+  @param[in]  Bus       Bus number of the port
+  @param[in]  Device    Device number of the port
+  @param[in]  Function  Function number of the port
+
+  @retval (pointer)     Table entry for the port
+  @retval NULL          Not a root port we pad
+**/
+HOT_PLUG_ROOT_PORT *FindRootPort(UINTN Bus, UINTN Device, UINTN Function)
+{
+  UINTN Index;
+
+  for (Index = 0; Index < mRootPortCount; Index++)
+  {
+    if (mRootPorts[Index].Bus == Bus && mRootPorts[Index].Device == Device && mRootPorts[Index].Function == Function)
+      return &mRootPorts[Index];
+  }
+
+  return NULL;
+}
+
+/**
+  Find a Thunderbolt downstream port in the port table
+
+  @param[in]  Bus       Bus number of the port
+  @param[in]  Device    Device number of the port
+  @param[in]  Function  Function number of the port
+
+  @retval (pointer)     Table entry for the port
+  @retval NULL          Not a downstream port we pad
+**/
+HOT_PLUG_DOWNSTREAM_PORT *FindDownstreamPort(UINTN Bus, UINTN Device, UINTN Function)
+{
+  UINTN Index;
+
+  for (Index = 0; Index < DOWNSTREAM_PORT_COUNT; Index++)
+  {
+    if (mDownstreamPorts[Index].Bus == Bus && mDownstreamPorts[Index].Device == Device && mDownstreamPorts[Index].Function == Function)
+      return &mDownstreamPorts[Index];
+  }
+
+  return NULL;
+}
+
+/**
+  Read a bridge's primary, secondary and subordinate bus numbers
+
+  @param  PciRootBridgeIo     Root bridge the bridge sits under
+  @param  Bus, Device, Function   Location of the bridge
+
+  @retval (value)             Bus number register, 0 if it can't be read
+**/
+UINT32 ReadBridgeBusNumbers(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo, UINTN Bus, UINTN Device, UINTN Function)
+{
+  UINT32 BusNumbers = 0;
+
+  if (EFI_ERROR(PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint32,
+                                          EFI_PCI_ADDRESS(Bus, Device, Function, PCI_BRIDGE_PRIMARY_BUS_REGISTER_OFFSET), 1, &BusNumbers)) ||
+      BusNumbers == 0xFFFFFFFF)
+    return 0;
+
+  return BusNumbers;
+}
+
+/**
+  Split the bus numbers left in the root bridge's range between the downstream ports
+  which are actually present, in proportion to the chain depth configured for each port.
+
+  The split is only worked out once, on the first request for downstream port padding.
+  If the root bridge can't tell us its bus range, every port keeps TBT_DEFAULT_BUS_PADDING.
+**/
+VOID AllocateBusPadding()
+{
+  EFI_STATUS Status;
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo;
+  EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
+  UINT64 BusBase = 0;
+  UINT64 BusLimit = 0;
+  UINTN PortsFound = 0;
+  UINTN TotalDepth = 0;
+  UINTN Available;
+  UINTN Share;
+  UINTN Index;
+  UINTN Used;
+  UINTN Limit;
+  UINT32 BusNumbers;
+  UINT16 VendorId;
+  UINT8 SriovBuses = GetSriovBusPadding();
+
+  if (mBusPaddingAllocated)
+    return;
+
+  mBusPaddingAllocated = TRUE;
+
+  Status = gBS->LocateProtocol(&gEfiPciRootBridgeIoProtocolGuid, NULL, (VOID **)&PciRootBridgeIo);
+
+  if (EFI_ERROR(Status))
+  {
+    DEBUG((DEBUG_ERROR, "AllocateBusPadding : No root bridge (%r), using %u buses per port\n", Status, TBT_DEFAULT_BUS_PADDING));
+    return;
+  }
+
+  // Same bus descriptor that StartBusEnumeration() hands to PciBus
+  Status = PciRootBridgeIo->Configuration(PciRootBridgeIo, (VOID **)&Descriptor);
+
+  if (!EFI_ERROR(Status))
+  {
+    for (; Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; Descriptor++)
+    {
+      if (Descriptor->ResType == ACPI_ADDRESS_SPACE_TYPE_BUS && Descriptor->AddrLen != 0)
+      {
+        BusBase = Descriptor->AddrRangeMin;
+        BusLimit = Descriptor->AddrRangeMin + Descriptor->AddrLen - 1;
+        break;
+      }
+    }
+  }
+
+  if (BusLimit == 0 || BusLimit > PCI_MAX_BUS)
+  {
+    DEBUG((DEBUG_ERROR, "AllocateBusPadding : Root bridge bus range unavailable (%r), using %u buses per port\n", Status, TBT_DEFAULT_BUS_PADDING));
+    return;
+  }
+
+  for (Index = 0; Index < DOWNSTREAM_PORT_COUNT; Index++)
+  {
+    HOT_PLUG_DOWNSTREAM_PORT *Port = &mDownstreamPorts[Index];
+
+    Status = PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint16, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0), 1, &VendorId);
+
+    Port->Present = (!EFI_ERROR(Status) && VendorId != 0xFFFF);
+
+    if (Port->Present)
+    {
+      PortsFound++;
+      TotalDepth += Port->MaxChainDepth;
+    }
+  }
+
+  if (PortsFound == 0 || TotalDepth == 0)
+    return;
+
+  //
+  // The downstream ports all share the switch's internal bus, the secondary bus of the
+  // switch's upstream port, which sits straight below the root port. Its subordinate bus
+  // is as far as the ports can reach. While PciBus is still scanning that's the top of
+  // the root bridge's range, and then root ports enumerated after ours need some left.
+  //
+  Limit = (UINTN)BusLimit;
+  Used = mDownstreamPorts[0].Bus;
+  BusNumbers = ReadBridgeBusNumbers(PciRootBridgeIo, mRootPorts[0].Bus, mRootPorts[0].Device, mRootPorts[0].Function);
+
+  if (BusNumbers != 0)
+    BusNumbers = ReadBridgeBusNumbers(PciRootBridgeIo, (UINT8)(BusNumbers >> 8), 0, 0);
+
+  if ((UINT8)(BusNumbers >> 8) == mDownstreamPorts[0].Bus && (UINT8)(BusNumbers >> 16) >= mDownstreamPorts[0].Bus)
+    Limit = MIN(Limit, (UINTN)(UINT8)(BusNumbers >> 16));
+
+  if (Limit == BusLimit)
+    Limit = (Limit > TBT_BUS_RESERVE_AFTER) ? Limit - TBT_BUS_RESERVE_AFTER : 0;
+
+  // Anything a port already has below it is gone
+  for (Index = 0; Index < DOWNSTREAM_PORT_COUNT; Index++)
+  {
+    HOT_PLUG_DOWNSTREAM_PORT *Port = &mDownstreamPorts[Index];
+
+    if (!Port->Present)
+      continue;
+
+    BusNumbers = ReadBridgeBusNumbers(PciRootBridgeIo, Port->Bus, Port->Device, Port->Function);
+
+    if ((UINT8)(BusNumbers >> 8) > Port->Bus && (UINT8)(BusNumbers >> 16) < Limit)
+      Used = MAX(Used, (UINTN)(UINT8)(BusNumbers >> 16));
+  }
+
+  // Out of buses, the ports get none beyond their own secondary bus. Falling back to the
+  // default padding here would ask for more than there is, which is what ran us out.
+  if (Limit <= Used + PortsFound)
+  {
+    DEBUG((DEBUG_ERROR, "AllocateBusPadding : Bus range 0x%lx-0x%lx exhausted, no padding\n", BusBase, BusLimit));
+    Available = 0;
+  }
+  else
+  {
+    Available = Limit - Used - PortsFound;
+  }
+
+  // VF routing IDs of SR-IOV devices seen last boot come off the top, for each port
+  if (Available > SriovBuses * PortsFound)
+    Available -= SriovBuses * PortsFound;
+  else
+    SriovBuses = 0;
+
+  DEBUG((DEBUG_INFO, "AllocateBusPadding : Root bridge buses 0x%lx-0x%lx, used to 0x%x, limit 0x%x, %u available for %u port(s)\n",
+         BusBase, BusLimit, Used, Limit, Available, PortsFound));
+
+  for (Index = 0; Index < DOWNSTREAM_PORT_COUNT; Index++)
+  {
+    HOT_PLUG_DOWNSTREAM_PORT *Port = &mDownstreamPorts[Index];
+
+    if (!Port->Present)
+      continue;
+
+    // The whole surplus is handed out, root ports after ours already have theirs set aside.
+    // Depth only weights the split, so a chain deeper than MaxChainDepth can still come up.
+    Share = (Available * Port->MaxChainDepth) / TotalDepth;
+
+    if (Share < (UINTN)Port->MaxChainDepth * TBT_BUSES_PER_HOP)
+      DEBUG((DEBUG_WARN, "AllocateBusPadding : Port %02X:%02X.%X can't reach a chain depth of %u\n",
+             Port->Bus, Port->Device, Port->Function, Port->MaxChainDepth));
+
+    Share = MIN(Share + SriovBuses, PCI_MAX_BUS);
+
+    Port->BusPadding = (UINT8)Share;
+
+    DEBUG((DEBUG_INFO, "AllocateBusPadding : Port %02X:%02X.%X (depth %u) gets %u buses\n",
+           Port->Bus, Port->Device, Port->Function, Port->MaxChainDepth, Port->BusPadding));
+  }
+}
+
 /**
   Returns the resource padding required by the PCI bus that is controlled by the specified Hot Plug Controller.
   @param[in]  This           The pointer to the instance of the EFI_PCI_HOT_PLUG_INIT protocol. initialized.
@@ -207,6 +472,8 @@ GetResourcePadding(
     OUT EFI_HPC_PADDING_ATTRIBUTES *Attributes)
 {
   EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *PaddingResource;
+  HOT_PLUG_ROOT_PORT *RootPort;
+  HOT_PLUG_DOWNSTREAM_PORT *DownstreamPort;
   UINT8 RsvdExtraBusNum = 0;
 
   UINTN RpBus;
@@ -236,21 +503,21 @@ GetResourcePadding(
   ZeroMem(PaddingResource, (PADDING_NUM * sizeof(EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR)) + sizeof(EFI_ACPI_END_TAG_DESCRIPTOR));
   *Attributes = EfiPaddingPciBus;
 
-  if ((RpBus == RP_BUS && RpDev == RP_DEV && RpFunc == RP_FUNC))
+  if ((RootPort = FindRootPort(RpBus, RpDev, RpFunc)) != NULL)
   {
-    UINT16 RsvdPcieMegaMem = 10;
-    UINT8 PcieMemAddrRngMax = 0;
-    UINT16 RsvdPciePMegaMem = 10;
-    UINT8 PciePMemAddrRngMax = 0;
-    UINT8 RsvdPcieKiloIo = 4;
-
+    UINT16 RsvdPcieMegaMem;
+    UINT64 PcieMemAlignment = GetPaddingAlignment(RootPort, FALSE);
+    UINT16 RsvdPciePMegaMem;
+    UINT64 PciePMemAlignment = GetPaddingAlignment(RootPort, TRUE);
+    UINT8 RsvdPcieKiloIo = GetIoPadding(RootPort);
     DEBUG((DEBUG_INFO, "GetResourcePadding : Padding for root bridge\n"));
 
+    // What this port can have without starving the other controllers
+    SolveMmioBudget();
 
-    RsvdPcieMegaMem = 512;
-    // PcieMemAddrRngMax = TbtPcieMemAddrRngMax;
-    RsvdPciePMegaMem = 512;
-    // PciePMemAddrRngMax = TbtPciePMemAddrRngMax;
+    RsvdPcieMegaMem = RootPort->MemBudgetMB;
+    RsvdPciePMegaMem = RootPort->PMemBudgetMB;
+    DEBUG((DEBUG_INFO, "GetResourcePadding : Mem alignment 0x%lx, PMem alignment 0x%lx\n", PcieMemAlignment, PciePMemAlignment));
 
     //
     // Padding for non-prefetchable memory
@@ -265,8 +532,8 @@ GetResourcePadding(
     // Pad non-prefetchable
     //
     PaddingResource->AddrRangeMin = 0;
-    PaddingResource->AddrLen = RsvdPcieMegaMem * 0x100000;
-    PaddingResource->AddrRangeMax = (1 << PcieMemAddrRngMax) - 1;
+    PaddingResource->AddrLen = (UINT64)RsvdPcieMegaMem * 0x100000;
+    PaddingResource->AddrRangeMax = PcieMemAlignment - 1;
 
     //
     // Padding for prefetchable memory
@@ -277,44 +544,54 @@ GetResourcePadding(
     PaddingResource->ResType = ACPI_ADDRESS_SPACE_TYPE_MEM;
     PaddingResource->GenFlag = 0x0;
     PaddingResource->AddrSpaceGranularity = 32;
+    PaddingResource->SpecificFlag = EFI_ACPI_MEMORY_RESOURCE_SPECIFIC_FLAG_CACHEABLE_PREFETCHABLE;
     //
     // Padding for prefetchable memory
     //
     PaddingResource->AddrRangeMin = 0;
-    PaddingResource->AddrLen = RsvdPciePMegaMem * 0x100000;
+    PaddingResource->AddrLen = (UINT64)RsvdPciePMegaMem * 0x100000;
     //
     // Pad 16 MB of MEM
     //
-    PaddingResource->AddrRangeMax = (1 << PciePMemAddrRngMax) - 1;
-    //
-    // Alignment
-    //
-    // Padding for I/O
-    //
-    PaddingResource++;
-    PaddingResource->Desc = 0x8A;
-    PaddingResource->Len = 0x2B;
-    PaddingResource->ResType = ACPI_ADDRESS_SPACE_TYPE_IO;
-    PaddingResource->GenFlag = 0x0;
-    PaddingResource->SpecificFlag = 0;
-    PaddingResource->AddrRangeMin = 0;
-    PaddingResource->AddrLen = RsvdPcieKiloIo * 0x400;
-    //
-    // Pad 4K of IO
-    //
-    PaddingResource->AddrRangeMax = 1;
+    PaddingResource->AddrRangeMax = PciePMemAlignment - 1;
     //
     // Alignment
     //
     PaddingResource++;
 
+    if (RsvdPcieKiloIo != 0)
+    {
+      //
+      // Padding for I/O
+      //
+      PaddingResource->Desc = 0x8A;
+      PaddingResource->Len = 0x2B;
+      PaddingResource->ResType = ACPI_ADDRESS_SPACE_TYPE_IO;
+      PaddingResource->GenFlag = 0x0;
+      PaddingResource->SpecificFlag = 0;
+      PaddingResource->AddrRangeMin = 0;
+      PaddingResource->AddrLen = RsvdPcieKiloIo * 0x400;
+      //
+      // Pad 4K of IO
+      //
+      PaddingResource->AddrRangeMax = 1;
+      //
+      // Alignment
+      //
+      PaddingResource++;
+    }
+
     *HpcState = EFI_HPC_STATE_INITIALIZED | EFI_HPC_STATE_ENABLED;
   }
-  else if ((RpBus == HP1_BUS && RpDev == HP1_DEV && RpFunc == HP1_FUNC) || (RpBus == HP2_BUS && RpDev == HP2_DEV && RpFunc == HP2_FUNC))
+  else if ((DownstreamPort = FindDownstreamPort(RpBus, RpDev, RpFunc)) != NULL)
   {
     DEBUG((DEBUG_INFO, "GetResourcePadding : Padding for downstream bridge\n"));
 
-    RsvdExtraBusNum = 20;
+    AllocateBusPadding();
+
+    RsvdExtraBusNum = DownstreamPort->BusPadding;
+
+    DEBUG((DEBUG_INFO, "GetResourcePadding : Reserving %u extra buses\n", RsvdExtraBusNum));
 
     PaddingResource->Desc = 0x8A;
     PaddingResource->Len = 0x2B;
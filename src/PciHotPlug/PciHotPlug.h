@@ -34,8 +34,10 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <IndustryStandard/Acpi10.h>
+#include <IndustryStandard/Pci.h>
 #include <Protocol/PciHotPlugInit.h>
 #include <Protocol/PciRootBridgeIo.h>
+#include <Protocol/PciIo.h>
 #include <Library/DevicePathLib.h>
 #include <Library/UefiLib.h>
 #include <Guid/HobList.h>
@@ -72,12 +74,82 @@ typedef struct PCIE_HOT_PLUG_DEVICE_PATH {
   EFI_DEVICE_PATH_PROTOCOL  EndDeviceNode;
 } PCIE_HOT_PLUG_DEVICE_PATH;
 
+typedef struct {
+  UINT8     Bus;
+  UINT8     Device;
+  UINT8     Function;
+  UINT8     Weight;         // Share of the MMIO budget relative to the other root ports
+  UINT16    MemPaddingMB;   // Most we would like
+  UINT16    PMemPaddingMB;  // Most we would like
+  UINT8     IoPaddingKB;
+  UINT8     IoPolicy;       // IO_PADDING_xxx
+  UINT64    MemAlignment;   // 0 = derive from the largest BAR recorded behind the port
+  UINT64    PMemAlignment;  // 0 = derive from the largest BAR recorded behind the port
+  UINT16    MemBudgetMB;    // What the MMIO budget solver granted
+  UINT16    PMemBudgetMB;   // What the MMIO budget solver granted
+  BOOLEAN   IoDecided;      // IoBudgetKB has been worked out
+  UINT8     IoBudgetKB;     // What GetIoPadding() decided
+} HOT_PLUG_ROOT_PORT;
+
+//
+// What was found behind a hot plug root port on the previous boot.
+// Stored in the HotPlugPortProfile variable, one entry per root port.
+// Bump the revision whenever the layout changes, old profiles are then ignored.
+//
+#define HOT_PLUG_PORT_PROFILE_REVISION  4
+
+typedef struct {
+  UINT8     Bus;
+  UINT8     Device;
+  UINT8     Function;
+  UINT8     Revision;
+  UINT32    IoBarCount;     // I/O BARs behind the port
+  UINT64    LargestMemBar;
+  UINT64    LargestPMemBar;
+  UINT64    TotalMem;       // Sum of the non-prefetchable BARs behind the port
+  UINT64    TotalPMem;      // Sum of the prefetchable BARs behind the port
+  UINT64    VfMem;          // Non-prefetchable VF BARs x TotalVFs of SR-IOV devices behind the port
+  UINT64    VfPMem;         // Prefetchable VF BARs x TotalVFs of SR-IOV devices behind the port
+  UINT32    VfBuses;        // Extra buses the VF routing IDs reach beyond their PF's bus
+} HOT_PLUG_PORT_PROFILE;
+
+#define MAX_PORT_PROFILES       8
+
+//
+// I/O padding policy per root port
+//
+#define IO_PADDING_ALWAYS       0   // Always pad
+#define IO_PADDING_AUTO         1   // Pad unless the previous boot found no I/O BARs behind the port
+#define IO_PADDING_NEVER        2   // Expected devices never have I/O BARs
+#define MIN_PADDING_ALIGNMENT   SIZE_1MB  // Bridge memory windows are 1MB granular
+
+typedef struct {
+  UINT8     Bus;
+  UINT8     Device;
+  UINT8     Function;
+  UINT8     MaxChainDepth;  // Deepest daisy chain expected behind this port
+  BOOLEAN   Present;
+  UINT8     BusPadding;     // Extra buses handed out by the allocator
+} HOT_PLUG_DOWNSTREAM_PORT;
+
 typedef struct {
   UINTN                           Signature;
   EFI_HANDLE                      Handle; // Handle for protocol this driver installs on
   EFI_PCI_HOT_PLUG_INIT_PROTOCOL  HotPlugInitProtocol;
 } PCI_HOT_PLUG_INSTANCE;
 
+extern HOT_PLUG_ROOT_PORT mRootPorts[];
+extern UINTN mRootPortCount;
+
+VOID LoadPortProfiles();
+HOT_PLUG_PORT_PROFILE *FindPortProfile(UINTN Bus, UINTN Device, UINTN Function);
+UINT64 GetPaddingAlignment(HOT_PLUG_ROOT_PORT *Port, BOOLEAN Prefetchable);
+UINT64 GetFixedMmio();
+UINT8 GetIoPadding(HOT_PLUG_ROOT_PORT *Port);
+UINT8 GetSriovBusPadding();
+VOID SolveMmioBudget();
+VOID EFIAPI OnReadyToBootRecordProfiles(IN EFI_EVENT Event, IN VOID *Context);
+
 /**
   This procedure returns a list of Root Hot Plug controllers that require
   initialization during boot process
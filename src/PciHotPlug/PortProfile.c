@@ -0,0 +1,615 @@
+/**
+ * File: PortProfile.c
+ * Author: Matthew Millman
+ *
+ * Remembers what was plugged in behind each hot plug root port, so the
+ * next boot can size and align its padding to suit.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PciHotPlug.h"
+
+#define PORT_PROFILE_VARIABLE L"HotPlugPortProfile"
+#define FIXED_MMIO_VARIABLE   L"HotPlugFixedMmio"
+
+#define PCIE_EXT_CAP_ID_SRIOV 0x0010
+#define SRIOV_CONTROL         0x08
+#define SRIOV_CTL_VF_ENABLE   BIT0
+#define SRIOV_CTL_VF_MSE      BIT3
+#define SRIOV_TOTAL_VFS       0x0E
+#define SRIOV_FIRST_VF_OFFSET 0x14
+#define SRIOV_VF_STRIDE       0x16
+#define SRIOV_VF_BAR0         0x24
+
+EFI_GUID gHotPlugPortProfileGuid = {0xAED84B62, 0xEA2F, 0x4356, {0x88, 0xE8, 0xCD, 0x01, 0x21, 0xEF, 0xE9, 0x1F}};
+
+// Profiles from the previous boot. Used for padding decisions on this boot.
+HOT_PLUG_PORT_PROFILE mPortProfiles[MAX_PORT_PROFILES];
+UINTN mPortProfileCount = 0;
+UINT64 mFixedMmio = 0;
+UINTN mIoPaddingFreedKB = 0;
+
+/**
+  Round a size up to the next power of two.
+
+  @param  Value               Size to round
+
+  @retval (value)             Smallest power of two not below Value
+**/
+UINT64 AlignToPowerOfTwo(UINT64 Value)
+{
+  UINT64 Power;
+
+  if (Value == 0)
+    return 0;
+
+  Power = GetPowerOfTwo64(Value);
+
+  return (Power == Value) ? Power : LShiftU64(Power, 1);
+}
+
+/**
+  Load the port profiles recorded on the previous boot.
+  A missing or mis-sized variable just means there is nothing to go on yet.
+**/
+VOID LoadPortProfiles()
+{
+  EFI_STATUS Status;
+  UINTN Size = sizeof(mPortProfiles);
+  UINTN Index;
+
+  mPortProfileCount = 0;
+
+  Status = gRT->GetVariable(PORT_PROFILE_VARIABLE, &gHotPlugPortProfileGuid, NULL, &Size, mPortProfiles);
+
+  if (EFI_ERROR(Status) || (Size % sizeof(HOT_PLUG_PORT_PROFILE)) != 0)
+  {
+    DEBUG((DEBUG_INFO, "LoadPortProfiles : No usable profile (%r)\n", Status));
+    return;
+  }
+
+  for (Index = 0; Index < Size / sizeof(HOT_PLUG_PORT_PROFILE); Index++)
+  {
+    if (mPortProfiles[Index].Revision != HOT_PLUG_PORT_PROFILE_REVISION)
+    {
+      DEBUG((DEBUG_INFO, "LoadPortProfiles : Profile revision %u is stale, ignoring\n", mPortProfiles[Index].Revision));
+      return;
+    }
+  }
+
+  mPortProfileCount = Size / sizeof(HOT_PLUG_PORT_PROFILE);
+
+  Size = sizeof(mFixedMmio);
+  Status = gRT->GetVariable(FIXED_MMIO_VARIABLE, &gHotPlugPortProfileGuid, NULL, &Size, &mFixedMmio);
+
+  if (EFI_ERROR(Status))
+    mFixedMmio = 0;
+
+  DEBUG((DEBUG_INFO, "LoadPortProfiles : %u port profile(s) loaded, fixed MMIO 0x%lx\n", mPortProfileCount, mFixedMmio));
+}
+
+/**
+  Get the 32-bit MMIO used by devices outside the hot plug hierarchies on the previous boot
+
+  @retval (value)       Bytes of MMIO, 0 if nothing was recorded
+**/
+UINT64 GetFixedMmio()
+{
+  return mFixedMmio;
+}
+
+/**
+  Find the profile recorded for a root port on the previous boot
+
+  @param[in]  Bus       Bus number of the port
+  @param[in]  Device    Device number of the port
+  @param[in]  Function  Function number of the port
+
+  @retval (pointer)     Recorded profile
+  @retval NULL          Nothing recorded for this port
+**/
+HOT_PLUG_PORT_PROFILE *FindPortProfile(UINTN Bus, UINTN Device, UINTN Function)
+{
+  UINTN Index;
+
+  for (Index = 0; Index < mPortProfileCount; Index++)
+  {
+    if (mPortProfiles[Index].Bus == Bus && mPortProfiles[Index].Device == Device && mPortProfiles[Index].Function == Function)
+      return &mPortProfiles[Index];
+  }
+
+  return NULL;
+}
+
+/**
+  Work out the alignment a root port's padding window should carry.
+
+  A configured alignment always wins. Otherwise the window is aligned to the largest
+  BAR recorded behind the port, so the same device can be re-added into the window.
+
+  PciBus aligns each hot plug window to its padding's alignment. A prefetchable window
+  of 2MB or 1GB or more is aligned to at least that, so the OS can map it with large pages.
+
+  @param[in]  Port          Root port table entry
+  @param[in]  Prefetchable  TRUE for the prefetchable window
+
+  @retval (value)           Alignment in bytes, always a power of two
+**/
+UINT64 GetPaddingAlignment(HOT_PLUG_ROOT_PORT *Port, BOOLEAN Prefetchable)
+{
+  HOT_PLUG_PORT_PROFILE *Profile;
+  UINT64 Alignment;
+  UINT64 Window;
+
+  Alignment = Prefetchable ? Port->PMemAlignment : Port->MemAlignment;
+
+  if (Alignment == 0)
+  {
+    Profile = FindPortProfile(Port->Bus, Port->Device, Port->Function);
+
+    if (Profile != NULL)
+      Alignment = Prefetchable ? Profile->LargestPMemBar : Profile->LargestMemBar;
+  }
+
+  if (Prefetchable)
+  {
+    SolveMmioBudget();
+    Window = MultU64x32(SIZE_1MB, Port->PMemBudgetMB);
+
+    if (Window >= SIZE_1GB)
+      Alignment = MAX(Alignment, SIZE_1GB);
+    else if (Window >= SIZE_2MB)
+      Alignment = MAX(Alignment, SIZE_2MB);
+  }
+
+  return AlignToPowerOfTwo(MAX(Alignment, MIN_PADDING_ALIGNMENT));
+}
+
+/**
+  Work out how much I/O padding a root port should get.
+
+  I/O space is only 64KB and bridges take it in 4KB lumps, so it is only reserved
+  where something behind the port is likely to want it. Worked out once per port,
+  PciBus asks again on every enumeration.
+
+  @param[in]  Port          Root port table entry
+
+  @retval (value)           I/O padding in KB, 0 for none
+**/
+UINT8 GetIoPadding(HOT_PLUG_ROOT_PORT *Port)
+{
+  HOT_PLUG_PORT_PROFILE *Profile;
+  BOOLEAN Elide = FALSE;
+
+  if (Port->IoDecided)
+    return Port->IoBudgetKB;
+
+  Port->IoDecided = TRUE;
+  Port->IoBudgetKB = Port->IoPaddingKB;
+
+  switch (Port->IoPolicy)
+  {
+  case IO_PADDING_NEVER:
+    Elide = TRUE;
+    break;
+
+  case IO_PADDING_AUTO:
+    // Nothing recorded yet (first boot, or the layout changed) means we can't tell. Keep the padding.
+    Profile = FindPortProfile(Port->Bus, Port->Device, Port->Function);
+    Elide = (Profile != NULL && Profile->IoBarCount == 0);
+    break;
+  }
+
+  if (!Elide || Port->IoPaddingKB == 0)
+    return Port->IoPaddingKB;
+
+  mIoPaddingFreedKB += Port->IoPaddingKB;
+  Port->IoBudgetKB = 0;
+
+  DEBUG((DEBUG_INFO, "GetIoPadding : %02X:%02X.%X has no I/O BARs behind it, %u KB of I/O padding dropped (%u KB freed in total)\n",
+         Port->Bus, Port->Device, Port->Function, Port->IoPaddingKB, mIoPaddingFreedKB));
+
+  return 0;
+}
+
+/**
+  Work out how many extra buses SR-IOV devices seen behind the switch's root
+  port on the previous boot need for their VF routing IDs. The VFs sit on the
+  buses below the downstream port their PF is plugged into, so that is the
+  only place they are reserved.
+
+  @retval (value)           Extra buses, 0 if there were no SR-IOV devices
+**/
+UINT8 GetSriovBusPadding()
+{
+  HOT_PLUG_PORT_PROFILE *Profile = FindPortProfile(mRootPorts[0].Bus, mRootPorts[0].Device, mRootPorts[0].Function);
+
+  if (Profile == NULL)
+    return 0;
+
+  return (UINT8)MIN(Profile->VfBuses, PCI_MAX_BUS);
+}
+
+/**
+  Find the SR-IOV extended capability of a device
+
+  @param  PciIo               Device to search
+
+  @retval (value)             Offset of the capability, 0 if not found
+**/
+UINT16 FindSriovCapability(EFI_PCI_IO_PROTOCOL *PciIo)
+{
+  UINT16 Offset = 0x100;
+  UINT32 Header;
+  UINTN Limit;
+
+  for (Limit = 0; Offset >= 0x100 && Limit < 256; Limit++)
+  {
+    if (EFI_ERROR(PciIo->Pci.Read(PciIo, EfiPciIoWidthUint32, Offset, 1, &Header)) || Header == 0 || Header == 0xFFFFFFFF)
+      return 0;
+
+    if ((Header & 0xFFFF) == PCIE_EXT_CAP_ID_SRIOV)
+      return Offset;
+
+    Offset = (UINT16)((Header >> 20) & 0xFFC);
+  }
+
+  return 0;
+}
+
+/**
+  Add what an SR-IOV device's VFs will need once the OS enables them to a
+  port's profile: VF BAR sizes x TotalVFs, and the bus numbers the last VF's
+  routing ID reaches.
+
+  @param  PciIo               Device to check
+  @param  Bus, Device, Function  Location of the device
+  @param  Profile             Profile of the root port the device is behind
+**/
+VOID RecordSriovNeeds(EFI_PCI_IO_PROTOCOL *PciIo, UINTN Bus, UINTN Device, UINTN Function, HOT_PLUG_PORT_PROFILE *Profile)
+{
+  UINT16 Offset;
+  UINT16 TotalVfs;
+  UINT16 FirstOffset;
+  UINT16 Stride;
+  UINT16 Control;
+  UINT16 Quiet;
+  UINT32 Original;
+  UINT32 Mask;
+  UINT32 OriginalUpper;
+  UINT32 MaskUpper;
+  UINT64 BarSize;
+  UINT32 Register;
+  UINTN LastRoutingId;
+  UINTN BarIndex;
+
+  Offset = FindSriovCapability(PciIo);
+
+  if (Offset == 0)
+    return;
+
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint16, Offset + SRIOV_TOTAL_VFS, 1, &TotalVfs);
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint16, Offset + SRIOV_FIRST_VF_OFFSET, 1, &FirstOffset);
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint16, Offset + SRIOV_VF_STRIDE, 1, &Stride);
+
+  if (TotalVfs == 0)
+    return;
+
+  PciIo->Pci.Read(PciIo, EfiPciIoWidthUint16, Offset + SRIOV_CONTROL, 1, &Control);
+
+  // Live VFs could be decoding their BARs, and turning them off would tear them down
+  if (Control & SRIOV_CTL_VF_ENABLE)
+  {
+    DEBUG((DEBUG_WARN, "RecordSriovNeeds : %02X:%02X.%X has VFs enabled already, not sizing them\n", Bus, Device, Function));
+    return;
+  }
+
+  // VF BARs only decode with VF MSE set, keep it off while they hold all-ones
+  Quiet = Control & ~SRIOV_CTL_VF_MSE;
+  PciIo->Pci.Write(PciIo, EfiPciIoWidthUint16, Offset + SRIOV_CONTROL, 1, &Quiet);
+
+  for (BarIndex = 0; BarIndex < PCI_MAX_BAR; BarIndex++)
+  {
+    Register = Offset + SRIOV_VF_BAR0 + (UINT32)BarIndex * 4;
+
+    PciIo->Pci.Read(PciIo, EfiPciIoWidthUint32, Register, 1, &Original);
+    Mask = 0xFFFFFFFF;
+    PciIo->Pci.Write(PciIo, EfiPciIoWidthUint32, Register, 1, &Mask);
+    PciIo->Pci.Read(PciIo, EfiPciIoWidthUint32, Register, 1, &Mask);
+    PciIo->Pci.Write(PciIo, EfiPciIoWidthUint32, Register, 1, &Original);
+
+    if ((Mask & 0xFFFFFFF0) == 0)
+      continue;
+
+    if ((Original & 0x6) == 0x4)
+    {
+      // 64-bit, the upper half lives in the next BAR
+      PciIo->Pci.Read(PciIo, EfiPciIoWidthUint32, Register + 4, 1, &OriginalUpper);
+      MaskUpper = 0xFFFFFFFF;
+      PciIo->Pci.Write(PciIo, EfiPciIoWidthUint32, Register + 4, 1, &MaskUpper);
+      PciIo->Pci.Read(PciIo, EfiPciIoWidthUint32, Register + 4, 1, &MaskUpper);
+      PciIo->Pci.Write(PciIo, EfiPciIoWidthUint32, Register + 4, 1, &OriginalUpper);
+
+      BarSize = ~(LShiftU64(MaskUpper, 32) | (Mask & 0xFFFFFFF0)) + 1;
+      BarIndex++;
+    }
+    else
+    {
+      BarSize = (UINT32)(~(Mask & 0xFFFFFFF0) + 1);
+    }
+
+    if (Original & BIT3)
+      Profile->VfPMem += MultU64x32(BarSize, TotalVfs);
+    else
+      Profile->VfMem += MultU64x32(BarSize, TotalVfs);
+  }
+
+  PciIo->Pci.Write(PciIo, EfiPciIoWidthUint16, Offset + SRIOV_CONTROL, 1, &Control);
+
+  LastRoutingId = ((Bus << 8) | (Device << 3) | Function) + FirstOffset + (UINTN)(TotalVfs - 1) * Stride;
+  Profile->VfBuses = MAX(Profile->VfBuses, (UINT32)((LastRoutingId >> 8) - Bus));
+
+  DEBUG((DEBUG_INFO, "RecordSriovNeeds : %02X:%02X.%X %u VF(s), VF Mem 0x%lx, VF PMem 0x%lx, %u extra bus(es)\n",
+         Bus, Device, Function, TotalVfs, Profile->VfMem, Profile->VfPMem, Profile->VfBuses));
+}
+
+/**
+  Check the windows the host bridge actually granted each root port against the
+  size and alignment asked for in GetResourcePadding().
+
+  @param  PciRootBridgeIo     Root bridge the ports live on
+**/
+VOID CheckGrantedWindows(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo)
+{
+  UINTN Index;
+
+  SolveMmioBudget();
+
+  for (Index = 0; Index < mRootPortCount; Index++)
+  {
+    HOT_PLUG_ROOT_PORT *Port = &mRootPorts[Index];
+    UINT32 MemWindow;
+    UINT32 PMemWindow;
+    UINT32 PMemBaseUpper;
+    UINT32 PMemLimitUpper;
+    UINT64 Base;
+    UINT64 Limit;
+    UINT64 Alignment;
+
+    PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0x20), 1, &MemWindow);
+    PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0x24), 1, &PMemWindow);
+    PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0x28), 1, &PMemBaseUpper);
+    PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0x2C), 1, &PMemLimitUpper);
+
+    Base = (MemWindow & 0xFFF0) << 16;
+    Limit = (MemWindow & 0xFFF00000) | 0xFFFFF;
+    Alignment = GetPaddingAlignment(Port, FALSE);
+
+    if (Limit < Base)
+      DEBUG((DEBUG_ERROR, "CheckGrantedWindows : %02X:%02X.%X has no memory window\n", Port->Bus, Port->Device, Port->Function));
+    else
+      DEBUG((DEBUG_INFO, "CheckGrantedWindows : %02X:%02X.%X Mem 0x%lx-0x%lx, wanted %u MB aligned to 0x%lx: %a\n",
+             Port->Bus, Port->Device, Port->Function, Base, Limit, Port->MemBudgetMB, Alignment,
+             ((Base & (Alignment - 1)) == 0 && (Limit - Base + 1) >= MultU64x32(SIZE_1MB, Port->MemBudgetMB)) ? "OK" : "NOT MET"));
+
+    Base = LShiftU64(PMemBaseUpper, 32) | ((PMemWindow & 0xFFF0) << 16);
+    Limit = LShiftU64(PMemLimitUpper, 32) | (PMemWindow & 0xFFF00000) | 0xFFFFF;
+    Alignment = GetPaddingAlignment(Port, TRUE);
+
+    if (Limit < Base)
+      DEBUG((DEBUG_ERROR, "CheckGrantedWindows : %02X:%02X.%X has no prefetchable window\n", Port->Bus, Port->Device, Port->Function));
+    else
+      DEBUG((DEBUG_INFO, "CheckGrantedWindows : %02X:%02X.%X PMem 0x%lx-0x%lx, wanted %u MB aligned to 0x%lx: %a\n",
+             Port->Bus, Port->Device, Port->Function, Base, Limit, Port->PMemBudgetMB, Alignment,
+             ((Base & (Alignment - 1)) == 0 && (Limit - Base + 1) >= MultU64x32(SIZE_1MB, Port->PMemBudgetMB)) ? "OK" : "NOT MET"));
+  }
+}
+
+/**
+  Write a profile variable, but only if it differs from what is already stored.
+  Nothing changes from one boot to the next unless the devices do, so this saves
+  a flash write on almost every boot.
+
+  @param  Name                Variable name
+  @param  Size                Size of Data in bytes, no more than MAX_PORT_PROFILES profiles
+  @param  Data                New contents
+
+  @retval EFI_SUCCESS         Variable is up to date
+  @retval other               SetVariable() failed
+**/
+EFI_STATUS UpdateProfileVariable(CHAR16 *Name, UINTN Size, VOID *Data)
+{
+  EFI_STATUS Status;
+  HOT_PLUG_PORT_PROFILE Stored[MAX_PORT_PROFILES];
+  UINTN StoredSize = sizeof(Stored);
+
+  Status = gRT->GetVariable(Name, &gHotPlugPortProfileGuid, NULL, &StoredSize, Stored);
+
+  if (!EFI_ERROR(Status) && StoredSize == Size && CompareMem(Stored, Data, Size) == 0)
+  {
+    DEBUG((DEBUG_INFO, "UpdateProfileVariable : %s unchanged\n", Name));
+    return EFI_SUCCESS;
+  }
+
+  return gRT->SetVariable(
+      Name,
+      &gHotPlugPortProfileGuid,
+      EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+      Size,
+      Data);
+}
+
+/**
+  Walk the PCI I/O handles behind each root port and record what they need,
+  for use by the next boot. Devices outside the hot plug hierarchies are
+  totalled up as the fixed MMIO load on the root bridge.
+
+  @param  PciRootBridgeIo     Root bridge the ports live on
+
+  @retval EFI_SUCCESS         Profiles saved
+  @retval other               Something went wrong.
+**/
+EFI_STATUS RecordPortProfiles(EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo)
+{
+  EFI_STATUS Status;
+  HOT_PLUG_PORT_PROFILE Profiles[MAX_PORT_PROFILES];
+  UINT8 SecondaryBus[MAX_PORT_PROFILES];
+  UINT8 SubordinateBus[MAX_PORT_PROFILES];
+  UINTN ProfileCount;
+  UINT64 FixedMmio = 0;
+  UINTN HandleCount;
+  EFI_HANDLE *HandleBuffer;
+  UINTN Index;
+  UINTN HandleIndex;
+  UINT8 BarIndex;
+
+  Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiPciIoProtocolGuid, NULL, &HandleCount, &HandleBuffer);
+
+  if (EFI_ERROR(Status))
+    return Status;
+
+  ZeroMem(Profiles, sizeof(Profiles));
+  ProfileCount = MIN(mRootPortCount, MAX_PORT_PROFILES);
+
+  for (Index = 0; Index < ProfileCount; Index++)
+  {
+    HOT_PLUG_ROOT_PORT *Port = &mRootPorts[Index];
+    UINT32 BusNumbers;
+
+    Profiles[Index].Bus = Port->Bus;
+    Profiles[Index].Device = Port->Device;
+    Profiles[Index].Function = Port->Function;
+    Profiles[Index].Revision = HOT_PLUG_PORT_PROFILE_REVISION;
+
+    PciRootBridgeIo->Pci.Read(PciRootBridgeIo, EfiPciWidthUint32, EFI_PCI_ADDRESS(Port->Bus, Port->Device, Port->Function, 0x18), 1, &BusNumbers);
+
+    SecondaryBus[Index] = (UINT8)(BusNumbers >> 8);
+    SubordinateBus[Index] = (UINT8)(BusNumbers >> 16);
+  }
+
+  for (HandleIndex = 0; HandleIndex < HandleCount; HandleIndex++)
+  {
+    EFI_PCI_IO_PROTOCOL *PciIo;
+    HOT_PLUG_PORT_PROFILE *Profile = NULL;
+    UINTN SegmentNumber;
+    UINTN BusNumber;
+    UINTN DeviceNumber;
+    UINTN FunctionNumber;
+
+    Status = gBS->HandleProtocol(HandleBuffer[HandleIndex], &gEfiPciIoProtocolGuid, (VOID **)&PciIo);
+
+    if (EFI_ERROR(Status))
+      continue;
+
+    PciIo->GetLocation(PciIo, &SegmentNumber, &BusNumber, &DeviceNumber, &FunctionNumber);
+
+    if (SegmentNumber != PciRootBridgeIo->SegmentNumber)
+      continue;
+
+    for (Index = 0; Index < ProfileCount; Index++)
+    {
+      if (SecondaryBus[Index] != 0 && BusNumber >= SecondaryBus[Index] && BusNumber <= SubordinateBus[Index])
+        Profile = &Profiles[Index];
+    }
+
+    if (Profile != NULL)
+      RecordSriovNeeds(PciIo, BusNumber, DeviceNumber, FunctionNumber, Profile);
+
+    for (BarIndex = 0; BarIndex < PCI_MAX_BAR; BarIndex++)
+    {
+      EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptor;
+
+      Status = PciIo->GetBarAttributes(PciIo, BarIndex, NULL, (VOID **)&Descriptor);
+
+      if (EFI_ERROR(Status))
+        continue;
+
+      if (Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR && Descriptor->ResType == ACPI_ADDRESS_SPACE_TYPE_IO)
+      {
+        if (Profile != NULL)
+          Profile->IoBarCount++;
+      }
+      else if (Descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR && Descriptor->ResType == ACPI_ADDRESS_SPACE_TYPE_MEM)
+      {
+        if (Profile == NULL)
+        {
+          if (Descriptor->AddrRangeMin < SIZE_4GB)
+            FixedMmio += Descriptor->AddrLen;
+        }
+        else if ((Descriptor->SpecificFlag & EFI_ACPI_MEMORY_RESOURCE_SPECIFIC_FLAG_CACHEABLE_PREFETCHABLE) != 0)
+        {
+          Profile->LargestPMemBar = MAX(Profile->LargestPMemBar, Descriptor->AddrLen);
+          Profile->TotalPMem += Descriptor->AddrLen;
+        }
+        else
+        {
+          Profile->LargestMemBar = MAX(Profile->LargestMemBar, Descriptor->AddrLen);
+          Profile->TotalMem += Descriptor->AddrLen;
+        }
+      }
+
+      FreePool(Descriptor);
+    }
+  }
+
+  FreePool(HandleBuffer);
+
+  for (Index = 0; Index < ProfileCount; Index++)
+  {
+    DEBUG((DEBUG_INFO, "RecordPortProfiles : %02X:%02X.%X buses 0x%x-0x%x, Mem 0x%lx (largest 0x%lx), PMem 0x%lx (largest 0x%lx), %u I/O BAR(s), VF Mem 0x%lx, VF PMem 0x%lx, %u VF bus(es)\n",
+           Profiles[Index].Bus, Profiles[Index].Device, Profiles[Index].Function, SecondaryBus[Index], SubordinateBus[Index],
+           Profiles[Index].TotalMem, Profiles[Index].LargestMemBar, Profiles[Index].TotalPMem, Profiles[Index].LargestPMemBar,
+           Profiles[Index].IoBarCount, Profiles[Index].VfMem, Profiles[Index].VfPMem, Profiles[Index].VfBuses));
+  }
+
+  DEBUG((DEBUG_INFO, "RecordPortProfiles : Fixed devices use 0x%lx of 32-bit MMIO\n", FixedMmio));
+
+  Status = UpdateProfileVariable(FIXED_MMIO_VARIABLE, sizeof(FixedMmio), &FixedMmio);
+
+  if (EFI_ERROR(Status))
+    DEBUG((DEBUG_WARN, "RecordPortProfiles : Unable to save fixed MMIO: %r\n", Status));
+
+  Status = UpdateProfileVariable(PORT_PROFILE_VARIABLE, ProfileCount * sizeof(HOT_PLUG_PORT_PROFILE), Profiles);
+
+  if (EFI_ERROR(Status))
+    DEBUG((DEBUG_WARN, "RecordPortProfiles : Unable to save port profiles: %r\n", Status));
+
+  return Status;
+}
+
+/**
+  ReadyToBoot notification. Enumeration is long done by now, so check the
+  padding we got and record what is plugged in.
+
+  @param  Event               Event whose notification function is being invoked.
+  @param  Context             Not used.
+**/
+VOID EFIAPI OnReadyToBootRecordProfiles(IN EFI_EVENT Event, IN VOID *Context)
+{
+  EFI_STATUS Status;
+  EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *PciRootBridgeIo;
+
+  gBS->CloseEvent(Event);
+
+  Status = gBS->LocateProtocol(&gEfiPciRootBridgeIoProtocolGuid, NULL, (VOID **)&PciRootBridgeIo);
+
+  if (EFI_ERROR(Status))
+    return;
+
+  CheckGrantedWindows(PciRootBridgeIo);
+  RecordPortProfiles(PciRootBridgeIo);
+}
@@ -0,0 +1,178 @@
+/**
+ * File: PciShimStats.c
+ * Author: Matthew Millman
+ *
+ * UEFI shell application which prints or resets the PciDxeShim statistics.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
+#include <Protocol/ShellParameters.h>
+
+#include "../PciDxeShim/PciShimStats.h"
+
+EFI_GUID gPciShimStatsProtocolGuid = PCI_SHIM_STATS_PROTOCOL_GUID;
+
+GLOBAL_REMOVE_IF_UNREFERENCED CHAR16 *mMethodNames[PCI_SHIM_STAT_METHODS] = {
+  L"PollMem",
+  L"PollIo",
+  L"Mem.Read",
+  L"Mem.Write",
+  L"Io.Read",
+  L"Io.Write",
+  L"CopyMem",
+  L"Pci.Read",
+  L"Pci.Write",
+  L"Map",
+  L"Unmap",
+  L"AllocateBuffer",
+  L"FreeBuffer",
+  L"Flush",
+  L"GetAttributes",
+  L"SetAttributes",
+  L"Configuration",
+  L"NotifyPhase",
+  L"GetNextRootBridge",
+  L"GetAllocAttributes",
+  L"StartBusEnumeration",
+  L"SetBusNumbers",
+  L"SubmitResources",
+  L"GetProposedResources",
+  L"PreprocessController"
+};
+
+GLOBAL_REMOVE_IF_UNREFERENCED CHAR16 *mPhaseNames[] = {
+  L"BeginEnumeration",
+  L"BeginBusAllocation",
+  L"EndBusAllocation",
+  L"BeginResourceAllocation",
+  L"AllocateResources",
+  L"SetResources",
+  L"FreeResources",
+  L"EndResourceAllocation",
+  L"EndEnumeration",
+  L"None yet"
+};
+
+/**
+  Print the statistics as a table, skipping methods which were never called
+
+  @param  Statistics          Copy of the statistics to print
+**/
+VOID PrintStatistics(PCI_SHIM_STATISTICS *Statistics)
+{
+  PCI_SHIM_METHOD_STATS Total;
+  PCI_SHIM_METHOD_STATS *Method;
+  UINTN Index;
+
+  Print(L"Phase:         %s\n", Statistics->Phase < ARRAY_SIZE(mPhaseNames) ? mPhaseNames[Statistics->Phase] : L"Unknown");
+  Print(L"ECAM:          %s\n", Statistics->EcamEnabled ? L"Enabled" : L"Disabled");
+  Print(L"Cache hits:    %lu\n", Statistics->CacheHits);
+  Print(L"Pruned cycles: %lu\n\n", Statistics->PrunedCycles);
+
+  Print(L"%-22s %10s %12s %12s\n", L"Method", L"Calls", L"Bytes", L"Time (us)");
+
+  ZeroMem(&Total, sizeof(Total));
+
+  for (Index = 0; Index < PCI_SHIM_STAT_METHODS; Index++)
+  {
+    Method = &Statistics->Methods[Index];
+
+    if (Method->Calls == 0)
+      continue;
+
+    Print(L"%-22s %10lu %12lu %12lu\n", mMethodNames[Index], Method->Calls, Method->Bytes, Method->Microseconds);
+
+    Total.Calls += Method->Calls;
+    Total.Bytes += Method->Bytes;
+    Total.Microseconds += Method->Microseconds;
+  }
+
+  Print(L"%-22s %10lu %12lu %12lu\n", L"Total", Total.Calls, Total.Bytes, Total.Microseconds);
+}
+
+/**
+  Entry point
+
+  @param  ImageHandle         Handle of this image
+  @param  SystemTable         EFI system table
+
+  @retval EFI_SUCCESS         Done
+  @retval EFI_NOT_FOUND       PciDxeShim isn't loaded
+  @retval other               Something went wrong.
+**/
+EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
+{
+  EFI_STATUS Status;
+  EFI_SHELL_PARAMETERS_PROTOCOL *ShellParameters;
+  PCI_SHIM_STATS_PROTOCOL *Stats;
+  PCI_SHIM_STATISTICS Statistics;
+  BOOLEAN Reset = FALSE;
+
+  Status = gBS->HandleProtocol(ImageHandle, &gEfiShellParametersProtocolGuid, (VOID **)&ShellParameters);
+
+  if (!EFI_ERROR(Status) && ShellParameters->Argc > 1)
+  {
+    if (ShellParameters->Argc == 2 && StrCmp(ShellParameters->Argv[1], L"-r") == 0)
+    {
+      Reset = TRUE;
+    }
+    else
+    {
+      Print(L"Usage: PciShimStats [-r]\n");
+      Print(L"  -r  Reset the counters\n");
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  Status = gBS->LocateProtocol(&gPciShimStatsProtocolGuid, NULL, (VOID **)&Stats);
+
+  if (EFI_ERROR(Status))
+  {
+    Print(L"PciDxeShim isn't loaded: %r\n", Status);
+    return Status;
+  }
+
+  if (Stats->Revision < PCI_SHIM_STATS_PROTOCOL_REVISION)
+  {
+    Print(L"PciDxeShim statistics revision %u, need %u\n", Stats->Revision, PCI_SHIM_STATS_PROTOCOL_REVISION);
+    return EFI_UNSUPPORTED;
+  }
+
+  if (Reset)
+  {
+    Status = Stats->Reset(Stats);
+    Print(L"Statistics reset: %r\n", Status);
+    return Status;
+  }
+
+  Status = Stats->GetStatistics(Stats, &Statistics);
+
+  if (EFI_ERROR(Status))
+  {
+    Print(L"Couldn't get statistics: %r\n", Status);
+    return Status;
+  }
+
+  PrintStatistics(&Statistics);
+
+  return EFI_SUCCESS;
+}
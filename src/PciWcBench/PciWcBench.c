@@ -0,0 +1,204 @@
+/**
+ * File: PciWcBench.c
+ * Author: Matthew Millman
+ *
+ * UEFI shell application which measures MMIO write bandwidth to a framebuffer
+ * uncached and write-combining, to check what PciDxeShim's write-combining
+ * actually buys.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.
+ *
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/DxeServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/BaseLib.h>
+#include <Protocol/ShellParameters.h>
+#include <Protocol/GraphicsOutput.h>
+
+#define BENCH_MAX_BYTES             SIZE_16MB
+#define BENCH_PASSES                4
+#define BENCH_CALIBRATE_US          10000
+
+/**
+  Work out how many TSC ticks there are to a microsecond
+
+  @retval (value)             Ticks per microsecond
+**/
+UINT64 CalibrateTsc()
+{
+  UINT64 Start = AsmReadTsc();
+
+  gBS->Stall(BENCH_CALIBRATE_US);
+
+  return DivU64x32(AsmReadTsc() - Start, BENCH_CALIBRATE_US);
+}
+
+/**
+  Fill a range with 64-bit writes and time it. CPUID is serializing, which
+  drains the WC buffers, and the read after it doesn't complete until the
+  posted writes ahead of it have, so nothing is left in flight when the
+  clock stops.
+
+  @param  Base                Start of the range
+  @param  Length              Size of the range
+  @param  TicksPerUs          From CalibrateTsc()
+
+  @retval (value)             Bandwidth in MB/s
+**/
+UINT64 MeasureWrites(UINT64 Base, UINT64 Length, UINT64 TicksPerUs)
+{
+  volatile UINT64 *Buffer = (volatile UINT64 *)(UINTN)Base;
+  UINTN Count = (UINTN)(Length / sizeof(UINT64));
+  UINT64 Start;
+  UINT64 Microseconds;
+  UINTN Pass;
+  UINTN Index;
+
+  Start = AsmReadTsc();
+
+  for (Pass = 0; Pass < BENCH_PASSES; Pass++)
+  {
+    for (Index = 0; Index < Count; Index++)
+      Buffer[Index] = 0;
+  }
+
+  // MemoryFence() only stops the compiler reordering, it doesn't drain anything
+  AsmCpuid(0, NULL, NULL, NULL, NULL);
+  (VOID)Buffer[Count - 1];
+
+  Microseconds = DivU64x64Remainder(AsmReadTsc() - Start, TicksPerUs, NULL);
+
+  if (Microseconds == 0)
+    return 0;
+
+  return DivU64x64Remainder(MultU64x32(Length, BENCH_PASSES), Microseconds, NULL);
+}
+
+/**
+  Measure a range with one cache type, then put the original attributes back
+
+  @param  Descriptor          GCD entry the range sits in
+  @param  Base                Start of the range
+  @param  Length              Size of the range
+  @param  CacheType           EFI_MEMORY_UC or EFI_MEMORY_WC
+  @param  TicksPerUs          From CalibrateTsc()
+**/
+VOID MeasureWith(EFI_GCD_MEMORY_SPACE_DESCRIPTOR *Descriptor, UINT64 Base, UINT64 Length, UINT64 CacheType, UINT64 TicksPerUs)
+{
+  EFI_STATUS Status;
+  UINT64 Bandwidth;
+
+  if ((Descriptor->Capabilities & CacheType) == 0)
+  {
+    Print(L"%s: not supported by this range\n", CacheType == EFI_MEMORY_WC ? L"WC" : L"UC");
+    return;
+  }
+
+  Status = gDS->SetMemorySpaceAttributes(Base, Length, (Descriptor->Attributes & ~EFI_MEMORY_CACHETYPE_MASK) | CacheType);
+
+  if (EFI_ERROR(Status))
+  {
+    Print(L"%s: couldn't set attributes: %r\n", CacheType == EFI_MEMORY_WC ? L"WC" : L"UC", Status);
+    return;
+  }
+
+  Bandwidth = MeasureWrites(Base, Length, TicksPerUs);
+
+  gDS->SetMemorySpaceAttributes(Base, Length, Descriptor->Attributes);
+
+  Print(L"%s: %lu MB/s\n", CacheType == EFI_MEMORY_WC ? L"WC" : L"UC", Bandwidth);
+}
+
+/**
+  Entry point
+
+  @param  ImageHandle         Handle of this image
+  @param  SystemTable         EFI system table
+
+  @retval EFI_SUCCESS         Done
+  @retval EFI_NOT_FOUND       No framebuffer given and none found
+  @retval other               Something went wrong.
+**/
+EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
+{
+  EFI_STATUS Status;
+  EFI_SHELL_PARAMETERS_PROTOCOL *ShellParameters;
+  EFI_GRAPHICS_OUTPUT_PROTOCOL *GraphicsOutput;
+  EFI_GCD_MEMORY_SPACE_DESCRIPTOR Descriptor;
+  UINT64 Base = 0;
+  UINT64 Length = 0;
+  UINT64 TicksPerUs;
+
+  Status = gBS->HandleProtocol(ImageHandle, &gEfiShellParametersProtocolGuid, (VOID **)&ShellParameters);
+
+  if (!EFI_ERROR(Status) && ShellParameters->Argc > 1)
+  {
+    if (ShellParameters->Argc == 3)
+    {
+      Base = StrHexToUint64(ShellParameters->Argv[1]);
+      Length = StrHexToUint64(ShellParameters->Argv[2]);
+    }
+    else
+    {
+      Print(L"Usage: PciWcBench [Base Length]\n");
+      Print(L"  Base Length  Range to test, in hex. Defaults to the GOP framebuffer\n");
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  if (Length == 0)
+  {
+    Status = gBS->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, NULL, (VOID **)&GraphicsOutput);
+
+    if (EFI_ERROR(Status) || GraphicsOutput->Mode->FrameBufferSize == 0)
+    {
+      Print(L"No framebuffer found: %r\n", EFI_ERROR(Status) ? Status : EFI_NOT_FOUND);
+      return EFI_NOT_FOUND;
+    }
+
+    Base = GraphicsOutput->Mode->FrameBufferBase;
+    Length = GraphicsOutput->Mode->FrameBufferSize;
+  }
+
+  Length = MIN(Length, BENCH_MAX_BYTES) & ~(UINT64)EFI_PAGE_MASK;
+
+  if (Length == 0 || (Base & EFI_PAGE_MASK) != 0)
+  {
+    Print(L"Range has to be page aligned and at least a page\n");
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = gDS->GetMemorySpaceDescriptor(Base, &Descriptor);
+
+  if (EFI_ERROR(Status) || Descriptor.GcdMemoryType != EfiGcdMemoryTypeMemoryMappedIo || Descriptor.BaseAddress + Descriptor.Length < Base + Length)
+  {
+    Print(L"0x%lx-0x%lx isn't within one MMIO range\n", Base, Base + Length - 1);
+    return EFI_INVALID_PARAMETER;
+  }
+
+  TicksPerUs = CalibrateTsc();
+
+  Print(L"Testing 0x%lx-0x%lx, currently %s\n", Base, Base + Length - 1,
+        (Descriptor.Attributes & EFI_MEMORY_WC) != 0 ? L"WC" : (Descriptor.Attributes & EFI_MEMORY_UC) != 0 ? L"UC" : L"other");
+
+  MeasureWith(&Descriptor, Base, Length, EFI_MEMORY_UC, TicksPerUs);
+  MeasureWith(&Descriptor, Base, Length, EFI_MEMORY_WC, TicksPerUs);
+
+  return EFI_SUCCESS;
+}